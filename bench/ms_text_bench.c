@@ -0,0 +1,231 @@
+/*
+ * MSILO module - benchmark and fuzz target of ms_text.c
+ *
+ * Copyright (C) 2001-2003 FhG Fokus
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Built by bench/Makefile. The results are checked against libc first
+ * (strftime, timegm), the benchmark then reports ns per call. With MS_FUZZ
+ * the same checks run as a libFuzzer target.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "ms_text.h"
+
+/* dates outside 1000..9999 are refused by ms_format_sip_date */
+#define MIN_DATE	(-30610224000LL)
+#define MAX_DATE	(253402300799LL)
+
+static int check_sip_date(time_t t)
+{
+	char buf[SIP_DATE_MAX_LEN], ref[SIP_DATE_MAX_LEN];
+	struct tm gmt;
+	int len;
+
+	len = ms_format_sip_date(t, buf);
+	if(t < MIN_DATE || t > MAX_DATE)
+		return len < 0 ? 0 : -1;
+
+	gmtime_r(&t, &gmt);
+	strftime(ref, sizeof(ref), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &gmt);
+	if(len != (int)strlen(ref) || memcmp(buf, ref, len) != 0)
+	{
+		fprintf(stderr, "date %lld: [%.*s] expected [%s]\n",
+				(long long)t, len > 0 ? len : 0, buf, ref);
+		return -1;
+	}
+	return 0;
+}
+
+static int check_time_digits(const char *s, int len)
+{
+	struct tm tm;
+	char d[15];
+	long long v;
+	time_t ref;
+	int ret;
+
+	ret = ms_time_from_digits(s, len, &v);
+	if(ret != 0)
+		return 0;
+
+	/* a valid value padded with zeros, an absent month is January */
+	memset(d, '0', 14);
+	memcpy(d, s, len);
+	d[14] = '\0';
+	memset(&tm, 0, sizeof(tm));
+	sscanf(d, "%4d%2d%2d%2d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+			&tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+	tm.tm_year -= 1900;
+	tm.tm_mon = len > 4 ? tm.tm_mon - 1 : 0;
+	ref = timegm(&tm);
+	if(v != (long long)ref)
+	{
+		fprintf(stderr, "time [%.*s]: %lld expected %lld\n",
+				len, s, v, (long long)ref);
+		return -1;
+	}
+	return 0;
+}
+
+static int check_escape(const char *s, int len, int mode)
+{
+	int dlen = 6 * len + 1;
+	char *dst = malloc(dlen);
+	int i, j, n, ret;
+
+	if(dst == NULL)
+		return 0;
+
+	ret = ms_escape_copy(s, len, dst, dlen, mode);
+	if(ret < 0 || dst[ret] != '\0')
+		goto error;
+
+	/* same as a plain byte by byte escaping */
+	for(i = 0, j = 0; j < len; j++)
+	{
+		unsigned char c = (unsigned char)s[j];
+		char e[7];
+
+		e[0] = '\\';
+		n = 2;
+		if(mode == MS_ESC_SQL ? c != '\'' : c >= 0x20 && c != '"' && c != '\\')
+		{
+			e[0] = c;
+			n = 1;
+		} else if(mode == MS_ESC_SQL || c == '"' || c == '\\') {
+			e[1] = c;
+		} else if(c == '\n' || c == '\r' || c == '\t') {
+			e[1] = c == '\n' ? 'n' : c == '\r' ? 'r' : 't';
+		} else {
+			n = snprintf(e, sizeof(e), "\\u%04x", c);
+		}
+
+		if(i + n > ret || memcmp(dst + i, e, n) != 0)
+			goto error;
+		i += n;
+	}
+	if(i != ret)
+		goto error;
+
+	/* too small a buffer is refused, never overrun */
+	if(ret > 0 && ms_escape_copy(s, len, dst, ret, mode) != -2)
+		goto error;
+
+	free(dst);
+	return 0;
+
+error:
+	fprintf(stderr, "escape mode %d of %d bytes failed\n", mode, len);
+	free(dst);
+	return -1;
+}
+
+#ifdef MS_FUZZ
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	int64_t t = 0;
+
+	if(size >= sizeof(t))
+	{
+		memcpy(&t, data, sizeof(t));
+		if(check_sip_date((time_t)(t % (MAX_DATE + 86400))) < 0)
+			abort();
+	}
+	if(size <= 14 && check_time_digits((const char *)data, (int)size) < 0)
+		abort();
+	if(check_escape((const char *)data, (int)size, MS_ESC_SQL) < 0
+			|| check_escape((const char *)data, (int)size, MS_ESC_JSON) < 0)
+		abort();
+
+	return 0;
+}
+
+#else
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	/* the first three are full length, the benchmark takes them */
+	static const char *times[] = { "20070219184227", "19991231235959",
+		"20240229000000", "2007021918", "200702", "20000100000000" };
+	long n = argc > 1 ? atol(argv[1]) : 1000000;
+	char text[1024], dst[6 * sizeof(text) + 1], date[SIP_DATE_MAX_LEN];
+	long long v, sum = 0;
+	double t0;
+	long i;
+	time_t t;
+
+	for(i = 0; i < (long)sizeof(text); i++)
+		text[i] = "Hello, it's me\t\"again\"\n"[i % 23];
+
+	/* correctness first */
+	for(t = MIN_DATE - 86400; t < MAX_DATE + 86400; t += 86400 * 7 + 3607)
+		if(check_sip_date(t) < 0)
+			return 1;
+	for(i = 0; i < (long)(sizeof(times) / sizeof(times[0])); i++)
+		if(check_time_digits(times[i], strlen(times[i])) < 0)
+			return 1;
+	if(check_escape(text, sizeof(text), MS_ESC_SQL) < 0
+			|| check_escape(text, sizeof(text), MS_ESC_JSON) < 0)
+		return 1;
+
+	t0 = now_ns();
+	for(i = 0; i < n; i++)
+		sum += ms_escape_copy(text, sizeof(text), dst, sizeof(dst), MS_ESC_SQL);
+	printf("ms_escape_copy sql  1k: %8.1f ns\n", (now_ns() - t0) / n);
+
+	t0 = now_ns();
+	for(i = 0; i < n; i++)
+		sum += ms_escape_copy(text, sizeof(text), dst, sizeof(dst), MS_ESC_JSON);
+	printf("ms_escape_copy json 1k: %8.1f ns\n", (now_ns() - t0) / n);
+
+	t0 = now_ns();
+	for(i = 0; i < n; i++)
+	{
+		ms_time_from_digits(times[i % 3], 14, &v);
+		sum += v;
+	}
+	printf("ms_time_from_digits:    %8.1f ns\n", (now_ns() - t0) / n);
+
+	t0 = now_ns();
+	for(i = 0; i < n; i++)
+		sum += ms_format_sip_date((time_t)(1171910547 + i), date);
+	printf("ms_format_sip_date:     %8.1f ns\n", (now_ns() - t0) / n);
+
+	/* keeps the loops from being optimized away */
+	return sum == 42 ? 2 : 0;
+}
+
+#endif
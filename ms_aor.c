@@ -0,0 +1,711 @@
+//
+// Per AoR delivery state in shared memory.
+//
+
+#include "ms_aor.h"
+#include <string.h>
+#include <sys/time.h>
+
+#include "../../mem/mem.h"
+#include "../../mem/shm_mem.h"
+#include "../../dprint.h"
+
+#define MS_AOR_MIN_BUCKETS 64
+#define MS_AOR_MAX_BUCKETS 65536
+
+static unsigned int ms_aor_hash(const str *user, const str *host)
+{
+    unsigned int h = 2166136261u;
+    int i;
+
+    for (i = 0; i < user->len; i++)
+        h = (h ^ (unsigned char)user->s[i]) * 16777619u;
+    h = (h ^ '@') * 16777619u;
+    for (i = 0; i < host->len; i++)
+        h = (h ^ (unsigned char)host->s[i]) * 16777619u;
+
+    return h;
+}
+
+/**
+ * init the table
+ */
+ms_aor_table ms_aor_init(unsigned int buckets)
+{
+    ms_aor_table t = NULL;
+    unsigned int b = MS_AOR_MIN_BUCKETS;
+
+    while (b < buckets && b < MS_AOR_MAX_BUCKETS)
+        b <<= 1;
+
+    t = (ms_aor_table)shm_malloc(sizeof(t_ms_aor_table));
+    if (t == NULL)
+        return NULL;
+    memset(t, 0, sizeof(t_ms_aor_table));
+
+    t->buckets = b;
+    t->aors = (ms_aor*)shm_malloc(b * sizeof(ms_aor));
+    if (t->aors == NULL)
+    {
+        LM_ERR("no more shm for the AoR table\n");
+        goto clean;
+    }
+    memset(t->aors, 0, b * sizeof(ms_aor));
+
+    if (lock_init(&t->lock) == 0)
+    {
+        LM_CRIT("could not initialize a lock\n");
+        goto clean;
+    }
+
+    return t;
+
+clean:
+    if (t->aors)
+        shm_free(t->aors);
+    shm_free(t);
+    return NULL;
+}
+
+static ms_aor ms_aor_find(ms_aor_table t, const str *user, const str *host,
+                          unsigned int hash)
+{
+    ms_aor a = t->aors[hash & (t->buckets - 1)];
+
+    for (; a; a = a->hash_next)
+    {
+        if (a->hash == hash && a->user.len == user->len && a->host.len == host->len
+            && memcmp(a->user.s, user->s, user->len) == 0
+            && memcmp(a->host.s, host->s, host->len) == 0)
+            return a;
+    }
+
+    return NULL;
+}
+
+static void ms_aor_forget_contact(ms_aor a)
+{
+    if (a->contact.s)
+        shm_free(a->contact.s);
+    memset(&a->contact, 0, sizeof(str));
+    memset(&a->received, 0, sizeof(str));
+    memset(&a->path, 0, sizeof(str));
+    a->contact_until = 0;
+}
+
+static void ms_aor_drop(ms_aor_table t, ms_aor a)
+{
+    ms_aor *pp = &t->aors[a->hash & (t->buckets - 1)];
+
+    while (*pp && *pp != a)
+        pp = &(*pp)->hash_next;
+    if (*pp)
+        *pp = a->hash_next;
+
+    if (a->prev)
+        a->prev->next = a->next;
+    else
+        t->head = a->next;
+    if (a->next)
+        a->next->prev = a->prev;
+
+    t->count--;
+    ms_aor_forget_contact(a);
+    shm_free(a);
+}
+
+static long long ms_aor_now_ms(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+// refills the bucket, returns the tokens in 1/1000
+static long long ms_aor_bucket(ms_aor a, const t_ms_rate *r, long long now_ms)
+{
+    long long cap = (long long)r->burst * 1000;
+
+    if (a->bucket_ms == 0)
+        a->tokens = cap;
+    else if (now_ms > a->bucket_ms)
+        a->tokens += (now_ms - a->bucket_ms) * r->rate;
+    if (a->tokens > cap)
+        a->tokens = cap;
+    a->rate = r->rate;
+    a->burst = r->burst;
+    a->bucket_ms = now_ms;
+
+    return a->tokens;
+}
+
+// a full bucket is the same as no bucket
+static int ms_aor_bucket_full(ms_aor a, long long now_ms)
+{
+    return a->bucket_ms == 0
+           || a->tokens + (now_ms - a->bucket_ms) * a->rate >= (long long)a->burst * 1000;
+}
+
+// the pause ended at end
+static void ms_aor_resume(ms_aor_table t, ms_aor a, time_t end)
+{
+    if (a->paused_at != 0)
+    {
+        if (end > a->paused_at)
+            t->paused_s += end - a->paused_at;
+        a->paused_at = 0;
+    }
+    a->unreach_until = 0;
+}
+
+static int ms_aor_idle(ms_aor_table t, ms_aor a, long long now_ms)
+{
+    time_t now = (time_t)(now_ms / 1000);
+
+    if (a->paused_at != 0 && a->unreach_until <= now)
+        ms_aor_resume(t, a, a->unreach_until);
+
+    return !a->paging && a->page_wait <= 0 && a->page_out <= 0
+           && a->inflight <= 0 && a->held == NULL
+           && a->paused_at == 0 && (a->fails == 0 || a->fail_time + t->fail_ttl <= now)
+           && a->contact_until <= now && ms_aor_bucket_full(a, now_ms);
+}
+
+// drops the entry when nothing refers to it any more
+static void ms_aor_release_idle(ms_aor_table t, ms_aor a)
+{
+    if (ms_aor_idle(t, a, ms_aor_now_ms()))
+        ms_aor_drop(t, a);
+}
+
+static ms_aor ms_aor_get(ms_aor_table t, const str *user, const str *host)
+{
+    unsigned int hash = ms_aor_hash(user, host);
+    ms_aor a;
+
+    a = ms_aor_find(t, user, host, hash);
+    if (a)
+        return a;
+
+    a = (ms_aor)shm_malloc(sizeof(t_ms_aor) + user->len + host->len);
+    if (a == NULL)
+    {
+        LM_ERR("no more shm for AoR state\n");
+        return NULL;
+    }
+    memset(a, 0, sizeof(t_ms_aor));
+    a->hash = hash;
+    a->user.s = a->data;
+    a->user.len = user->len;
+    memcpy(a->user.s, user->s, user->len);
+    a->host.s = a->data + user->len;
+    a->host.len = host->len;
+    memcpy(a->host.s, host->s, host->len);
+
+    a->hash_next = t->aors[hash & (t->buckets - 1)];
+    t->aors[hash & (t->buckets - 1)] = a;
+    a->next = t->head;
+    if (t->head)
+        t->head->prev = a;
+    t->head = a;
+    t->count++;
+
+    return a;
+}
+
+/**
+ * start a paginated dump of the AoR, batch is kept for the next pages;
+ * page gets the entry the queued messages are counted on
+ * - MS_AOR_EXIST if one is already running
+ */
+int ms_aor_page_begin(ms_aor_table t, str *user, str *host, int batch, time_t now,
+                      ms_aor *page)
+{
+    ms_aor a;
+
+    lock_get(&t->lock);
+    a = ms_aor_get(t, user, host);
+    if (a == NULL)
+    {
+        lock_release(&t->lock);
+        return MS_AOR_ERR;
+    }
+    if (a->paging)
+    {
+        lock_release(&t->lock);
+        return MS_AOR_EXIST;
+    }
+
+    a->paging = 1;
+    a->page_wait++;
+    a->page_time = now;
+    a->watermark = 0;
+    a->batch = batch;
+    *page = a;
+
+    lock_release(&t->lock);
+    return MS_AOR_OK;
+}
+
+/**
+ * record the page of n messages just queued for a, it ends the wait
+ * ms_aor_page_begin() or ms_aor_page_due() started; last ends the dump
+ */
+int ms_aor_page_set(ms_aor_table t, ms_aor a, t_msg_mid watermark, int n,
+                    int last, time_t now)
+{
+    lock_get(&t->lock);
+    // counted even if a failure stopped the dump meanwhile, the messages
+    // are queued and point to the entry
+    a->page_out += n;
+    a->page_wait--;
+    if (last || !a->paging)
+    {
+        a->paging = 0;
+        ms_aor_release_idle(t, a);
+        lock_release(&t->lock);
+        return MS_AOR_OK;
+    }
+
+    if (watermark > a->watermark)
+        a->watermark = watermark;
+    a->page_time = now;
+
+    lock_release(&t->lock);
+    return MS_AOR_OK;
+}
+
+/**
+ * a message of a page of a left the queue, delivered or dropped
+ */
+void ms_aor_page_settled(ms_aor_table t, ms_aor a)
+{
+    lock_get(&t->lock);
+    a->page_out--;
+    if (a->page_out <= 0)
+        ms_aor_release_idle(t, a);
+    lock_release(&t->lock);
+}
+
+/**
+ * collect up to max AoRs whose queued messages all settled, or whose
+ * page is older than timeout seconds
+ */
+int ms_aor_page_due(ms_aor_table t, time_t now, int timeout, ms_aor_due due,
+                    int max, ms_arena ar)
+{
+    ms_aor a;
+    char *s;
+    int n = 0;
+
+    lock_get(&t->lock);
+    for (a = t->head; a && n < max; a = a->next)
+    {
+        if (!a->paging)
+            continue;
+        if (a->page_wait > 0
+                || (a->page_out > 0 && a->page_time + timeout > now))
+            continue;
+
+        s = ms_arena_alloc(ar, a->user.len + a->host.len);
+        if (s == NULL)
+            break;
+
+        due[n].user.s = s;
+        due[n].user.len = a->user.len;
+        memcpy(s, a->user.s, a->user.len);
+        due[n].host.s = s + a->user.len;
+        due[n].host.len = a->host.len;
+        memcpy(due[n].host.s, a->host.s, a->host.len);
+        due[n].watermark = a->watermark;
+        due[n].batch = a->batch;
+        due[n].aor = a;
+
+        // pinned, and not due again, until the next page is set
+        a->page_wait++;
+        a->page_time = now;
+        n++;
+    }
+    lock_release(&t->lock);
+
+    return n;
+}
+
+/**
+ * take a window slot of the AoR for el, window <= 0 - no limit
+ * - MS_AOR_HELD if the window is full, the AoR keeps el then
+ */
+int ms_aor_win_acquire(ms_aor_table t, str *user, str *host, retry_list_el el,
+                       int window)
+{
+    retry_list_el *pp;
+    ms_aor a;
+
+    lock_get(&t->lock);
+    a = ms_aor_get(t, user, host);
+    if (a == NULL)
+    {
+        lock_release(&t->lock);
+        return MS_AOR_ERR;
+    }
+
+    // held messages are only waiting for a full window to drain
+    if ((window <= 0 || a->inflight < window) && a->held == NULL)
+    {
+        a->inflight++;
+        el->aor = a;
+        lock_release(&t->lock);
+        return MS_AOR_OK;
+    }
+
+    for (pp = &a->held; *pp && (*pp)->msgid < el->msgid; pp = &(*pp)->next)
+        ;
+    el->aor = a;
+    el->prev = NULL;
+    el->next = *pp;
+    *pp = el;
+    a->held_n++;
+
+    lock_release(&t->lock);
+    return MS_AOR_HELD;
+}
+
+/**
+ * a message of the AoR left the window; resend, if given, is held again
+ * returns the held message that takes over the slot, or NULL
+ */
+retry_list_el ms_aor_win_release(ms_aor_table t, ms_aor a, retry_list_el resend)
+{
+    retry_list_el *pp, el = NULL;
+
+    lock_get(&t->lock);
+
+    if (resend)
+    {
+        for (pp = &a->held; *pp && (*pp)->msgid < resend->msgid; pp = &(*pp)->next)
+            ;
+        resend->aor = a;
+        resend->prev = NULL;
+        resend->next = *pp;
+        *pp = resend;
+        a->held_n++;
+    }
+
+    if (a->held)
+    {
+        el = a->held;
+        a->held = el->next;
+        a->held_n--;
+        el->next = NULL;
+    }
+    else
+    {
+        a->inflight--;
+        ms_aor_release_idle(t, a);
+    }
+
+    lock_release(&t->lock);
+    return el;
+}
+
+/**
+ * take out the messages held by all the windows, at shutdown
+ * returns them linked by prev, NULL if none
+ */
+retry_list_el ms_aor_held_reset(ms_aor_table t)
+{
+    retry_list_el p_ret = NULL, p_last = NULL, el;
+    ms_aor a;
+
+    lock_get(&t->lock);
+    for (a = t->head; a; a = a->next)
+    {
+        while ((el = a->held) != NULL)
+        {
+            a->held = el->next;
+            el->aor = NULL;
+            el->next = p_last;
+            el->prev = NULL;
+            if (p_last)
+                p_last->prev = el;
+            else
+                p_ret = el;
+            p_last = el;
+        }
+        a->held_n = 0;
+    }
+    lock_release(&t->lock);
+
+    return p_ret;
+}
+
+/**
+ * take a token from the buckets of the AoR and of its domain
+ * - MS_AOR_DEFER and *wait_ms until the emptier one has a token
+ */
+int ms_aor_rate_take(ms_aor_table t, str *user, str *host, const t_ms_rate *aor,
+                     const t_ms_rate *domain, long long *wait_ms)
+{
+    str none = {"", 0};
+    long long now_ms = ms_aor_now_ms();
+    long long wait = 0, w;
+    ms_aor a = NULL, d = NULL;
+
+    lock_get(&t->lock);
+    if (aor->rate > 0 && (a = ms_aor_get(t, user, host)) != NULL)
+    {
+        w = 1000 - ms_aor_bucket(a, aor, now_ms);
+        if (w > 0)
+            wait = (w + aor->rate - 1) / aor->rate;
+    }
+    if (domain->rate > 0 && (d = ms_aor_get(t, &none, host)) != NULL)
+    {
+        w = 1000 - ms_aor_bucket(d, domain, now_ms);
+        if (w > 0 && (w + domain->rate - 1) / domain->rate > wait)
+            wait = (w + domain->rate - 1) / domain->rate;
+    }
+
+    // both or none
+    if (wait == 0)
+    {
+        if (a)
+            a->tokens -= 1000;
+        if (d)
+            d->tokens -= 1000;
+    }
+    lock_release(&t->lock);
+
+    *wait_ms = wait;
+    return wait > 0 ? MS_AOR_DEFER : MS_AOR_OK;
+}
+
+/**
+ * drop the idle entries whose buckets refilled
+ */
+void ms_aor_sweep(ms_aor_table t)
+{
+    long long now_ms = ms_aor_now_ms();
+    ms_aor a, next;
+
+    if (t == NULL)
+        return;
+
+    lock_get(&t->lock);
+    for (a = t->head; a; a = next)
+    {
+        next = a->next;
+        if (ms_aor_idle(t, a, now_ms))
+            ms_aor_drop(t, a);
+    }
+    lock_release(&t->lock);
+}
+
+/**
+ * a delivery to the AoR failed, pause forces the pause, otherwise the AoR
+ * pauses at failures consecutive ones (0 - never); until the time given or
+ * its next dump, its paginated dump stops
+ * - MS_AOR_PAUSED and *held the held messages, the caller owns them
+ */
+int ms_aor_failed(ms_aor_table t, ms_aor a, int pause, int failures, time_t until,
+                  retry_list_el *held)
+{
+    time_t now = time(NULL);
+
+    *held = NULL;
+    lock_get(&t->lock);
+    a->fails++;
+    a->fail_time = now;
+    if (!pause && (failures <= 0 || a->fails < failures))
+    {
+        lock_release(&t->lock);
+        return MS_AOR_OK;
+    }
+
+    if (a->paused_at == 0)
+    {
+        a->paused_at = now;
+        t->pauses++;
+    }
+    if (until > a->unreach_until)
+        a->unreach_until = until;
+    a->paging = 0;
+    *held = a->held;
+    a->held = NULL;
+    a->held_n = 0;
+    lock_release(&t->lock);
+
+    return MS_AOR_PAUSED;
+}
+
+/**
+ * a message was delivered to the AoR
+ */
+void ms_aor_succeeded(ms_aor_table t, ms_aor a)
+{
+    lock_get(&t->lock);
+    a->fails = 0;
+    lock_release(&t->lock);
+}
+
+/**
+ * non zero while the AoR is paused
+ */
+int ms_aor_unreachable(ms_aor_table t, str *user, str *host, time_t now)
+{
+    ms_aor a;
+    int ret;
+
+    lock_get(&t->lock);
+    a = ms_aor_find(t, user, host, ms_aor_hash(user, host));
+    ret = a != NULL && a->unreach_until > now;
+    if (a != NULL && !ret && a->paused_at != 0)
+        ms_aor_resume(t, a, a->unreach_until);
+    lock_release(&t->lock);
+
+    return ret;
+}
+
+/**
+ * the AoR registered again, its pause ends
+ */
+void ms_aor_reachable(ms_aor_table t, str *user, str *host)
+{
+    ms_aor a;
+
+    lock_get(&t->lock);
+    a = ms_aor_find(t, user, host, ms_aor_hash(user, host));
+    if (a != NULL && a->paused_at != 0)
+    {
+        ms_aor_resume(t, a, time(NULL));
+        ms_aor_release_idle(t, a);
+    }
+    lock_release(&t->lock);
+}
+
+/**
+ * number of pauses and the time the finished ones took, seconds
+ */
+void ms_aor_pause_stats(ms_aor_table t, long *pauses, long long *paused_s)
+{
+    lock_get(&t->lock);
+    *pauses = t->pauses;
+    *paused_s = t->paused_s;
+    lock_release(&t->lock);
+}
+
+/**
+ * keep the contact the AoR registered until until, NULL contact forgets it
+ */
+int ms_aor_set_contact(ms_aor_table t, str *user, str *host, str *contact,
+                       str *received, str *path, time_t until)
+{
+    ms_aor a;
+    char *s = NULL;
+
+    if (contact != NULL)
+    {
+        s = (char*)shm_malloc(contact->len + received->len + path->len);
+        if (s == NULL)
+        {
+            LM_ERR("no more shm for the contact\n");
+            return MS_AOR_ERR;
+        }
+    }
+
+    lock_get(&t->lock);
+    a = contact != NULL ? ms_aor_get(t, user, host)
+                        : ms_aor_find(t, user, host, ms_aor_hash(user, host));
+    if (a == NULL)
+    {
+        lock_release(&t->lock);
+        if (s)
+            shm_free(s);
+        return contact != NULL ? MS_AOR_ERR : MS_AOR_OK;
+    }
+
+    ms_aor_forget_contact(a);
+    if (contact == NULL)
+    {
+        ms_aor_release_idle(t, a);
+        lock_release(&t->lock);
+        return MS_AOR_OK;
+    }
+
+    a->contact.s = s;
+    a->contact.len = contact->len;
+    memcpy(s, contact->s, contact->len);
+    a->received.s = s + contact->len;
+    a->received.len = received->len;
+    memcpy(a->received.s, received->s, received->len);
+    a->path.s = a->received.s + received->len;
+    a->path.len = path->len;
+    memcpy(a->path.s, path->s, path->len);
+    a->contact_until = until;
+
+    lock_release(&t->lock);
+    return MS_AOR_OK;
+}
+
+/**
+ * copy the registered contact of the AoR into the arena
+ * - MS_AOR_ERR if there is none or it expired by now
+ */
+int ms_aor_get_contact(ms_aor_table t, str *user, str *host, time_t now,
+                       str *contact, str *received, str *path, ms_arena ar)
+{
+    ms_aor a;
+    char *s;
+    int ret = MS_AOR_ERR;
+
+    lock_get(&t->lock);
+    a = ms_aor_find(t, user, host, ms_aor_hash(user, host));
+    if (a == NULL || a->contact_until <= now)
+        goto done;
+
+    s = ms_arena_alloc(ar, a->contact.len + a->received.len + a->path.len);
+    if (s == NULL)
+        goto done;
+
+    contact->s = s;
+    contact->len = a->contact.len;
+    memcpy(s, a->contact.s, a->contact.len);
+    received->s = s + a->contact.len;
+    received->len = a->received.len;
+    memcpy(received->s, a->received.s, a->received.len);
+    path->s = received->s + a->received.len;
+    path->len = a->path.len;
+    memcpy(path->s, a->path.s, a->path.len);
+    ret = MS_AOR_OK;
+
+done:
+    lock_release(&t->lock);
+    return ret;
+}
+
+/**
+ * destroy the table
+ */
+void ms_aor_free(ms_aor_table t)
+{
+    ms_aor a, next;
+    retry_list_el el;
+
+    if (t == NULL)
+        return;
+
+    for (a = t->head; a; a = next)
+    {
+        next = a->next;
+        while ((el = a->held) != NULL)
+        {
+            a->held = el->next;
+            retry_list_el_free(el);
+        }
+        ms_aor_forget_contact(a);
+        shm_free(a);
+    }
+    lock_destroy(&t->lock);
+    shm_free(t->aors);
+    shm_free(t);
+}
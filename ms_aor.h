@@ -0,0 +1,148 @@
+//
+// Per AoR delivery state in shared memory.
+//
+// A paginated dump queues the stored messages of an AoR one page at a time:
+// m_dump() queues the first page and the sender process queues the next one
+// (id > watermark) only after every message of the current page reached a
+// final state.
+//
+// The window bounds the MESSAGE transactions outstanding to the AoR. A
+// message over the window is held, in id order, and released by the reply
+// of an earlier one, which hands its slot over. Every message sent takes
+// a slot, the window only limits them when set.
+//
+// Delivery to an AoR pauses when a message fails as unreachable or after
+// a run of consecutive failures (circuit breaker). A paused AoR is not
+// sent to until its next dump or until the pause time passes; the failure
+// count survives the pause so the first failure after it pauses again.
+//
+// Token buckets limit the sending rate per AoR and per domain; the domain
+// bucket lives in an entry with an empty user.
+//
+// The MESSAGE capable contact of the REGISTER that dumped the AoR is kept
+// until the registration expires, the sender delivers to it directly.
+//
+// Entries exist while a dump of the AoR is running, messages are in flight
+// or held, a bucket is still refilling, the AoR is paused or failed
+// recently, or its contact is registered.
+//
+
+#ifndef OPENSIPS_1_11_2_TLS_MS_AOR_H
+#define OPENSIPS_1_11_2_TLS_MS_AOR_H
+
+#include <time.h>
+#include "../../str.h"
+#include "../../locking.h"
+#include "msilo.h"
+#include "ms_arena.h"
+#include "msg_retry.h"
+
+#define MS_AOR_OK      0
+#define MS_AOR_ERR    -1
+#define MS_AOR_EXIST   1
+#define MS_AOR_HELD    2
+#define MS_AOR_DEFER   3
+#define MS_AOR_PAUSED  4
+
+#define MS_AOR_PAGE_MAX 64
+
+typedef struct _ms_aor
+{
+    unsigned int hash;
+    str user;
+    str host;
+
+    int paging;             // a paginated dump is running
+    int page_wait;          // pages being queued, each pins the entry
+    time_t page_time;       // when the current page was queued
+    t_msg_mid watermark;    // highest id the dump has passed
+    int page_out;           // queued messages of the pages not settled yet
+    int batch;              // messages per MESSAGE the UA takes
+
+    int inflight;           // window slots taken
+    int held_n;
+    retry_list_el held;     // over the window, ordered by id
+
+    int rate;               // bucket refill, tokens per second
+    int burst;
+    long long tokens;       // in 1/1000 of a token
+    long long bucket_ms;    // last refill, 0 - no bucket
+
+    time_t unreach_until;   // queued messages wait for the next dump
+    time_t paused_at;
+    int fails;              // consecutive failed deliveries
+    time_t fail_time;
+
+    str contact;            // one shm block with received and path
+    str received;           // where the contact is reached, if NATed
+    str path;               // Path of the REGISTER
+    time_t contact_until;
+
+    struct _ms_aor * hash_next;
+    struct _ms_aor * next;  // all entries, walked by the sender
+    struct _ms_aor * prev;
+    char data[];
+} t_ms_aor, *ms_aor;
+
+typedef struct _ms_aor_table
+{
+    unsigned int buckets;  // power of two
+    ms_aor * aors;
+    ms_aor head;
+    long count;
+    int fail_ttl;          // seconds a failure count is kept for
+    long pauses;
+    long long paused_s;    // total time of the finished pauses
+    gen_lock_t lock;
+} t_ms_aor_table, *ms_aor_table;
+
+// AoR whose page is finished, strings are in the caller's arena
+typedef struct _ms_aor_due
+{
+    str user;
+    str host;
+    t_msg_mid watermark;
+    int batch;
+    ms_aor aor;             // counts the messages of the next page
+} t_ms_aor_due, *ms_aor_due;
+
+typedef struct _ms_rate
+{
+    int rate;   // messages per second, 0 - no limit
+    int burst;
+} t_ms_rate;
+
+
+ms_aor_table ms_aor_init(unsigned int buckets);
+void ms_aor_free(ms_aor_table t);
+
+int ms_aor_page_begin(ms_aor_table t, str *user, str *host, int batch, time_t now,
+                      ms_aor *page);
+int ms_aor_page_set(ms_aor_table t, ms_aor a, t_msg_mid watermark, int n,
+                    int last, time_t now);
+void ms_aor_page_settled(ms_aor_table t, ms_aor a);
+int ms_aor_page_due(ms_aor_table t, time_t now, int timeout, ms_aor_due due,
+                    int max, ms_arena a);
+
+int ms_aor_win_acquire(ms_aor_table t, str *user, str *host, retry_list_el el,
+                       int window);
+retry_list_el ms_aor_win_release(ms_aor_table t, ms_aor a, retry_list_el resend);
+retry_list_el ms_aor_held_reset(ms_aor_table t);
+
+int ms_aor_rate_take(ms_aor_table t, str *user, str *host, const t_ms_rate *aor,
+                     const t_ms_rate *domain, long long *wait_ms);
+void ms_aor_sweep(ms_aor_table t);
+
+int ms_aor_failed(ms_aor_table t, ms_aor a, int pause, int failures, time_t until,
+                  retry_list_el *held);
+void ms_aor_succeeded(ms_aor_table t, ms_aor a);
+int ms_aor_unreachable(ms_aor_table t, str *user, str *host, time_t now);
+void ms_aor_reachable(ms_aor_table t, str *user, str *host);
+void ms_aor_pause_stats(ms_aor_table t, long *pauses, long long *paused_s);
+
+int ms_aor_set_contact(ms_aor_table t, str *user, str *host, str *contact,
+                       str *received, str *path, time_t until);
+int ms_aor_get_contact(ms_aor_table t, str *user, str *host, time_t now,
+                       str *contact, str *received, str *path, ms_arena a);
+
+#endif //OPENSIPS_1_11_2_TLS_MS_AOR_H
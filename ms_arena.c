@@ -0,0 +1,160 @@
+//
+// Bump allocator in pkg memory for message assembly.
+//
+
+#include "ms_arena.h"
+#include <string.h>
+
+#include "../../mem/mem.h"
+#include "../../dprint.h"
+
+static ms_arena_chunk ms_arena_chunk_new(size_t size)
+{
+    ms_arena_chunk c = (ms_arena_chunk)pkg_malloc(sizeof(t_ms_arena_chunk) + size);
+    if(c == NULL)
+        return NULL;
+
+    c->next = NULL;
+    c->size = size;
+    c->used = 0;
+    return c;
+}
+
+static void ms_arena_chunk_free_all(ms_arena_chunk c)
+{
+    ms_arena_chunk p;
+
+    while(c)
+    {
+        p = c;
+        c = c->next;
+        pkg_free(p);
+    }
+}
+
+/**
+ * take the smallest pooled chunk that can hold size bytes
+ */
+static ms_arena_chunk ms_arena_pool_take(ms_arena a, size_t size)
+{
+    ms_arena_chunk p0, p1 = NULL, best = NULL, best_prev = NULL;
+
+    for(p0 = a->pool; p0; p1 = p0, p0 = p0->next)
+    {
+        if(p0->size >= size && (best == NULL || p0->size < best->size))
+        {
+            best = p0;
+            best_prev = p1;
+        }
+    }
+
+    if(best == NULL)
+        return NULL;
+
+    if(best_prev)
+        best_prev->next = best->next;
+    else
+        a->pool = best->next;
+
+    best->next = NULL;
+    best->used = 0;
+    return best;
+}
+
+/**
+ * init an arena, chunks are allocated lazily
+ */
+int ms_arena_init(ms_arena a, size_t chunk_size, size_t keep_size)
+{
+    if(!a || chunk_size == 0)
+        return -1;
+
+    a->chunk_size = chunk_size;
+    a->keep_size = keep_size;
+    a->head = NULL;
+    a->pool = NULL;
+    return 0;
+}
+
+/**
+ * free all chunks
+ */
+void ms_arena_destroy(ms_arena a)
+{
+    if(!a)
+        return;
+
+    ms_arena_chunk_free_all(a->head);
+    ms_arena_chunk_free_all(a->pool);
+    a->head = NULL;
+    a->pool = NULL;
+}
+
+/**
+ * reserve size bytes, valid until the next reset.
+ * Requests larger than the chunk size get a dedicated chunk.
+ */
+char * ms_arena_alloc(ms_arena a, size_t size)
+{
+    ms_arena_chunk c;
+    char * ret;
+
+    if(!a || size == 0)
+        return NULL;
+
+    size = (size + MS_ARENA_ALIGN - 1) & ~((size_t)MS_ARENA_ALIGN - 1);
+
+    c = a->head;
+    if(c == NULL || c->size - c->used < size)
+    {
+        c = ms_arena_pool_take(a, size);
+        if(c == NULL)
+            c = ms_arena_chunk_new(size > a->chunk_size ? size : a->chunk_size);
+        if(c == NULL)
+        {
+            LM_ERR("no more pkg memory for %lu bytes\n", (unsigned long)size);
+            return NULL;
+        }
+
+        c->next = a->head;
+        a->head = c;
+    }
+
+    ret = c->data + c->used;
+    c->used += size;
+    return ret;
+}
+
+/**
+ * release everything reserved so far. Chunks go back to the pool while it
+ * stays under keep_size bytes, the rest is returned to pkg memory.
+ */
+void ms_arena_reset(ms_arena a)
+{
+    ms_arena_chunk p0, p1;
+    size_t kept = 0;
+
+    if(!a)
+        return;
+
+    for(p0 = a->pool; p0; p0 = p0->next)
+        kept += p0->size;
+
+    p0 = a->head;
+    a->head = NULL;
+    while(p0)
+    {
+        p1 = p0;
+        p0 = p0->next;
+        if(kept + p1->size > a->keep_size)
+        {
+            pkg_free(p1);
+            continue;
+        }
+
+        kept += p1->size;
+        p1->used = 0;
+        p1->next = a->pool;
+        a->pool = p1;
+    }
+}
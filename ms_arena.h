@@ -0,0 +1,37 @@
+//
+// Bump allocator in pkg memory used to assemble outgoing messages. Every
+// process has its own arena; everything reserved from it is released at
+// once by ms_arena_reset() when the batch (or request) is done. Chunks are
+// pooled across resets up to keep_size bytes so that large messages do not
+// hit pkg_malloc each time.
+//
+
+#ifndef OPENSIPS_1_11_2_TLS_MS_ARENA_H
+#define OPENSIPS_1_11_2_TLS_MS_ARENA_H
+
+#include <stddef.h>
+
+#define MS_ARENA_ALIGN 8
+
+typedef struct _ms_arena_chunk
+{
+    struct _ms_arena_chunk * next;
+    size_t size;
+    size_t used;
+    char data[];
+} t_ms_arena_chunk, *ms_arena_chunk;
+
+typedef struct _ms_arena
+{
+    size_t chunk_size;
+    size_t keep_size;
+    ms_arena_chunk head;  // chunks in use, head is the current one
+    ms_arena_chunk pool;  // released chunks kept for reuse
+} t_ms_arena, *ms_arena;
+
+int ms_arena_init(ms_arena a, size_t chunk_size, size_t keep_size);
+void ms_arena_destroy(ms_arena a);
+char * ms_arena_alloc(ms_arena a, size_t size);
+void ms_arena_reset(ms_arena a);
+
+#endif //OPENSIPS_1_11_2_TLS_MS_ARENA_H
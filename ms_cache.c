@@ -0,0 +1,586 @@
+//
+// Write-through cache of stored messages in shared memory.
+//
+
+#include "ms_cache.h"
+#include <string.h>
+
+#include "../../mem/mem.h"
+#include "../../mem/shm_mem.h"
+#include "../../dprint.h"
+
+#define MS_CACHE_MIN_BUCKETS 256
+#define MS_CACHE_MAX_BUCKETS 65536
+// expected average size of a cached message, used to size the hash tables
+#define MS_CACHE_AVG_MSG 512
+
+static unsigned int ms_cache_aor_hash(const str *user, const str *host)
+{
+    unsigned int h = 2166136261u;
+    int i;
+
+    for (i = 0; i < user->len; i++)
+        h = (h ^ (unsigned char)user->s[i]) * 16777619u;
+    h = (h ^ '@') * 16777619u;
+    for (i = 0; i < host->len; i++)
+        h = (h ^ (unsigned char)host->s[i]) * 16777619u;
+
+    return h;
+}
+
+static inline unsigned int ms_cache_mid_slot(ms_cache c, t_msg_mid mid)
+{
+    return (unsigned int)(((unsigned long long)mid * 0x9E3779B97F4A7C15ull) >> 32)
+           & (c->mid_buckets - 1);
+}
+
+static unsigned int ms_cache_buckets(size_t n)
+{
+    unsigned int b = MS_CACHE_MIN_BUCKETS;
+    while (b < n && b < MS_CACHE_MAX_BUCKETS)
+        b <<= 1;
+    return b;
+}
+
+/**
+ * init the cache, max_bytes bounds the shm used by cached entries
+ */
+ms_cache ms_cache_init(size_t max_bytes)
+{
+    ms_cache c = NULL;
+
+    c = (ms_cache)shm_malloc(sizeof(t_ms_cache));
+    if (c == NULL)
+        return NULL;
+    memset(c, 0, sizeof(t_ms_cache));
+
+    c->max_bytes = max_bytes;
+    c->mid_buckets = ms_cache_buckets(max_bytes / MS_CACHE_AVG_MSG);
+    c->aor_buckets = c->mid_buckets;
+
+    c->aors = (ms_cache_aor*)shm_malloc(c->aor_buckets * sizeof(ms_cache_aor));
+    c->mids = (ms_cache_msg*)shm_malloc(c->mid_buckets * sizeof(ms_cache_msg));
+    if (c->aors == NULL || c->mids == NULL)
+    {
+        LM_ERR("no more shm for cache tables\n");
+        goto clean;
+    }
+    memset(c->aors, 0, c->aor_buckets * sizeof(ms_cache_aor));
+    memset(c->mids, 0, c->mid_buckets * sizeof(ms_cache_msg));
+
+    if (lock_init(&c->lock) == 0)
+    {
+        LM_CRIT("could not initialize a lock\n");
+        goto clean;
+    }
+
+    return c;
+
+clean:
+    if (c->aors)
+        shm_free(c->aors);
+    if (c->mids)
+        shm_free(c->mids);
+    shm_free(c);
+    return NULL;
+}
+
+static void ms_cache_lru_unlink(ms_cache c, ms_cache_aor a)
+{
+    if (a->lru_prev)
+        a->lru_prev->lru_next = a->lru_next;
+    else
+        c->lru_head = a->lru_next;
+    if (a->lru_next)
+        a->lru_next->lru_prev = a->lru_prev;
+    else
+        c->lru_tail = a->lru_prev;
+    a->lru_prev = a->lru_next = NULL;
+}
+
+static void ms_cache_lru_touch(ms_cache c, ms_cache_aor a)
+{
+    if (c->lru_tail == a)
+        return;
+    if (a->lru_prev || a->lru_next || c->lru_head == a)
+        ms_cache_lru_unlink(c, a);
+
+    a->lru_prev = c->lru_tail;
+    a->lru_next = NULL;
+    if (c->lru_tail)
+        c->lru_tail->lru_next = a;
+    else
+        c->lru_head = a;
+    c->lru_tail = a;
+}
+
+static ms_cache_aor ms_cache_aor_find(ms_cache c, const str *user, const str *host,
+                                      unsigned int hash)
+{
+    ms_cache_aor a = c->aors[hash & (c->aor_buckets - 1)];
+
+    for (; a; a = a->hash_next)
+    {
+        if (a->hash == hash && a->user.len == user->len && a->host.len == host->len
+            && memcmp(a->user.s, user->s, user->len) == 0
+            && memcmp(a->host.s, host->s, host->len) == 0)
+            return a;
+    }
+
+    return NULL;
+}
+
+static ms_cache_msg ms_cache_msg_find(ms_cache c, t_msg_mid mid)
+{
+    ms_cache_msg m = c->mids[ms_cache_mid_slot(c, mid)];
+
+    while (m && m->mid != mid)
+        m = m->mid_next;
+
+    return m;
+}
+
+/**
+ * unlink a message from its AoR and the mid table and free it
+ */
+static void ms_cache_msg_drop(ms_cache c, ms_cache_msg m)
+{
+    ms_cache_msg *pp = &c->mids[ms_cache_mid_slot(c, m->mid)];
+    ms_cache_aor a = m->aor;
+
+    while (*pp && *pp != m)
+        pp = &(*pp)->mid_next;
+    if (*pp)
+        *pp = m->mid_next;
+
+    if (m->aor_prev)
+        m->aor_prev->aor_next = m->aor_next;
+    else
+        a->head = m->aor_next;
+    if (m->aor_next)
+        m->aor_next->aor_prev = m->aor_prev;
+    else
+        a->tail = m->aor_prev;
+
+    a->count--;
+    c->used_bytes -= m->size;
+    shm_free(m);
+}
+
+/**
+ * remove an AoR with all its messages
+ */
+static void ms_cache_aor_drop(ms_cache c, ms_cache_aor a)
+{
+    ms_cache_aor *pp = &c->aors[a->hash & (c->aor_buckets - 1)];
+
+    while (a->head)
+        ms_cache_msg_drop(c, a->head);
+
+    while (*pp && *pp != a)
+        pp = &(*pp)->hash_next;
+    if (*pp)
+        *pp = a->hash_next;
+
+    ms_cache_lru_unlink(c, a);
+    c->used_bytes -= a->size;
+    shm_free(a);
+}
+
+/**
+ * make room for size bytes by evicting least recently used AoRs, keep
+ * keeps the AoR being written to
+ * return: 0 => room available ; -1 => does not fit
+ */
+static int ms_cache_make_room(ms_cache c, size_t size, ms_cache_aor keep)
+{
+    ms_cache_aor a = c->lru_head;
+
+    while (c->used_bytes + size > c->max_bytes && a)
+    {
+        ms_cache_aor next = a->lru_next;
+        if (a != keep)
+        {
+            ms_cache_aor_drop(c, a);
+            c->evicted++;
+        }
+        a = next;
+    }
+
+    return (c->used_bytes + size > c->max_bytes) ? -1 : 0;
+}
+
+static ms_cache_aor ms_cache_aor_new(ms_cache c, const str *user, const str *host,
+                                     unsigned int hash)
+{
+    size_t size = sizeof(t_ms_cache_aor) + user->len + host->len;
+    ms_cache_aor a;
+    unsigned int slot = hash & (c->aor_buckets - 1);
+
+    if (ms_cache_make_room(c, size, NULL) < 0)
+        return NULL;
+
+    a = (ms_cache_aor)shm_malloc(size);
+    if (a == NULL)
+        return NULL;
+    memset(a, 0, sizeof(t_ms_cache_aor));
+
+    a->hash = hash;
+    a->size = size;
+    a->user.s = a->data;
+    a->user.len = user->len;
+    memcpy(a->user.s, user->s, user->len);
+    a->host.s = a->data + user->len;
+    a->host.len = host->len;
+    memcpy(a->host.s, host->s, host->len);
+
+    a->hash_next = c->aors[slot];
+    c->aors[slot] = a;
+    ms_cache_lru_touch(c, a);
+    c->used_bytes += size;
+
+    return a;
+}
+
+static char* ms_cache_put_str(char *p, str *dst, const str *src)
+{
+    dst->s = p;
+    dst->len = 0;
+    if (src && src->s && src->len > 0)
+    {
+        memcpy(p, src->s, src->len);
+        dst->len = src->len;
+    }
+    return p + dst->len;
+}
+
+/**
+ * add a freshly stored message
+ * return: MS_CACHE_OK => cached ; MS_CACHE_MISS => not cached (the AoR is
+ * no longer complete) ; MS_CACHE_ERR => error
+ */
+int ms_cache_add(ms_cache c, str *user, str *host, t_msg_mid mid, str *from,
+                 str *to, str *body, str *ctype, str *msg_type, time_t inc_time,
+                 time_t exp_time)
+{
+    unsigned int hash = ms_cache_aor_hash(user, host);
+    unsigned int slot;
+    size_t size;
+    ms_cache_aor a;
+    ms_cache_msg m, p;
+    char *s;
+
+    if (c == NULL)
+        return MS_CACHE_ERR;
+
+    size = sizeof(t_ms_cache_msg) + from->len + to->len + body->len
+           + (ctype ? ctype->len : 0) + (msg_type ? msg_type->len : 0);
+
+    lock_get(&c->lock);
+
+    a = ms_cache_aor_find(c, user, host, hash);
+    if (mid <= 0)
+        goto miss;  // stored, but the id is unknown
+    if (a == NULL)
+    {
+        a = ms_cache_aor_new(c, user, host, hash);
+        if (a == NULL)
+            goto miss;
+    }
+    ms_cache_lru_touch(c, a);
+
+    if (ms_cache_msg_find(c, mid) != NULL)
+    {
+        lock_release(&c->lock);
+        return MS_CACHE_OK;
+    }
+
+    if (ms_cache_make_room(c, size, a) < 0)
+        goto miss;
+
+    m = (ms_cache_msg)shm_malloc(size);
+    if (m == NULL)
+        goto miss;
+
+    m->mid = mid;
+    m->inc_time = inc_time;
+    m->exp_time = exp_time;
+    m->size = size;
+    m->aor = a;
+    s = m->data;
+    s = ms_cache_put_str(s, &m->from, from);
+    s = ms_cache_put_str(s, &m->to, to);
+    s = ms_cache_put_str(s, &m->body, body);
+    s = ms_cache_put_str(s, &m->ctype, ctype);
+    ms_cache_put_str(s, &m->msg_type, msg_type);
+
+    // ids grow, so the new message goes (almost always) to the tail
+    p = a->tail;
+    while (p && p->mid > mid)
+        p = p->aor_prev;
+    m->aor_prev = p;
+    m->aor_next = p ? p->aor_next : a->head;
+    if (m->aor_next)
+        m->aor_next->aor_prev = m;
+    else
+        a->tail = m;
+    if (p)
+        p->aor_next = m;
+    else
+        a->head = m;
+    a->count++;
+
+    slot = ms_cache_mid_slot(c, mid);
+    m->mid_next = c->mids[slot];
+    c->mids[slot] = m;
+    c->used_bytes += size;
+
+    lock_release(&c->lock);
+    return MS_CACHE_OK;
+
+miss:
+    if (a)
+        a->complete = 0;
+    c->gens[hash & (MS_CACHE_GENS - 1)]++;
+    lock_release(&c->lock);
+    return MS_CACHE_MISS;
+}
+
+/**
+ * list the pending messages of a complete AoR, at most max, rows carry the
+ * mid, exp_time and msg_type (copied into the arena) as the storage dump does
+ * return: MS_CACHE_OK => rows/n filled ; MS_CACHE_MISS => ask the database ;
+ * MS_CACHE_ERR => no memory
+ */
+int ms_cache_dump(ms_cache c, str *user, str *host, ms_row rows, int max, int *n,
+                  ms_arena ar)
+{
+    unsigned int hash = ms_cache_aor_hash(user, host);
+    ms_cache_aor a;
+    ms_cache_msg m;
+    char *s;
+    int ret = MS_CACHE_MISS;
+
+    *n = 0;
+    if (c == NULL)
+        return MS_CACHE_MISS;
+
+    lock_get(&c->lock);
+    a = ms_cache_aor_find(c, user, host, hash);
+    if (a != NULL && a->complete && a->count <= max)
+    {
+        ret = MS_CACHE_OK;
+        for (m = a->head; m; m = m->aor_next)
+        {
+            s = ms_arena_alloc(ar, m->msg_type.len);
+            if (s == NULL && m->msg_type.len > 0)
+            {
+                ret = MS_CACHE_ERR;
+                break;
+            }
+            memset(&rows[*n], 0, sizeof(t_ms_row));
+            rows[*n].mid = m->mid;
+            rows[*n].exp_time = m->exp_time;
+            ms_cache_put_str(s, &rows[*n].msg_type, &m->msg_type);
+            (*n)++;
+        }
+        ms_cache_lru_touch(c, a);
+    }
+    lock_release(&c->lock);
+
+    return ret;
+}
+
+/**
+ * generation of the AoR, taken before a database dump of it
+ */
+unsigned int ms_cache_gen(ms_cache c, str *user, str *host)
+{
+    unsigned int hash = ms_cache_aor_hash(user, host);
+    unsigned int gen;
+
+    if (c == NULL)
+        return 0;
+
+    lock_get(&c->lock);
+    gen = c->gens[hash & (MS_CACHE_GENS - 1)];
+    lock_release(&c->lock);
+
+    return gen;
+}
+
+/**
+ * record the result of a database dump of the AoR: if every id the
+ * database returned is cached, later dumps are served from the cache;
+ * gen is ms_cache_gen() from before the dump, a message that missed the
+ * cache since then may not be among the ids
+ * return: MS_CACHE_OK => complete ; MS_CACHE_MISS => not complete
+ */
+int ms_cache_set_complete(ms_cache c, str *user, str *host, const t_msg_mid *mids,
+                          int n, unsigned int gen)
+{
+    unsigned int hash = ms_cache_aor_hash(user, host);
+    ms_cache_aor a;
+    ms_cache_msg m;
+    int i;
+    int ret = MS_CACHE_MISS;
+
+    if (c == NULL)
+        return MS_CACHE_MISS;
+
+    lock_get(&c->lock);
+    if (c->gens[hash & (MS_CACHE_GENS - 1)] != gen)
+        goto done;
+    a = ms_cache_aor_find(c, user, host, hash);
+    if (a == NULL && n == 0)
+        a = ms_cache_aor_new(c, user, host, hash);
+    if (a == NULL)
+        goto done;
+
+    for (i = 0; i < n; i++)
+    {
+        m = ms_cache_msg_find(c, mids[i]);
+        if (m == NULL || m->aor != a)
+            goto done;
+    }
+
+    a->complete = 1;
+    ms_cache_lru_touch(c, a);
+    ret = MS_CACHE_OK;
+
+done:
+    lock_release(&c->lock);
+    return ret;
+}
+
+/**
+ * copy a cached message into the arena
+ * return: MS_CACHE_OK => row filled ; MS_CACHE_MISS => not cached ;
+ * MS_CACHE_ERR => no memory
+ */
+int ms_cache_get(ms_cache c, t_msg_mid mid, ms_row row, ms_arena ar)
+{
+    ms_cache_msg m;
+    char *s;
+    int ret = MS_CACHE_MISS;
+
+    if (c == NULL)
+        return MS_CACHE_MISS;
+
+    lock_get(&c->lock);
+    m = ms_cache_msg_find(c, mid);
+    if (m == NULL)
+        goto done;
+
+    s = ms_arena_alloc(ar, m->from.len + m->to.len + m->body.len + m->ctype.len
+                           + m->msg_type.len + m->aor->user.len + m->aor->host.len);
+    if (s == NULL)
+    {
+        ret = MS_CACHE_ERR;
+        goto done;
+    }
+
+    memset(row, 0, sizeof(t_ms_row));
+    row->mid = m->mid;
+    row->inc_time = m->inc_time;
+    row->exp_time = m->exp_time;
+    s = ms_cache_put_str(s, &row->from, &m->from);
+    s = ms_cache_put_str(s, &row->to, &m->to);
+    s = ms_cache_put_str(s, &row->body, &m->body);
+    s = ms_cache_put_str(s, &row->ctype, &m->ctype);
+    s = ms_cache_put_str(s, &row->msg_type, &m->msg_type);
+    s = ms_cache_put_str(s, &row->user, &m->aor->user);
+    ms_cache_put_str(s, &row->host, &m->aor->host);
+    ret = MS_CACHE_OK;
+
+done:
+    lock_release(&c->lock);
+    return ret;
+}
+
+/**
+ * forget a message deleted from the database
+ */
+void ms_cache_del(ms_cache c, t_msg_mid mid)
+{
+    ms_cache_msg m;
+
+    if (c == NULL)
+        return;
+
+    lock_get(&c->lock);
+    m = ms_cache_msg_find(c, mid);
+    if (m != NULL)
+        ms_cache_msg_drop(c, m);
+    lock_release(&c->lock);
+}
+
+/**
+ * drop messages expired by now, as the database cleaner does
+ * return: number of dropped messages
+ */
+int ms_cache_expire(ms_cache c, time_t now)
+{
+    ms_cache_aor a, an;
+    ms_cache_msg m, mn;
+    int n = 0;
+
+    if (c == NULL)
+        return 0;
+
+    lock_get(&c->lock);
+    for (a = c->lru_head; a; a = an)
+    {
+        an = a->lru_next;
+        for (m = a->head; m; m = mn)
+        {
+            mn = m->aor_next;
+            if (m->exp_time <= now)
+            {
+                ms_cache_msg_drop(c, m);
+                n++;
+            }
+        }
+    }
+    lock_release(&c->lock);
+
+    return n;
+}
+
+/**
+ * rows became pending behind the cache's back (e.g. reminder send time
+ * reset), fall back to the database for every AoR until dumped again
+ */
+void ms_cache_set_incomplete_all(ms_cache c)
+{
+    ms_cache_aor a;
+    int i;
+
+    if (c == NULL)
+        return;
+
+    lock_get(&c->lock);
+    for (a = c->lru_head; a; a = a->lru_next)
+        a->complete = 0;
+    // nor may a dump running now mark its AoR complete
+    for (i = 0; i < MS_CACHE_GENS; i++)
+        c->gens[i]++;
+    lock_release(&c->lock);
+}
+
+/**
+ * free the cache
+ */
+void ms_cache_free(ms_cache c)
+{
+    if (c == NULL)
+        return;
+
+    while (c->lru_head)
+        ms_cache_aor_drop(c, c->lru_head);
+
+    lock_destroy(&c->lock);
+    shm_free(c->aors);
+    shm_free(c->mids);
+    shm_free(c);
+}
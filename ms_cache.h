@@ -0,0 +1,101 @@
+//
+// Write-through cache of stored messages in shared memory.
+//
+// m_store() adds every message it inserts (snd_time == 0 only) under the
+// AoR it was stored for, keyed by the database id. The database stays the
+// source of truth: an AoR is served from the cache by m_dump() only when
+// it is marked complete, i.e. a database dump has shown that every pending
+// row of the AoR is cached. Rows missing from the cache are loaded from
+// the database as before.
+//
+// Memory is bounded by max_bytes; when full, whole AoRs are evicted in
+// least recently used order so an AoR is never left half cached.
+//
+
+#ifndef OPENSIPS_1_11_2_TLS_MS_CACHE_H
+#define OPENSIPS_1_11_2_TLS_MS_CACHE_H
+
+#include <time.h>
+#include "../../str.h"
+#include "../../locking.h"
+#include "msilo.h"
+#include "ms_arena.h"
+#include "ms_store.h"
+
+#define MS_CACHE_OK     0
+#define MS_CACHE_ERR   -1
+#define MS_CACHE_MISS   1
+
+// generations of AoRs by hash, so one is kept for AoRs with no entry
+#define MS_CACHE_GENS   256
+
+typedef struct _ms_cache_aor t_ms_cache_aor, *ms_cache_aor;
+
+typedef struct _ms_cache_msg
+{
+    t_msg_mid mid;
+    time_t inc_time;
+    time_t exp_time;
+    str from;
+    str to;
+    str body;
+    str ctype;
+    str msg_type;
+    size_t size;
+
+    ms_cache_aor aor;
+    struct _ms_cache_msg * aor_next;  // per AoR list, ordered by mid
+    struct _ms_cache_msg * aor_prev;
+    struct _ms_cache_msg * mid_next;  // mid hash chain
+    char data[];
+} t_ms_cache_msg, *ms_cache_msg;
+
+struct _ms_cache_aor
+{
+    unsigned int hash;
+    str user;
+    str host;
+    int complete;  // every pending row of the AoR is in the cache
+    int count;
+    size_t size;
+
+    ms_cache_msg head;
+    ms_cache_msg tail;
+    struct _ms_cache_aor * hash_next;
+    struct _ms_cache_aor * lru_prev;  // lru_prev == least recently used
+    struct _ms_cache_aor * lru_next;
+    char data[];
+};
+
+typedef struct _ms_cache
+{
+    size_t max_bytes;
+    size_t used_bytes;
+    unsigned int aor_buckets;  // power of two
+    unsigned int mid_buckets;  // power of two
+    ms_cache_aor * aors;
+    ms_cache_msg * mids;
+    ms_cache_aor lru_head;  // least recently used
+    ms_cache_aor lru_tail;  // most recently used
+    long evicted;
+    unsigned int gens[MS_CACHE_GENS];  // bumped when a message misses the AoR
+    gen_lock_t lock;
+} t_ms_cache, *ms_cache;
+
+ms_cache ms_cache_init(size_t max_bytes);
+void ms_cache_free(ms_cache c);
+
+int ms_cache_add(ms_cache c, str *user, str *host, t_msg_mid mid, str *from,
+                 str *to, str *body, str *ctype, str *msg_type, time_t inc_time,
+                 time_t exp_time);
+int ms_cache_dump(ms_cache c, str *user, str *host, ms_row rows, int max, int *n,
+                  ms_arena a);
+unsigned int ms_cache_gen(ms_cache c, str *user, str *host);
+int ms_cache_set_complete(ms_cache c, str *user, str *host, const t_msg_mid *mids,
+                          int n, unsigned int gen);
+int ms_cache_get(ms_cache c, t_msg_mid mid, ms_row row, ms_arena a);
+void ms_cache_del(ms_cache c, t_msg_mid mid);
+int ms_cache_expire(ms_cache c, time_t now);
+void ms_cache_set_incomplete_all(ms_cache c);
+
+#endif //OPENSIPS_1_11_2_TLS_MS_CACHE_H
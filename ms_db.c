@@ -0,0 +1,645 @@
+/*
+ * MSILO module - SQL storage backend
+ *
+ * Copyright (C) 2001-2003 FhG Fokus
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../../dprint.h"
+#include "../../db/db.h"
+
+#include "ms_store.h"
+
+#define MS_DB_KEYS		10
+#define PH_SQL_BUF_LEN	2048
+#define S_TABLE_VERSION	6
+
+str ms_db_url = {NULL, 0};
+str ms_db_table = str_init("silo");
+
+str sc_mid      = str_init("id");        /* 0 */
+str sc_from     = str_init("src_addr");  /* 1 */
+str sc_to       = str_init("dst_addr");  /* 2 */
+str sc_uri_user = str_init("username");  /* 3 */
+str sc_uri_host = str_init("domain");    /* 4 */
+str sc_body     = str_init("body");      /* 5 */
+str sc_ctype    = str_init("ctype");     /* 6 */
+str sc_exp_time = str_init("exp_time");  /* 7 */
+str sc_inc_time = str_init("inc_time");  /* 8 */
+str sc_snd_time = str_init("snd_time");  /* 9 */
+str sc_msg_type = str_init("msg_type");  /* 10 */
+
+/** rows fetched at once from large results */
+int ms_db_fetch_rows = 512;
+
+/** database connection */
+static db_con_t *db_con = NULL;
+static db_func_t msilo_dbf;
+
+#define SET_STR_VAL(_str, _res, _r, _c)	\
+	if (RES_ROWS(_res)[_r].values[_c].nul == 0) \
+	{ \
+		switch(RES_ROWS(_res)[_r].values[_c].type) \
+		{ \
+		case DB_STRING: \
+			(_str).s=(char*)RES_ROWS(_res)[_r].values[_c].val.string_val; \
+			(_str).len=strlen((_str).s); \
+			break; \
+		case DB_STR: \
+			(_str).len=RES_ROWS(_res)[_r].values[_c].val.str_val.len; \
+			(_str).s=(char*)RES_ROWS(_res)[_r].values[_c].val.str_val.s; \
+			break; \
+		case DB_BLOB: \
+			(_str).len=RES_ROWS(_res)[_r].values[_c].val.blob_val.len; \
+			(_str).s=(char*)RES_ROWS(_res)[_r].values[_c].val.blob_val.s; \
+			break; \
+		default: \
+			(_str).len=0; \
+			(_str).s=NULL; \
+		} \
+	}
+
+#define SET_DB_STR(_v, _s) \
+	do { \
+		(_v).type = DB_STR; \
+		(_v).nul = 0; \
+		(_v).val.str_val = (_s); \
+	} while(0)
+
+#define SET_DB_BIGINT(_v, _i) \
+	do { \
+		(_v).type = DB_BIGINT; \
+		(_v).nul = 0; \
+		(_v).val.bigint_val = (long long)(_i); \
+	} while(0)
+
+/** called for row _i of _res, return <0 to stop */
+typedef int (*ms_db_row_f)(db_res_t *res, int i, void *param);
+
+static int ms_db_init(void)
+{
+	init_db_url( ms_db_url , 0 /*cannot be null*/);
+	ms_db_table.len = strlen (ms_db_table.s);
+	sc_mid.len = strlen(sc_mid.s);
+	sc_from.len = strlen(sc_from.s);
+	sc_to.len = strlen(sc_to.s);
+	sc_uri_user.len = strlen(sc_uri_user.s);
+	sc_uri_host.len = strlen(sc_uri_host.s);
+	sc_body.len = strlen(sc_body.s);
+	sc_ctype.len = strlen(sc_ctype.s);
+	sc_exp_time.len = strlen(sc_exp_time.s);
+	sc_inc_time.len = strlen(sc_inc_time.s);
+	sc_snd_time.len = strlen(sc_snd_time.s);
+	sc_msg_type.len = strlen(sc_msg_type.s);
+
+	/* binding to mysql module  */
+	if (db_bind_mod(&ms_db_url, &msilo_dbf))
+	{
+		LM_INFO("database module not found\n");
+		return -1;
+	}
+
+	if (!DB_CAPABILITY(msilo_dbf, DB_CAP_ALL)) {
+		LM_ERR("database module does not implement "
+		    "all functions needed by the module\n");
+		return -1;
+	}
+
+	if (ms_db_fetch_rows <= 0)
+		ms_db_fetch_rows = 512;
+	if (DB_CAPABILITY(msilo_dbf, DB_CAP_FETCH))
+		ms_db_store.caps |= MS_STORE_CAP_PAGED;
+	else
+		LM_INFO("database module cannot fetch in chunks, "
+			"results are loaded at once\n");
+
+	/* cached rows are keyed by the id the database gave them */
+	if (DB_CAPABILITY(msilo_dbf, DB_CAP_LAST_INSERTED_ID))
+		ms_db_store.caps |= MS_STORE_CAP_IDS;
+
+	db_con = msilo_dbf.init(&ms_db_url);
+	if (!db_con)
+	{
+		LM_ERR("failed to connect to the database\n");
+		return -1;
+	}
+
+	if(db_check_table_version(&msilo_dbf, db_con, &ms_db_table, S_TABLE_VERSION) < 0) {
+		LM_ERR("error during table version check.\n");
+		return -1;
+	}
+	if(db_con)
+		msilo_dbf.close(db_con);
+	db_con = NULL;
+
+	return 0;
+}
+
+static int ms_db_child_init(int rank)
+{
+	if (msilo_dbf.init==0)
+	{
+		LM_CRIT("database not bound\n");
+		return -1;
+	}
+	db_con = msilo_dbf.init(&ms_db_url);
+	if (!db_con)
+	{
+		LM_ERR("child %d: failed to connect database\n", rank);
+		return -1;
+	}
+
+	if (msilo_dbf.use_table(db_con, &ms_db_table) < 0) {
+		LM_ERR("child %d: failed in use_table\n", rank);
+		return -1;
+	}
+
+	LM_DBG("#%d database connection opened successfully\n", rank);
+	return 0;
+}
+
+static void ms_db_destroy(void)
+{
+	if(db_con && msilo_dbf.close)
+		msilo_dbf.close(db_con);
+	db_con = NULL;
+}
+
+static int ms_db_use_table(void)
+{
+	if (db_con == NULL)
+	{
+		LM_ERR("db_con is NULL\n");
+		return -1;
+	}
+	if (msilo_dbf.use_table(db_con, &ms_db_table) < 0)
+	{
+		LM_ERR("failed to use_table\n");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * run a query and walk its rows, ms_db_fetch_rows at a time if the
+ * database module can fetch, so a large backlog is never held at once
+ * returns the number of rows walked
+ */
+static int ms_db_query_rows(db_key_t *keys, db_op_t *ops, db_val_t *vals,
+		db_key_t *cols, int nk, int nc, db_key_t order, int limit,
+		ms_db_row_f f, void *param)
+{
+	db_res_t* res = NULL;
+	int fetch = DB_CAPABILITY(msilo_dbf, DB_CAP_FETCH);
+	int chunk = ms_db_fetch_rows;
+	int i, n = 0;
+
+	/* the DB API has no LIMIT, a first chunk of that size does the job */
+	if (limit > 0 && limit < chunk)
+		chunk = limit;
+
+	if (ms_db_use_table() < 0)
+		return -1;
+
+	if (fetch)
+	{
+		if (msilo_dbf.query(db_con, keys, ops, vals, cols, nk, nc,
+					order, 0) < 0
+				|| msilo_dbf.fetch_result(db_con, &res, chunk) < 0)
+		{
+			LM_ERR("failed to query the database\n");
+			return -1;
+		}
+	} else if (msilo_dbf.query(db_con, keys, ops, vals, cols, nk, nc,
+				order, &res) < 0)
+	{
+		LM_ERR("failed to query the database\n");
+		return -1;
+	}
+
+	do {
+		for (i = 0; i < RES_ROW_N(res); i++)
+		{
+			n++;
+			if (f(res, i, param) < 0 || n == limit)
+				goto done;
+		}
+		if (!fetch)
+			break;
+		if (msilo_dbf.fetch_result(db_con, &res, chunk) < 0)
+		{
+			LM_ERR("failed to fetch rows\n");
+			goto done;
+		}
+	} while (RES_ROW_N(res) > 0);
+
+done:
+	if (res && msilo_dbf.free_result(db_con, res) < 0)
+		LM_ERR("failed to free result of query\n");
+	return n;
+}
+
+/**
+ * the rows come back in one result, only the id column of each, so the
+ * count does not walk them chunk by chunk through fetch_result
+ */
+static int ms_db_count(str *user, str *host)
+{
+	db_key_t db_keys[2];
+	db_val_t db_vals[2];
+	db_key_t db_cols[1];
+	db_res_t* res = NULL;
+	int n;
+
+	db_keys[0] = &sc_uri_user;
+	db_keys[1] = &sc_uri_host;
+	SET_DB_STR(db_vals[0], *user);
+	SET_DB_STR(db_vals[1], *host);
+	db_cols[0] = &sc_mid;
+
+	if (ms_db_use_table() < 0)
+		return -1;
+
+	if (msilo_dbf.query(db_con, db_keys, 0, db_vals, db_cols,
+				2, 1, 0, &res) < 0 ) {
+		LM_ERR("failed to query the database\n");
+		return -1;
+	}
+	n = RES_ROW_N(res);
+	msilo_dbf.free_result(db_con, res);
+
+	return n;
+}
+
+static int ms_db_insert(ms_row row, t_msg_mid *mid)
+{
+	db_key_t db_keys[MS_DB_KEYS];
+	db_val_t db_vals[MS_DB_KEYS];
+	int nr_keys = 0;
+
+	*mid = 0;
+
+	db_keys[nr_keys] = &sc_uri_user;
+	SET_DB_STR(db_vals[nr_keys], row->user);
+	nr_keys++;
+
+	db_keys[nr_keys] = &sc_uri_host;
+	SET_DB_STR(db_vals[nr_keys], row->host);
+	nr_keys++;
+
+	db_keys[nr_keys] = &sc_to;
+	SET_DB_STR(db_vals[nr_keys], row->to);
+	nr_keys++;
+
+	db_keys[nr_keys] = &sc_from;
+	SET_DB_STR(db_vals[nr_keys], row->from);
+	nr_keys++;
+
+	db_keys[nr_keys] = &sc_body;
+	db_vals[nr_keys].type = DB_BLOB;
+	db_vals[nr_keys].nul = 0;
+	db_vals[nr_keys].val.blob_val = row->body;
+	nr_keys++;
+
+	db_keys[nr_keys] = &sc_ctype;
+	SET_DB_STR(db_vals[nr_keys], row->ctype);
+	nr_keys++;
+
+	db_keys[nr_keys] = &sc_exp_time;
+	SET_DB_BIGINT(db_vals[nr_keys], row->exp_time);
+	nr_keys++;
+
+	db_keys[nr_keys] = &sc_inc_time;
+	SET_DB_BIGINT(db_vals[nr_keys], row->inc_time);
+	nr_keys++;
+
+	db_keys[nr_keys] = &sc_snd_time;
+	SET_DB_BIGINT(db_vals[nr_keys], row->snd_time);
+	nr_keys++;
+
+	db_keys[nr_keys] = &sc_msg_type;
+	SET_DB_STR(db_vals[nr_keys], row->msg_type);
+	db_vals[nr_keys].nul = row->msg_type.len <= 0;
+	nr_keys++;
+
+	if (ms_db_use_table() < 0)
+		return -1;
+
+	if(msilo_dbf.insert(db_con, db_keys, db_vals, nr_keys) < 0)
+	{
+		LM_ERR("failed to store message\n");
+		return -1;
+	}
+
+	if (ms_db_store.caps & MS_STORE_CAP_IDS)
+		*mid = (t_msg_mid)msilo_dbf.last_inserted_id(db_con);
+
+	return 0;
+}
+
+typedef struct _ms_db_row_ctx
+{
+	ms_row_f f;
+	void *param;
+} t_ms_db_row_ctx;
+
+static int ms_db_dump_row(db_res_t *res, int i, void *param)
+{
+	t_ms_db_row_ctx *ctx = (t_ms_db_row_ctx*)param;
+	t_ms_row row;
+
+	memset(&row, 0, sizeof(t_ms_row));
+	row.mid = RES_ROWS(res)[i].values[0].val.bigint_val;
+	SET_STR_VAL(row.msg_type, res, i, 1);
+	row.exp_time = (time_t)RES_ROWS(res)[i].values[2].val.bigint_val;
+
+	return ctx->f(&row, ctx->param);
+}
+
+static int ms_db_dump(str *user, str *host, t_msg_mid after, int limit,
+		ms_row_f f, void *param)
+{
+	db_key_t db_keys[4];
+	db_op_t  db_ops[4];
+	db_val_t db_vals[4];
+	db_key_t db_cols[3];
+	t_ms_db_row_ctx ctx;
+
+	db_keys[0]=&sc_uri_user;
+	db_keys[1]=&sc_uri_host;
+	db_keys[2]=&sc_snd_time;
+	db_ops[0]=OP_EQ;
+	db_ops[1]=OP_EQ;
+	db_ops[2]=OP_EQ;
+
+	// Select only what the scheduler needs.
+	db_cols[0]=&sc_mid;
+	db_cols[1]=&sc_msg_type;
+	db_cols[2]=&sc_exp_time;
+
+	SET_DB_STR(db_vals[0], *user);
+	SET_DB_STR(db_vals[1], *host);
+	db_vals[2].type = DB_INT;
+	db_vals[2].nul = 0;
+	db_vals[2].val.int_val = 0;
+
+	/* next page: keyset pagination on the id */
+	db_keys[3]=&sc_mid;
+	db_ops[3]=OP_GT;
+	SET_DB_BIGINT(db_vals[3], after);
+
+	ctx.f = f;
+	ctx.param = param;
+
+	return ms_db_query_rows(db_keys, db_ops, db_vals, db_cols,
+			after > 0 ? 4 : 3, 3, &sc_mid, limit, ms_db_dump_row, &ctx);
+}
+
+/**
+ * Builds SQL Query string sql_str, using sql_query buffer. Constructs SELECT query to load all
+ * messages for sending with specified message ids.
+ */
+static int build_sql_query(char *sql_query, str *sql_str, const t_msg_mid *mids_to_load, size_t mids_to_load_size)
+{
+	int off = 0, ret = 0, i = 0;
+	ret = snprintf(sql_query, PH_SQL_BUF_LEN, "SELECT `%.*s`, `%.*s`, `%.*s`, `%.*s`, `%.*s`, `%.*s`, `%.*s`, `%.*s`, `%.*s` FROM `%.*s` WHERE ",
+				   sc_mid.len, sc_mid.s,
+				   sc_from.len, sc_from.s,
+				   sc_to.len, sc_to.s,
+				   sc_body.len, sc_body.s,
+				   sc_ctype.len, sc_ctype.s,
+				   sc_inc_time.len, sc_inc_time.s,
+				   sc_uri_user.len, sc_uri_user.s,
+				   sc_uri_host.len, sc_uri_host.s,
+				   sc_msg_type.len, sc_msg_type.s,
+				   ms_db_table.len, ms_db_table.s);
+	if (ret < 0 || ret >= PH_SQL_BUF_LEN) goto error;
+	off = ret;
+
+	// WHERE conditions.
+	for(i = 0; i < mids_to_load_size; i++){
+		ret = snprintf(sql_query + off, PH_SQL_BUF_LEN - off, " `%.*s`=%lld ", sc_mid.len, sc_mid.s, (long long) mids_to_load[i]);
+		if (ret < 0 || ret >= (PH_SQL_BUF_LEN - off)) goto error;
+		off += ret;
+
+		if (i+1 < mids_to_load_size){
+			ret = snprintf(sql_query + off, PH_SQL_BUF_LEN - off, " OR ");
+			if (ret < 0 || ret >= (PH_SQL_BUF_LEN - off)) goto error;
+			off += ret;
+		}
+	}
+
+	ret = snprintf(sql_query + off, PH_SQL_BUF_LEN - off, " ORDER BY `%.*s`", sc_mid.len, sc_mid.s);
+	if (ret < 0 || ret >= (PH_SQL_BUF_LEN - off)) goto error;
+	off += ret;
+
+	// Null terminate.
+	if (off + 1 >= PH_SQL_BUF_LEN) goto error;
+	sql_query[off + 1] = '\0';
+	sql_str->s = sql_query;
+	sql_str->len = off;
+
+	return 0;
+error:
+	return -1;
+}
+
+static int ms_db_load(const t_msg_mid *mids, int n, ms_row_f f, void *param)
+{
+	char sql_query[PH_SQL_BUF_LEN];
+	str sql_str;
+	db_res_t* db_res = NULL;
+	t_ms_row row;
+	int i, rows;
+
+	if (n <= 0)
+		return 0;
+
+	if (build_sql_query(sql_query, &sql_str, mids, n) < 0)
+	{
+		LM_CRIT("Could not build sql string\n");
+		return -1;
+	}
+
+	if (ms_db_use_table() < 0)
+		return -1;
+
+	if (msilo_dbf.raw_query(db_con, &sql_str, &db_res)!=0)
+	{
+		LM_ERR("failed to load messages\n");
+		return -1;
+	}
+
+	rows = RES_ROW_N(db_res);
+	for(i = 0; i < rows; i++)
+	{
+		memset(&row, 0, sizeof(t_ms_row));
+		row.mid = RES_ROWS(db_res)[i].values[0].val.bigint_val;
+		SET_STR_VAL(row.from, db_res, i, 1);
+		SET_STR_VAL(row.to, db_res, i, 2);
+		SET_STR_VAL(row.body, db_res, i, 3);
+		SET_STR_VAL(row.ctype, db_res, i, 4);
+		row.inc_time = (time_t)RES_ROWS(db_res)[i].values[5/*inc time*/].val.bigint_val;
+		SET_STR_VAL(row.user, db_res, i, 6);
+		SET_STR_VAL(row.host, db_res, i, 7);
+		SET_STR_VAL(row.msg_type, db_res, i, 8);
+		if (f(&row, param) < 0)
+			break;
+	}
+
+	if (msilo_dbf.free_result(db_con, db_res) < 0)
+		LM_ERR("failed to free result of query\n");
+
+	return rows;
+}
+
+static int ms_db_remove(t_msg_mid mid)
+{
+	db_key_t db_keys[1];
+	db_val_t db_vals[1];
+
+	db_keys[0] = &sc_mid;
+	SET_DB_BIGINT(db_vals[0], mid);
+
+	if (ms_db_use_table() < 0)
+		return -1;
+
+	if (msilo_dbf.delete(db_con, db_keys, NULL, db_vals, 1) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int ms_db_expire(time_t now)
+{
+	db_key_t db_keys[1];
+	db_val_t db_vals[1];
+	db_op_t  db_ops[1] = { OP_LEQ };
+
+	db_keys[0] = &sc_exp_time;
+	SET_DB_BIGINT(db_vals[0], now);
+
+	if (ms_db_use_table() < 0)
+		return -1;
+
+	if (msilo_dbf.delete(db_con, db_keys, db_ops, db_vals, 1) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int ms_db_reminder_row(db_res_t *res, int i, void *param)
+{
+	t_ms_db_row_ctx *ctx = (t_ms_db_row_ctx*)param;
+	t_ms_row row;
+
+	memset(&row, 0, sizeof(t_ms_row));
+	row.mid = RES_ROWS(res)[i].values[0].val.bigint_val;
+	SET_STR_VAL(row.user, res, i, 1);
+	SET_STR_VAL(row.host, res, i, 2);
+	SET_STR_VAL(row.body, res, i, 3);
+	SET_STR_VAL(row.ctype, res, i, 4);
+	row.snd_time =
+		(time_t)RES_ROWS(res)[i].values[5/*snd time*/].val.bigint_val;
+	SET_STR_VAL(row.msg_type, res, i, 6);
+
+	return ctx->f(&row, ctx->param);
+}
+
+static int ms_db_reminders(time_t now, ms_row_f f, void *param)
+{
+	db_key_t db_keys[2];
+	db_op_t  db_ops[2];
+	db_val_t db_vals[2];
+	db_key_t db_cols[7];
+	t_ms_db_row_ctx ctx;
+
+	db_keys[0]=&sc_snd_time;
+	db_keys[1]=&sc_snd_time;
+	db_ops[0]=OP_NEQ;
+	db_ops[1]=OP_LEQ;
+
+	db_cols[0]=&sc_mid;
+	db_cols[1]=&sc_uri_user;
+	db_cols[2]=&sc_uri_host;
+	db_cols[3]=&sc_body;
+	db_cols[4]=&sc_ctype;
+	db_cols[5]=&sc_snd_time;
+	db_cols[6]=&sc_msg_type;
+
+	db_vals[0].type = DB_INT;
+	db_vals[0].nul = 0;
+	db_vals[0].val.int_val = 0;
+	SET_DB_BIGINT(db_vals[1], now);
+
+	ctx.f = f;
+	ctx.param = param;
+
+	return ms_db_query_rows(db_keys, db_ops, db_vals, db_cols, 2, 7,
+			NULL, 0, ms_db_reminder_row, &ctx);
+}
+
+static int ms_db_reset_stime(t_msg_mid mid)
+{
+	db_key_t db_keys[1];
+	db_op_t  db_ops[1];
+	db_val_t db_vals[1];
+	db_key_t db_cols[1];
+	db_val_t db_cvals[1];
+
+	db_keys[0]=&sc_mid;
+	db_ops[0]=OP_EQ;
+	SET_DB_BIGINT(db_vals[0], mid);
+
+	db_cols[0]=&sc_snd_time;
+	db_cvals[0].type = DB_INT;
+	db_cvals[0].nul = 0;
+	db_cvals[0].val.int_val = 0;
+
+	LM_DBG("updating send time for [%lld]!\n", (long long) mid);
+
+	if (ms_db_use_table() < 0)
+		return -1;
+
+	if(msilo_dbf.update(db_con,db_keys,db_ops,db_vals,db_cols,db_cvals,1,1)!=0)
+	{
+		LM_ERR("failed to make update for [%lld]!\n", (long long)mid);
+		return -1;
+	}
+	return 0;
+}
+
+t_ms_store ms_db_store = {
+	"db",
+	0,
+	ms_db_init,
+	ms_db_child_init,
+	ms_db_destroy,
+	ms_db_count,
+	ms_db_insert,
+	ms_db_dump,
+	ms_db_load,
+	ms_db_remove,
+	ms_db_expire,
+	ms_db_reminders,
+	ms_db_reset_stime,
+	NULL
+};
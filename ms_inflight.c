@@ -0,0 +1,140 @@
+//
+// MESSAGE transactions in flight, see ms_inflight.h.
+//
+
+#include "ms_inflight.h"
+#include <string.h>
+
+#include "../../mem/mem.h"
+#include "../../mem/shm_mem.h"
+#include "../../dprint.h"
+
+#define MS_INFLIGHT_IDX_MASK ((1UL << MS_INFLIGHT_IDX_BITS) - 1)
+
+static ms_inflight_h ms_inflight_handle(ms_inflight t, int i)
+{
+    return ((unsigned long)t->slots[i].gen << MS_INFLIGHT_IDX_BITS) | (unsigned long)(i + 1);
+}
+
+/**
+ * init the table with size slots
+ */
+ms_inflight ms_inflight_init(unsigned int size)
+{
+    ms_inflight t;
+    unsigned int i;
+
+    if (size == 0 || size > MS_INFLIGHT_MAX)
+    {
+        LM_ERR("in-flight table size %u out of 1..%d\n", size, MS_INFLIGHT_MAX);
+        return NULL;
+    }
+
+    t = (ms_inflight)shm_malloc(sizeof(t_ms_inflight) + size * sizeof(t_ms_inflight_slot));
+    if (t == NULL)
+    {
+        LM_ERR("no more shm for the in-flight table\n");
+        return NULL;
+    }
+    memset(t, 0, sizeof(t_ms_inflight) + size * sizeof(t_ms_inflight_slot));
+
+    if (lock_init(&t->lock) == 0)
+    {
+        LM_CRIT("could not initialize a lock\n");
+        shm_free(t);
+        return NULL;
+    }
+
+    t->size = size;
+    for (i = 0; i < size; i++)
+    {
+        t->slots[i].gen = 1;
+        t->slots[i].free_next = i + 1 < size ? (int)(i + 1) : -1;
+    }
+    t->free_head = 0;
+
+    return t;
+}
+
+/**
+ * destroy the table
+ */
+void ms_inflight_free(ms_inflight t)
+{
+    if (t == NULL)
+        return;
+
+    lock_destroy(&t->lock);
+    shm_free(t);
+}
+
+/**
+ * take a slot for the message of el, next is the handle of the message
+ * sent after it in the same MESSAGE, 0 if none
+ * return: the handle, 0 if the table is full
+ */
+ms_inflight_h ms_inflight_put(ms_inflight t, const retry_list_el el, int flags,
+                              ms_inflight_h next)
+{
+    ms_inflight_slot s;
+    ms_inflight_h h;
+    int i;
+
+    lock_get(&t->lock);
+    i = t->free_head;
+    if (i < 0)
+    {
+        lock_release(&t->lock);
+        return 0;
+    }
+
+    s = &t->slots[i];
+    t->free_head = s->free_next;
+    s->busy = 1;
+    t->used++;
+
+    s->mid = el->msgid;
+    s->flags = flags;
+    s->retry_ctr = el->retry_ctr;
+    s->key = el->key;
+    s->aor = el->aor;
+    s->next = next;
+    h = ms_inflight_handle(t, i);
+    lock_release(&t->lock);
+
+    return h;
+}
+
+/**
+ * copy the slot of h out and release it
+ * return: MS_INFLIGHT_ERR if h is stale
+ */
+int ms_inflight_take(ms_inflight t, ms_inflight_h h, ms_inflight_slot out)
+{
+    unsigned long i = (h & MS_INFLIGHT_IDX_MASK);
+    ms_inflight_slot s;
+
+    if (i == 0 || i > t->size)
+        return MS_INFLIGHT_ERR;
+    i--;
+
+    lock_get(&t->lock);
+    s = &t->slots[i];
+    if (!s->busy || ms_inflight_handle(t, (int)i) != h)
+    {
+        lock_release(&t->lock);
+        return MS_INFLIGHT_ERR;
+    }
+
+    *out = *s;
+    s->gen = (s->gen + 1) & (unsigned int)(~0UL >> MS_INFLIGHT_IDX_BITS);
+    if (s->gen == 0)
+        s->gen = 1;
+    s->busy = 0;
+    s->free_next = t->free_head;
+    t->free_head = (int)i;
+    t->used--;
+    lock_release(&t->lock);
+
+    return MS_INFLIGHT_OK;
+}
@@ -0,0 +1,65 @@
+//
+// MESSAGE transactions in flight.
+//
+// The TM callback parameter is a handle to a slot of a table preallocated
+// in shared memory instead of a shm element per message. The slot keeps
+// what the reply needs: the message id, its retry state, the queue key and
+// the window slot of the AoR.
+//
+// A handle is the slot index and the generation of the slot. The
+// generation changes with every release, so a stale handle (a callback
+// after the message was already settled) finds nothing.
+//
+// The messages batched into one MESSAGE are chained, the handle of the
+// first one settles all of them.
+//
+
+#ifndef OPENSIPS_1_11_2_TLS_MS_INFLIGHT_H
+#define OPENSIPS_1_11_2_TLS_MS_INFLIGHT_H
+
+#include "../../locking.h"
+#include "msilo.h"
+#include "msg_retry.h"
+
+#define MS_INFLIGHT_OK    0
+#define MS_INFLIGHT_ERR  -1
+
+#define MS_INFLIGHT_IDX_BITS 20
+#define MS_INFLIGHT_MAX      ((1 << MS_INFLIGHT_IDX_BITS) - 1)
+
+// the message is a reminder, it has no retry state
+#define MS_INFLIGHT_REMINDER (1<<0)
+
+// 0 is no handle
+typedef unsigned long ms_inflight_h;
+
+typedef struct _ms_inflight_slot
+{
+    t_msg_mid mid;
+    int flags;
+    int retry_ctr;
+    t_retry_key key;
+    struct _ms_aor * aor;   // window slot held by the message
+    ms_inflight_h next;     // next message of the same MESSAGE
+    unsigned int gen;
+    int busy;
+    int free_next;
+} t_ms_inflight_slot, *ms_inflight_slot;
+
+typedef struct _ms_inflight
+{
+    unsigned int size;
+    int free_head;
+    long used;
+    gen_lock_t lock;
+    t_ms_inflight_slot slots[];
+} t_ms_inflight, *ms_inflight;
+
+ms_inflight ms_inflight_init(unsigned int size);
+void ms_inflight_free(ms_inflight t);
+
+ms_inflight_h ms_inflight_put(ms_inflight t, const retry_list_el el, int flags,
+                              ms_inflight_h next);
+int ms_inflight_take(ms_inflight t, ms_inflight_h h, ms_inflight_slot out);
+
+#endif //OPENSIPS_1_11_2_TLS_MS_INFLIGHT_H
@@ -0,0 +1,1153 @@
+//
+// Message storage in memory mapped append-only segment files.
+//
+// The log is a fixed set of preallocated segment files <log_dir>/msilo.<i>.seg
+// mapped MAP_SHARED by mod_init before fork, so every process appends into
+// the same pages. A segment starts with a 64 byte header carrying its
+// sequence number (0 == free); records follow back to back:
+//
+//   PUT    a stored message
+//   DEL    the message was delivered (m_clean_silo)
+//   STIME  the send time of a reminder changed
+//
+// Every record repeats the sequence of its segment and is covered by a
+// CRC32; its magic is written last, after a barrier. Recovery replays the
+// segments in sequence order and stops a segment at the first record with
+// a bad magic, sequence or checksum, i.e. at a torn write or at stale data
+// left by an earlier use of a recycled segment.
+//
+// The messages are indexed in shm (by id and by AoR) under one lock. Reads
+// copy the record into a per process buffer under the lock and decode it
+// after the release. Expired messages are only dropped from the index, the
+// recovery skips them by their exp_time.
+//
+// The clean timer compacts the oldest sealed segment: live messages are
+// rewritten into the active segment and the old one is freed. The lock is
+// taken per moved message, so the workers are not stalled for the whole
+// segment. A crash in between only leaves duplicates, the newer copy wins
+// at recovery.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../../mem/mem.h"
+#include "../../mem/shm_mem.h"
+#include "../../locking.h"
+#include "../../dprint.h"
+
+#include "ms_store.h"
+
+#define MS_LOG_SEG_MAGIC    "MSLOG001"
+#define MS_LOG_REC_MAGIC    0x4d534c52u  // "MSLR"
+#define MS_LOG_SEG_HDR      64
+#define MS_LOG_REC_HDR      40
+#define MS_LOG_PUT_HDR      (MS_LOG_REC_HDR + 3 * 8 + 7 * 4)
+#define MS_LOG_ALIGN(_n)    (((_n) + 7) & ~7u)
+
+#define MS_LOG_PUT      1
+#define MS_LOG_DEL      2
+#define MS_LOG_STIME    3
+
+#define MS_LOG_MIN_SEGMENTS     3
+#define MS_LOG_MIN_SEGMENT_SIZE (64 * 1024)
+#define MS_LOG_MIN_BUCKETS      1024
+#define MS_LOG_MAX_BUCKETS      (1 << 20)
+// expected average size of a record, used to size the hash tables
+#define MS_LOG_AVG_REC          512
+// buckets scanned by compaction per lock hold
+#define MS_LOG_COMPACT_SCAN     256
+
+char* ms_log_dir = NULL;
+int ms_log_segment_size = 8 * 1024 * 1024;
+int ms_log_segments = 8;
+int ms_log_sync = 0;  // 0 - none, 1 - msync(MS_ASYNC), 2 - msync(MS_SYNC)
+
+typedef struct _ms_log_seg_hdr
+{
+    char magic[8];
+    uint64_t seq;
+    uint64_t size;
+    int64_t next_mid;
+    char pad[MS_LOG_SEG_HDR - 32];
+} t_ms_log_seg_hdr;
+
+typedef struct _ms_log_rec
+{
+    uint32_t magic;
+    uint32_t crc;       // from len to the end of the record
+    uint32_t len;       // whole record, 8 aligned
+    uint16_t type;
+    uint16_t pad;
+    uint64_t seq;       // seq of the segment
+    int64_t mid;
+    int64_t arg;        // STIME - new snd_time
+} t_ms_log_rec;
+
+typedef struct _ms_log_ent
+{
+    t_msg_mid mid;
+    unsigned int hash;  // AoR hash
+    int seg;
+    unsigned int off;
+    unsigned int len;
+    time_t exp_time;
+    time_t snd_time;
+    str user;
+    str host;
+    str msg_type;
+    struct _ms_log_ent * mid_next;  // mid hash chain
+    struct _ms_log_ent * aor_next;  // AoR bucket list, ordered by mid
+    struct _ms_log_ent * aor_prev;
+    char data[];
+} t_ms_log_ent, *ms_log_ent;
+
+typedef struct _ms_log_seg
+{
+    uint64_t seq;       // 0 - free
+    unsigned int used;
+    unsigned int live;  // bytes of records still in the index
+} t_ms_log_seg;
+
+typedef struct _ms_log
+{
+    gen_lock_t lock;
+    int active;
+    int compact;           // segment being compacted, -1 - none
+    uint64_t next_seq;
+    t_msg_mid next_mid;
+    unsigned int buckets;  // power of two
+    ms_log_ent * mids;
+    ms_log_ent * aors;
+    long count;
+    t_ms_log_seg segs[];
+} t_ms_log, *ms_log;
+
+static ms_log ml_log = NULL;
+// mapped before fork, same address in every process
+static char ** ml_maps = NULL;
+static int * ml_fds = NULL;
+
+// per process copy buffer
+static char * ml_buf = NULL;
+static unsigned int ml_buf_size = 0;
+
+static uint32_t ml_crc_table[256];
+
+static void ms_log_crc_init(void)
+{
+    uint32_t c;
+    int i, k;
+
+    for (i = 0; i < 256; i++)
+    {
+        c = (uint32_t)i;
+        for (k = 0; k < 8; k++)
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        ml_crc_table[i] = c;
+    }
+}
+
+static uint32_t ms_log_crc(const char *p, unsigned int len)
+{
+    uint32_t c = 0xFFFFFFFFu;
+
+    while (len--)
+        c = ml_crc_table[(c ^ (unsigned char)*p++) & 0xFF] ^ (c >> 8);
+
+    return c ^ 0xFFFFFFFFu;
+}
+
+static inline uint32_t ms_log_rec_crc(const t_ms_log_rec *r)
+{
+    return ms_log_crc((const char *)&r->len, r->len - offsetof(t_ms_log_rec, len));
+}
+
+static unsigned int ms_log_aor_hash(const str *user, const str *host)
+{
+    unsigned int h = 2166136261u;
+    int i;
+
+    for (i = 0; i < user->len; i++)
+        h = (h ^ (unsigned char)user->s[i]) * 16777619u;
+    h = (h ^ '@') * 16777619u;
+    for (i = 0; i < host->len; i++)
+        h = (h ^ (unsigned char)host->s[i]) * 16777619u;
+
+    return h;
+}
+
+static inline unsigned int ms_log_mid_slot(t_msg_mid mid)
+{
+    return (unsigned int)(((unsigned long long)mid * 0x9E3779B97F4A7C15ull) >> 32)
+           & (ml_log->buckets - 1);
+}
+
+static int ms_log_buf_grow(unsigned int size)
+{
+    unsigned int n = ml_buf_size ? ml_buf_size : 4096;
+    char *p;
+
+    if (size <= ml_buf_size)
+        return 0;
+
+    while (n < size)
+        n <<= 1;
+    p = (char *)pkg_realloc(ml_buf, n);
+    if (p == NULL)
+    {
+        LM_ERR("no more pkg for %u bytes\n", n);
+        return -1;
+    }
+    ml_buf = p;
+    ml_buf_size = n;
+
+    return 0;
+}
+
+/*** index, called with the lock held ***/
+
+static ms_log_ent ms_log_find(t_msg_mid mid)
+{
+    ms_log_ent e = ml_log->mids[ms_log_mid_slot(mid)];
+
+    while (e && e->mid != mid)
+        e = e->mid_next;
+
+    return e;
+}
+
+static void ms_log_link(ms_log_ent e)
+{
+    ms_log_ent *slot = &ml_log->aors[e->hash & (ml_log->buckets - 1)];
+    ms_log_ent p;
+    unsigned int m = ms_log_mid_slot(e->mid);
+
+    e->mid_next = ml_log->mids[m];
+    ml_log->mids[m] = e;
+
+    // ids grow, the new entry usually goes to the end of the bucket
+    for (p = *slot; p && p->aor_next; p = p->aor_next)
+        ;
+    while (p && p->mid > e->mid)
+        p = p->aor_prev;
+
+    e->aor_prev = p;
+    e->aor_next = p ? p->aor_next : *slot;
+    if (e->aor_next)
+        e->aor_next->aor_prev = e;
+    if (p)
+        p->aor_next = e;
+    else
+        *slot = e;
+
+    ml_log->segs[e->seg].live += e->len;
+    ml_log->count++;
+}
+
+static void ms_log_drop(ms_log_ent e)
+{
+    ms_log_ent *pp = &ml_log->mids[ms_log_mid_slot(e->mid)];
+
+    while (*pp && *pp != e)
+        pp = &(*pp)->mid_next;
+    if (*pp)
+        *pp = e->mid_next;
+
+    if (e->aor_prev)
+        e->aor_prev->aor_next = e->aor_next;
+    else
+        ml_log->aors[e->hash & (ml_log->buckets - 1)] = e->aor_next;
+    if (e->aor_next)
+        e->aor_next->aor_prev = e->aor_prev;
+
+    ml_log->segs[e->seg].live -= e->len;
+    ml_log->count--;
+    shm_free(e);
+}
+
+static ms_log_ent ms_log_ent_new(t_msg_mid mid, const str *user, const str *host,
+                                 const str *msg_type)
+{
+    int tlen = msg_type->len > 0 ? msg_type->len : 0;
+    ms_log_ent e;
+
+    e = (ms_log_ent)shm_malloc(sizeof(t_ms_log_ent) + user->len + host->len + tlen);
+    if (e == NULL)
+    {
+        LM_ERR("no more shm for the log index\n");
+        return NULL;
+    }
+    memset(e, 0, sizeof(t_ms_log_ent));
+    e->mid = mid;
+    e->hash = ms_log_aor_hash(user, host);
+    e->user.s = e->data;
+    e->user.len = user->len;
+    memcpy(e->user.s, user->s, user->len);
+    e->host.s = e->data + user->len;
+    e->host.len = host->len;
+    memcpy(e->host.s, host->s, host->len);
+    e->msg_type.s = e->host.s + host->len;
+    e->msg_type.len = tlen;
+    memcpy(e->msg_type.s, msg_type->s, tlen);
+
+    return e;
+}
+
+static inline int ms_log_ent_match(ms_log_ent e, const str *user, const str *host,
+                                   unsigned int hash)
+{
+    return e->hash == hash && e->user.len == user->len && e->host.len == host->len
+           && memcmp(e->user.s, user->s, user->len) == 0
+           && memcmp(e->host.s, host->s, host->len) == 0;
+}
+
+/*** records ***/
+
+// fills row with pointers into the PUT record r
+static void ms_log_decode(const t_ms_log_rec *r, ms_row row)
+{
+    const char *p = (const char *)r + MS_LOG_REC_HDR;
+    str *f[7];
+    int64_t t;
+    uint32_t l;
+    int i;
+
+    memset(row, 0, sizeof(t_ms_row));
+    row->mid = (t_msg_mid)r->mid;
+    memcpy(&t, p, 8);
+    row->inc_time = (time_t)t;
+    memcpy(&t, p + 8, 8);
+    row->exp_time = (time_t)t;
+    memcpy(&t, p + 16, 8);
+    row->snd_time = (time_t)t;
+
+    f[0] = &row->user;
+    f[1] = &row->host;
+    f[2] = &row->from;
+    f[3] = &row->to;
+    f[4] = &row->ctype;
+    f[5] = &row->msg_type;
+    f[6] = &row->body;
+
+    p = (const char *)r + MS_LOG_PUT_HDR;
+    for (i = 0; i < 7; i++)
+    {
+        memcpy(&l, (const char *)r + MS_LOG_REC_HDR + 24 + i * 4, 4);
+        f[i]->s = (char *)p;
+        f[i]->len = (int)l;
+        p += l;
+    }
+}
+
+// checks the record at off of segment i, returns its length or 0
+static unsigned int ms_log_check(int i, unsigned int off)
+{
+    const t_ms_log_rec *r = (const t_ms_log_rec *)(ml_maps[i] + off);
+    unsigned int size = (unsigned int)ms_log_segment_size;
+    uint32_t l[7];
+    unsigned int n;
+    int k;
+
+    if (off + MS_LOG_REC_HDR > size || r->magic != MS_LOG_REC_MAGIC
+        || r->seq != ml_log->segs[i].seq || r->len < MS_LOG_REC_HDR
+        || (r->len & 7) || r->len > size - off)
+        return 0;
+    if (ms_log_rec_crc(r) != r->crc)
+        return 0;
+
+    if (r->type == MS_LOG_PUT)
+    {
+        if (r->len < MS_LOG_PUT_HDR)
+            return 0;
+        memcpy(l, (const char *)r + MS_LOG_REC_HDR + 24, sizeof(l));
+        // each length is bounded first, their sum could wrap
+        for (n = MS_LOG_PUT_HDR, k = 0; k < 7; k++)
+        {
+            if (l[k] > r->len - n)
+                return 0;
+            n += l[k];
+        }
+    }
+
+    return r->len;
+}
+
+static void ms_log_sync_range(int i, unsigned int off, unsigned int len)
+{
+    long pg = sysconf(_SC_PAGESIZE);
+    unsigned int start = off & ~(unsigned int)(pg - 1);
+
+    if (ms_log_sync <= 0 || len == 0)
+        return;
+
+    if (msync(ml_maps[i] + start, off + len - start,
+              ms_log_sync > 1 ? MS_SYNC : MS_ASYNC) < 0)
+        LM_ERR("msync of segment %d failed: %s\n", i, strerror(errno));
+}
+
+static void ms_log_seg_write_hdr(int i)
+{
+    t_ms_log_seg_hdr *h = (t_ms_log_seg_hdr *)ml_maps[i];
+
+    h->seq = ml_log->segs[i].seq;
+    h->size = (uint64_t)ms_log_segment_size;
+    h->next_mid = (int64_t)ml_log->next_mid;
+    __sync_synchronize();
+    memcpy(h->magic, MS_LOG_SEG_MAGIC, 8);
+    ms_log_sync_range(i, 0, MS_LOG_SEG_HDR);
+}
+
+static int ms_log_seg_roll(void)
+{
+    int i;
+
+    for (i = 0; i < ms_log_segments; i++)
+        if (ml_log->segs[i].seq == 0)
+            break;
+    if (i == ms_log_segments)
+        return -1;
+
+    ml_log->segs[i].seq = ml_log->next_seq++;
+    ml_log->segs[i].used = MS_LOG_SEG_HDR;
+    ml_log->segs[i].live = 0;
+    ms_log_seg_write_hdr(i);
+    ml_log->active = i;
+
+    LM_DBG("log segment %d active, seq %llu\n", i,
+           (unsigned long long)ml_log->segs[i].seq);
+    return 0;
+}
+
+static void ms_log_seg_free(int i)
+{
+    ml_log->segs[i].seq = 0;
+    ml_log->segs[i].used = 0;
+    ml_log->segs[i].live = 0;
+    ms_log_seg_write_hdr(i);
+}
+
+/**
+ * append record r (crc, magic and seq are set here) to the active segment,
+ * returns the segment and sets *off, -1 if the log is full
+ */
+static int ms_log_append(t_ms_log_rec *r, unsigned int *off)
+{
+    t_ms_log_rec *dst;
+    int i = ml_log->active;
+
+    if (r->len > (unsigned int)ms_log_segment_size - MS_LOG_SEG_HDR)
+    {
+        LM_ERR("record of %u bytes does not fit in a segment\n", r->len);
+        return -1;
+    }
+
+    if (ml_log->segs[i].used + r->len > (unsigned int)ms_log_segment_size)
+    {
+        if (ms_log_seg_roll() < 0)
+        {
+            LM_ERR("message log is full\n");
+            return -1;
+        }
+        i = ml_log->active;
+    }
+
+    *off = ml_log->segs[i].used;
+    dst = (t_ms_log_rec *)(ml_maps[i] + *off);
+
+    r->magic = 0;
+    r->seq = ml_log->segs[i].seq;
+    r->crc = ms_log_rec_crc(r);
+    memcpy((char *)dst + 4, (char *)r + 4, r->len - 4);
+    __sync_synchronize();
+    dst->magic = MS_LOG_REC_MAGIC;
+
+    ml_log->segs[i].used += r->len;
+    ms_log_sync_range(i, *off, r->len);
+
+    return i;
+}
+
+static int ms_log_append_op(int type, t_msg_mid mid, int64_t arg)
+{
+    t_ms_log_rec r;
+    unsigned int off;
+
+    memset(&r, 0, sizeof(r));
+    r.len = MS_LOG_REC_HDR;
+    r.type = type;
+    r.mid = mid;
+    r.arg = arg;
+
+    return ms_log_append(&r, &off) < 0 ? -1 : 0;
+}
+
+/**
+ * copy the PUT record of e into the process buffer at off
+ */
+static int ms_log_copy(ms_log_ent e, unsigned int off)
+{
+    if (ms_log_buf_grow(off + e->len) < 0)
+        return -1;
+    memcpy(ml_buf + off, ml_maps[e->seg] + e->off, e->len);
+    return 0;
+}
+
+/*** recovery ***/
+
+static int ms_log_replay(int i, time_t now)
+{
+    unsigned int off = MS_LOG_SEG_HDR, len;
+    const t_ms_log_rec *r;
+    ms_log_ent e;
+    t_ms_row row;
+
+    while ((len = ms_log_check(i, off)) != 0)
+    {
+        r = (const t_ms_log_rec *)(ml_maps[i] + off);
+        e = ms_log_find((t_msg_mid)r->mid);
+        if ((t_msg_mid)r->mid >= ml_log->next_mid)
+            ml_log->next_mid = (t_msg_mid)r->mid + 1;
+
+        switch (r->type)
+        {
+        case MS_LOG_PUT:
+            ms_log_decode(r, &row);
+            // a copy left by an interrupted compaction is replaced
+            if (e)
+                ms_log_drop(e);
+            if (row.exp_time <= now)
+                break;
+            e = ms_log_ent_new(row.mid, &row.user, &row.host, &row.msg_type);
+            if (e == NULL)
+                return -1;
+            e->seg = i;
+            e->off = off;
+            e->len = len;
+            e->exp_time = row.exp_time;
+            e->snd_time = row.snd_time;
+            ms_log_link(e);
+            break;
+        case MS_LOG_DEL:
+            if (e)
+                ms_log_drop(e);
+            break;
+        case MS_LOG_STIME:
+            if (e)
+                e->snd_time = (time_t)r->arg;
+            break;
+        default:
+            LM_WARN("unknown record type %d in segment %d\n", r->type, i);
+        }
+        off += len;
+    }
+
+    ml_log->segs[i].used = off;
+    return 0;
+}
+
+static int ms_log_open(int i)
+{
+    char path[1024];
+    struct stat st;
+    int fd;
+
+    if (snprintf(path, sizeof(path), "%s/msilo.%d.seg", ms_log_dir, i)
+        >= (int)sizeof(path))
+    {
+        LM_ERR("log_dir too long\n");
+        return -1;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+    {
+        LM_ERR("cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) < 0)
+    {
+        LM_ERR("cannot stat %s: %s\n", path, strerror(errno));
+        goto error;
+    }
+    if (st.st_size != 0 && st.st_size != ms_log_segment_size)
+    {
+        LM_ERR("%s has %lld bytes, log_segment_size is %d\n", path,
+               (long long)st.st_size, ms_log_segment_size);
+        goto error;
+    }
+    if (st.st_size == 0 && ftruncate(fd, ms_log_segment_size) < 0)
+    {
+        LM_ERR("cannot size %s: %s\n", path, strerror(errno));
+        goto error;
+    }
+
+    ml_maps[i] = mmap(NULL, ms_log_segment_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    if (ml_maps[i] == MAP_FAILED)
+    {
+        ml_maps[i] = NULL;
+        LM_ERR("cannot map %s: %s\n", path, strerror(errno));
+        goto error;
+    }
+    ml_fds[i] = fd;
+
+    return 0;
+
+error:
+    close(fd);
+    return -1;
+}
+
+static int ms_log_init(void)
+{
+    t_ms_log_seg_hdr *h;
+    int *order = NULL;
+    unsigned int b;
+    time_t now;
+    int i, k, n;
+
+    if (ms_log_dir == NULL || *ms_log_dir == '\0')
+    {
+        LM_ERR("log_dir is required by the log storage\n");
+        return -1;
+    }
+    if (ms_log_segments < MS_LOG_MIN_SEGMENTS)
+    {
+        LM_WARN("log_segments raised to %d\n", MS_LOG_MIN_SEGMENTS);
+        ms_log_segments = MS_LOG_MIN_SEGMENTS;
+    }
+    if (ms_log_segment_size < MS_LOG_MIN_SEGMENT_SIZE)
+    {
+        LM_WARN("log_segment_size raised to %d\n", MS_LOG_MIN_SEGMENT_SIZE);
+        ms_log_segment_size = MS_LOG_MIN_SEGMENT_SIZE;
+    }
+    ms_log_segment_size = MS_LOG_ALIGN(ms_log_segment_size);
+
+    ms_log_crc_init();
+
+    ml_log = (ms_log)shm_malloc(sizeof(t_ms_log)
+                                + ms_log_segments * sizeof(t_ms_log_seg));
+    if (ml_log == NULL)
+    {
+        LM_ERR("no more shm\n");
+        return -1;
+    }
+    memset(ml_log, 0, sizeof(t_ms_log) + ms_log_segments * sizeof(t_ms_log_seg));
+    ml_log->next_seq = 1;
+    ml_log->next_mid = 1;
+    ml_log->compact = -1;
+
+    for (b = MS_LOG_MIN_BUCKETS; b < MS_LOG_MAX_BUCKETS
+         && b < (unsigned long long)ms_log_segments * ms_log_segment_size / MS_LOG_AVG_REC;)
+        b <<= 1;
+    ml_log->buckets = b;
+    ml_log->mids = (ms_log_ent *)shm_malloc(b * sizeof(ms_log_ent));
+    ml_log->aors = (ms_log_ent *)shm_malloc(b * sizeof(ms_log_ent));
+    ml_maps = (char **)pkg_malloc(ms_log_segments * sizeof(char *));
+    ml_fds = (int *)pkg_malloc(ms_log_segments * sizeof(int));
+    order = (int *)pkg_malloc(ms_log_segments * sizeof(int));
+    if (ml_log->mids == NULL || ml_log->aors == NULL || ml_maps == NULL
+        || ml_fds == NULL || order == NULL)
+    {
+        LM_ERR("no more memory\n");
+        goto error;
+    }
+    memset(ml_log->mids, 0, b * sizeof(ms_log_ent));
+    memset(ml_log->aors, 0, b * sizeof(ms_log_ent));
+    memset(ml_maps, 0, ms_log_segments * sizeof(char *));
+    for (i = 0; i < ms_log_segments; i++)
+        ml_fds[i] = -1;
+
+    if (lock_init(&ml_log->lock) == 0)
+    {
+        LM_CRIT("could not initialize a lock\n");
+        goto error;
+    }
+
+    // open the segments and order the used ones by seq
+    for (n = 0, i = 0; i < ms_log_segments; i++)
+    {
+        if (ms_log_open(i) < 0)
+            goto error;
+
+        h = (t_ms_log_seg_hdr *)ml_maps[i];
+        if (memcmp(h->magic, MS_LOG_SEG_MAGIC, 8) != 0 || h->seq == 0
+            || h->size != (uint64_t)ms_log_segment_size)
+            continue;
+
+        ml_log->segs[i].seq = h->seq;
+        if (h->seq >= ml_log->next_seq)
+            ml_log->next_seq = h->seq + 1;
+        if (h->next_mid > ml_log->next_mid)
+            ml_log->next_mid = (t_msg_mid)h->next_mid;
+
+        for (k = n++; k > 0 && ml_log->segs[order[k - 1]].seq > h->seq; k--)
+            order[k] = order[k - 1];
+        order[k] = i;
+    }
+
+    now = time(NULL);
+    for (k = 0; k < n; k++)
+        if (ms_log_replay(order[k], now) < 0)
+            goto error;
+
+    if (n > 0)
+        ml_log->active = order[n - 1];
+    else if (ms_log_seg_roll() < 0)
+        goto error;
+
+    LM_INFO("message log: %d segments of %d bytes, %d used, %ld messages\n",
+            ms_log_segments, ms_log_segment_size, n, ml_log->count);
+
+    pkg_free(order);
+    return 0;
+
+error:
+    if (order)
+        pkg_free(order);
+    return -1;
+}
+
+static int ms_log_child_init(int rank)
+{
+    return 0;
+}
+
+static void ms_log_destroy(void)
+{
+    int i;
+
+    if (ml_maps == NULL)
+        return;
+
+    for (i = 0; i < ms_log_segments; i++)
+    {
+        if (ml_maps[i])
+        {
+            msync(ml_maps[i], ms_log_segment_size, MS_SYNC);
+            munmap(ml_maps[i], ms_log_segment_size);
+        }
+        if (ml_fds[i] >= 0)
+            close(ml_fds[i]);
+    }
+    pkg_free(ml_maps);
+    pkg_free(ml_fds);
+    ml_maps = NULL;
+    ml_fds = NULL;
+}
+
+/*** store API ***/
+
+static int ms_log_count(str *user, str *host)
+{
+    unsigned int hash = ms_log_aor_hash(user, host);
+    ms_log_ent e;
+    int n = 0;
+
+    lock_get(&ml_log->lock);
+    for (e = ml_log->aors[hash & (ml_log->buckets - 1)]; e; e = e->aor_next)
+        if (ms_log_ent_match(e, user, host, hash))
+            n++;
+    lock_release(&ml_log->lock);
+
+    return n;
+}
+
+static int ms_log_insert(ms_row row, t_msg_mid *mid)
+{
+    const str *f[7] = { &row->user, &row->host, &row->from, &row->to,
+                        &row->ctype, &row->msg_type, &row->body };
+    t_ms_log_rec *r;
+    ms_log_ent e;
+    unsigned int len, off;
+    uint32_t l;
+    int64_t t;
+    char *p;
+    int i, seg;
+
+    *mid = 0;
+
+    for (len = MS_LOG_PUT_HDR, i = 0; i < 7; i++)
+        len += f[i]->len > 0 ? f[i]->len : 0;
+    len = MS_LOG_ALIGN(len);
+    if (ms_log_buf_grow(len) < 0)
+        return -1;
+
+    // the record is built outside the lock
+    memset(ml_buf, 0, len);
+    r = (t_ms_log_rec *)ml_buf;
+    r->len = len;
+    r->type = MS_LOG_PUT;
+    p = ml_buf + MS_LOG_REC_HDR;
+    t = row->inc_time;
+    memcpy(p, &t, 8);
+    t = row->exp_time;
+    memcpy(p + 8, &t, 8);
+    t = row->snd_time;
+    memcpy(p + 16, &t, 8);
+    p = ml_buf + MS_LOG_PUT_HDR;
+    for (i = 0; i < 7; i++)
+    {
+        l = f[i]->len > 0 ? f[i]->len : 0;
+        memcpy(ml_buf + MS_LOG_REC_HDR + 24 + i * 4, &l, 4);
+        if (l)
+            memcpy(p, f[i]->s, l);
+        p += l;
+    }
+
+    e = ms_log_ent_new(0, &row->user, &row->host, &row->msg_type);
+    if (e == NULL)
+        return -1;
+    e->exp_time = row->exp_time;
+    e->snd_time = row->snd_time;
+
+    lock_get(&ml_log->lock);
+    r->mid = ml_log->next_mid;
+    seg = ms_log_append(r, &off);
+    if (seg < 0)
+    {
+        lock_release(&ml_log->lock);
+        shm_free(e);
+        return -1;
+    }
+    ml_log->next_mid++;
+    e->mid = (t_msg_mid)r->mid;
+    e->seg = seg;
+    e->off = off;
+    e->len = len;
+    ms_log_link(e);
+    lock_release(&ml_log->lock);
+
+    *mid = e->mid;
+    return 0;
+}
+
+// dump result, copied out of the index under the lock, packed one after
+// the other in the process buffer
+typedef struct _ms_log_dump_ent
+{
+    t_msg_mid mid;
+    time_t exp_time;
+    int type_len;
+    char type[];
+} t_ms_log_dump_ent;
+
+#define MS_LOG_DUMP_ENT_LEN(_l) \
+    MS_LOG_ALIGN((unsigned int)(sizeof(t_ms_log_dump_ent) + (_l)))
+
+static int ms_log_dump(str *user, str *host, t_msg_mid after, int limit,
+                       ms_row_f f, void *param)
+{
+    unsigned int hash = ms_log_aor_hash(user, host);
+    t_ms_log_dump_ent *d;
+    t_ms_row row;
+    ms_log_ent e;
+    unsigned int off = 0, len;
+    int i, n = 0;
+
+    lock_get(&ml_log->lock);
+    for (e = ml_log->aors[hash & (ml_log->buckets - 1)]; e; e = e->aor_next)
+    {
+        if (e->mid <= after || e->snd_time != 0
+            || !ms_log_ent_match(e, user, host, hash))
+            continue;
+        if (limit > 0 && n >= limit)
+            break;
+        len = MS_LOG_DUMP_ENT_LEN(e->msg_type.len);
+        if (ms_log_buf_grow(off + len) < 0)
+            break;
+        d = (t_ms_log_dump_ent *)(ml_buf + off);
+        off += len;
+        n++;
+        d->mid = e->mid;
+        d->exp_time = e->exp_time;
+        d->type_len = e->msg_type.len;
+        memcpy(d->type, e->msg_type.s, e->msg_type.len);
+    }
+    lock_release(&ml_log->lock);
+
+    memset(&row, 0, sizeof(t_ms_row));
+    for (off = 0, i = 0; i < n; i++)
+    {
+        d = (t_ms_log_dump_ent *)(ml_buf + off);
+        off += MS_LOG_DUMP_ENT_LEN(d->type_len);
+        row.mid = d->mid;
+        row.exp_time = d->exp_time;
+        row.msg_type.s = d->type;
+        row.msg_type.len = d->type_len;
+        if (f(&row, param) < 0)
+            break;
+    }
+
+    return n;
+}
+
+static int ms_log_load(const t_msg_mid *mids, int n, ms_row_f f, void *param)
+{
+    ms_log_ent e;
+    t_ms_row row;
+    int i, rows = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        lock_get(&ml_log->lock);
+        e = ms_log_find(mids[i]);
+        if (e == NULL || ms_log_copy(e, 0) < 0)
+        {
+            lock_release(&ml_log->lock);
+            continue;
+        }
+        lock_release(&ml_log->lock);
+
+        ms_log_decode((t_ms_log_rec *)ml_buf, &row);
+        rows++;
+        if (f(&row, param) < 0)
+            break;
+    }
+
+    return rows;
+}
+
+static int ms_log_remove(t_msg_mid mid)
+{
+    ms_log_ent e;
+    int ret = 0;
+
+    lock_get(&ml_log->lock);
+    e = ms_log_find(mid);
+    if (e)
+    {
+        ret = ms_log_append_op(MS_LOG_DEL, mid, 0);
+        if (ret == 0)
+            ms_log_drop(e);
+    }
+    lock_release(&ml_log->lock);
+
+    return ret;
+}
+
+static int ms_log_expire(time_t now)
+{
+    ms_log_ent e, next;
+    unsigned int i;
+    int n = 0;
+
+    lock_get(&ml_log->lock);
+    for (i = 0; i < ml_log->buckets; i++)
+    {
+        for (e = ml_log->mids[i]; e; e = next)
+        {
+            next = e->mid_next;
+            if (e->exp_time <= now)
+            {
+                ms_log_drop(e);
+                n++;
+            }
+        }
+    }
+    lock_release(&ml_log->lock);
+
+    if (n)
+        LM_DBG("%d messages expired\n", n);
+    return n;
+}
+
+static int ms_log_reminders(time_t now, ms_row_f f, void *param)
+{
+    t_msg_mid *mids = NULL;
+    ms_log_ent e;
+    unsigned int i;
+    int n = 0, size = 0, ret;
+
+    // collect the ids first, the rows are copied one by one by load
+    lock_get(&ml_log->lock);
+    for (i = 0; i < ml_log->buckets; i++)
+    {
+        for (e = ml_log->mids[i]; e; e = e->mid_next)
+        {
+            if (e->snd_time == 0 || e->snd_time > now)
+                continue;
+            if (n == size)
+            {
+                t_msg_mid *m;
+                size = size ? 2 * size : 64;
+                m = (t_msg_mid *)pkg_malloc(size * sizeof(t_msg_mid));
+                if (m == NULL)
+                    break;
+                if (mids)
+                {
+                    memcpy(m, mids, n * sizeof(t_msg_mid));
+                    pkg_free(mids);
+                }
+                mids = m;
+            }
+            mids[n++] = e->mid;
+        }
+    }
+    lock_release(&ml_log->lock);
+
+    ret = n ? ms_log_load(mids, n, f, param) : 0;
+    if (mids)
+        pkg_free(mids);
+
+    return ret;
+}
+
+static int ms_log_reset_stime(t_msg_mid mid)
+{
+    ms_log_ent e;
+    int ret = -1;
+
+    lock_get(&ml_log->lock);
+    e = ms_log_find(mid);
+    if (e && ms_log_append_op(MS_LOG_STIME, mid, 0) == 0)
+    {
+        e->snd_time = 0;
+        ret = 0;
+    }
+    lock_release(&ml_log->lock);
+
+    return ret;
+}
+
+/**
+ * move the next live message of segment v, looking from bucket *b on,
+ * called with the lock held; returns 1 if one was moved, 0 if none was
+ * found within a scan step, -1 on error
+ */
+static int ms_log_compact_step(int v, unsigned int *b)
+{
+    ms_log_ent e;
+    t_ms_log_rec *r;
+    unsigned int k, off;
+    int64_t t;
+    int seg;
+
+    for (k = 0; *b < ml_log->buckets && k < MS_LOG_COMPACT_SCAN; (*b)++, k++)
+    {
+        for (e = ml_log->mids[*b]; e; e = e->mid_next)
+            if (e->seg == v)
+                break;
+        if (e == NULL)
+            continue;
+
+        if (ms_log_copy(e, 0) < 0)
+            return -1;
+        r = (t_ms_log_rec *)ml_buf;
+        // the copy carries the current send time, older STIMEs go away
+        t = e->snd_time;
+        memcpy(ml_buf + MS_LOG_REC_HDR + 16, &t, 8);
+        seg = ms_log_append(r, &off);
+        if (seg < 0)
+            return -1;
+        ml_log->segs[e->seg].live -= e->len;
+        e->seg = seg;
+        e->off = off;
+        ml_log->segs[seg].live += e->len;
+        // the bucket may hold more of v, it is looked at again
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * rewrite the live messages of segment v into the active segment, then free
+ * v; the lock is released between the steps, the messages stored meanwhile
+ * go to the active segment and never to v
+ */
+static int ms_log_compact(int v)
+{
+    unsigned int b = 0;
+    int ret = 0, n = 0;
+
+    for (;;)
+    {
+        lock_get(&ml_log->lock);
+        if (ml_log->segs[v].live == 0 || b >= ml_log->buckets)
+            break;
+        ret = ms_log_compact_step(v, &b);
+        if (ret < 0)
+            break;
+        n += ret;
+        lock_release(&ml_log->lock);
+    }
+
+    if (ret == 0)
+    {
+        // the copies are on disk before the old segment goes
+        if (ms_log_sync > 0)
+            ms_log_sync_range(ml_log->active, MS_LOG_SEG_HDR,
+                              ml_log->segs[ml_log->active].used - MS_LOG_SEG_HDR);
+        LM_DBG("segment %d compacted, %d messages moved\n", v, n);
+        ms_log_seg_free(v);
+    }
+    ml_log->compact = -1;
+    lock_release(&ml_log->lock);
+
+    return ret;
+}
+
+static void ms_log_maintain(void)
+{
+    t_ms_log_seg *s;
+    int i, v, free_n;
+
+    lock_get(&ml_log->lock);
+
+    if (ml_log->compact >= 0)
+    {
+        lock_release(&ml_log->lock);
+        return;
+    }
+
+    for (v = -1, free_n = 0, i = 0; i < ms_log_segments; i++)
+    {
+        s = &ml_log->segs[i];
+        if (s->seq == 0)
+        {
+            free_n++;
+            continue;
+        }
+        if (i != ml_log->active && (v < 0 || s->seq < ml_log->segs[v].seq))
+            v = i;
+    }
+
+    if (v >= 0)
+    {
+        s = &ml_log->segs[v];
+        if (free_n >= 2 && (uint64_t)s->live * 4 > s->used - MS_LOG_SEG_HDR)
+            v = -1;
+    }
+    ml_log->compact = v;
+
+    lock_release(&ml_log->lock);
+
+    if (v >= 0 && ms_log_compact(v) < 0)
+        LM_ERR("failed to compact log segment %d\n", v);
+}
+
+t_ms_store ms_log_store = {
+    "log",
+    MS_STORE_CAP_IDS | MS_STORE_CAP_INDEXED | MS_STORE_CAP_PAGED,
+    ms_log_init,
+    ms_log_child_init,
+    ms_log_destroy,
+    ms_log_count,
+    ms_log_insert,
+    ms_log_dump,
+    ms_log_load,
+    ms_log_remove,
+    ms_log_expire,
+    ms_log_reminders,
+    ms_log_reset_stime,
+    ms_log_maintain
+};
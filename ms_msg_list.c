@@ -268,6 +268,32 @@ errorx:
 	return MSG_LIST_ERR;
 }
 
+/**
+ * flags of the message with mid, MSG_LIST_ERR if it is not in the sent list
+ */
+int msg_list_get_flag(msg_list ml, t_msg_mid mid)
+{
+	msg_list_el p0;
+	int fl = MSG_LIST_ERR;
+
+	if(ml==0 || mid==0)
+		return MSG_LIST_ERR;
+
+	lock_get(&ml->sem_sent);
+
+	for(p0 = ml->lsent; p0; p0 = p0->next)
+	{
+		if(p0->msgid==mid)
+		{
+			fl = p0->flag;
+			break;
+		}
+	}
+
+	lock_release(&ml->sem_sent);
+	return fl;
+}
+
 /**
  * check if the messages from list were sent
  */
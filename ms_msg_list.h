@@ -83,6 +83,7 @@ msg_list msg_list_init();
 void msg_list_free(msg_list);
 int msg_list_check_msg(msg_list, t_msg_mid, int *, int *);
 int msg_list_set_flag(msg_list, t_msg_mid, int);
+int msg_list_get_flag(msg_list, t_msg_mid);
 int msg_list_check(msg_list);
 msg_list_el msg_list_reset(msg_list);
 
@@ -0,0 +1,98 @@
+//
+// Message storage backends. The module logic (m_store, m_dump, the sender,
+// the cleaner and the reminder timer) only talks to the selected t_ms_store;
+// "db" keeps the messages in the SQL table through the DB API, "log" in
+// memory mapped segment files on local disk.
+//
+
+#ifndef OPENSIPS_1_11_2_TLS_MS_STORE_H
+#define OPENSIPS_1_11_2_TLS_MS_STORE_H
+
+#include <time.h>
+#include "../../str.h"
+#include "msilo.h"
+
+// Backend reports the id of an inserted message.
+#define MS_STORE_CAP_IDS      (1<<0)
+// Backend keeps its own in-memory index, the message cache is pointless.
+#define MS_STORE_CAP_INDEXED  (1<<1)
+// Backend reads a page of an AoR without loading the rest of its messages.
+#define MS_STORE_CAP_PAGED    (1<<2)
+
+// One stored message. Strings handed to callbacks are valid only during
+// the callback.
+typedef struct _ms_row
+{
+    t_msg_mid mid;
+    str user;      // owner AoR
+    str host;
+    str from;
+    str to;
+    str body;
+    str ctype;
+    str msg_type;
+    time_t inc_time;
+    time_t exp_time;
+    time_t snd_time;
+} t_ms_row, *ms_row;
+
+// Iteration callback, return 0 to continue, <0 to stop.
+typedef int (*ms_row_f)(ms_row row, void *param);
+
+typedef struct _ms_store
+{
+    char *name;
+    int caps;
+
+    int  (*init)(void);             // mod_init, before fork
+    int  (*child_init)(int rank);
+    void (*destroy)(void);
+
+    // number of stored messages of the AoR
+    int  (*count)(str *user, str *host);
+    // store a message, *mid is 0 if the backend cannot tell
+    int  (*insert)(ms_row row, t_msg_mid *mid);
+    // messages waiting for the AoR (snd_time 0), in id order, only ids
+    // above after and at most limit of them if limit > 0; rows carry the
+    // mid, exp_time and msg_type only
+    int  (*dump)(str *user, str *host, t_msg_mid after, int limit,
+                 ms_row_f f, void *param);
+    // rows of the given ids, missing ids are skipped
+    int  (*load)(const t_msg_mid *mids, int n, ms_row_f f, void *param);
+    int  (*remove)(t_msg_mid mid);
+    // drop messages expired at now, returns how many if the backend
+    // knows, 0 otherwise
+    int  (*expire)(time_t now);
+    // reminders due at now (0 < snd_time <= now)
+    int  (*reminders)(time_t now, ms_row_f f, void *param);
+    // turn a failed reminder into a regular offline message
+    int  (*reset_stime)(t_msg_mid mid);
+    // periodic housekeeping from the clean timer, may be NULL
+    void (*maintain)(void);
+} t_ms_store, *ms_store;
+
+/** SQL backend - ms_db.c */
+extern t_ms_store ms_db_store;
+extern str ms_db_url;
+extern str ms_db_table;
+extern int ms_db_fetch_rows;
+extern str sc_mid;
+extern str sc_from;
+extern str sc_to;
+extern str sc_uri_user;
+extern str sc_uri_host;
+extern str sc_body;
+extern str sc_ctype;
+extern str sc_exp_time;
+extern str sc_inc_time;
+extern str sc_snd_time;
+extern str sc_msg_type;
+
+/** memory mapped log backend - ms_log.c */
+extern t_ms_store ms_log_store;
+extern char* ms_log_dir;
+extern int ms_log_segment_size;
+extern int ms_log_segments;
+extern int ms_log_sync;
+
+#endif //OPENSIPS_1_11_2_TLS_MS_STORE_H
@@ -0,0 +1,353 @@
+/*
+ * MSILO module - string and time helpers, no core dependencies
+ *
+ * Copyright (C) 2001-2003 FhG Fokus
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "ms_text.h"
+
+/**
+ * byte sets searched by ms_find_special: up to MS_BYTESET_MAX explicit
+ * bytes, optionally any control byte (< 0x20)
+ */
+const ms_byteset_t ms_set_sql = { 1, 0, {'\''} };
+const ms_byteset_t ms_set_json = { 2, 1, {'"', '\\'} };
+const ms_byteset_t ms_set_token_end = { 2, 1, {' ', ';'} };
+
+static inline int ms_byteset_match(const ms_byteset_t *set, unsigned char c)
+{
+	int i;
+
+	if(set->ctrl && c < 0x20)
+		return 1;
+	for(i = 0; i < set->n; i++)
+		if(c == set->bytes[i])
+			return 1;
+	return 0;
+}
+
+/**
+ * find the first byte of [p, end) that is in set
+ * return: pointer to the byte ; end if there is none
+ */
+const char* ms_find_special(const char *p, const char *end,
+		const ms_byteset_t *set)
+{
+	int i;
+
+#if defined(__AVX2__)
+	{
+		const __m256i ctrl_max = _mm256_set1_epi8(0x1f);
+		__m256i want[MS_BYTESET_MAX];
+
+		for(i = 0; i < set->n; i++)
+			want[i] = _mm256_set1_epi8((char)set->bytes[i]);
+
+		while(end - p >= 32)
+		{
+			__m256i v = _mm256_loadu_si256((const __m256i*)p);
+			__m256i hit = set->ctrl
+				? _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctrl_max), v)
+				: _mm256_setzero_si256();
+			unsigned int mask;
+
+			for(i = 0; i < set->n; i++)
+				hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, want[i]));
+
+			mask = (unsigned int)_mm256_movemask_epi8(hit);
+			if(mask)
+				return p + __builtin_ctz(mask);
+			p += 32;
+		}
+	}
+#endif
+#if defined(__SSE2__)
+	{
+		const __m128i ctrl_max = _mm_set1_epi8(0x1f);
+		__m128i want[MS_BYTESET_MAX];
+
+		for(i = 0; i < set->n; i++)
+			want[i] = _mm_set1_epi8((char)set->bytes[i]);
+
+		while(end - p >= 16)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i*)p);
+			/* unsigned v <= 0x1f  <=>  min(v, 0x1f) == v */
+			__m128i hit = set->ctrl
+				? _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl_max), v)
+				: _mm_setzero_si128();
+			unsigned int mask;
+
+			for(i = 0; i < set->n; i++)
+				hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, want[i]));
+
+			mask = (unsigned int)_mm_movemask_epi8(hit);
+			if(mask)
+				return p + __builtin_ctz(mask);
+			p += 16;
+		}
+	}
+#endif
+
+	for(; p < end; p++)
+		if(ms_byteset_match(set, (unsigned char)*p))
+			return p;
+
+	return end;
+}
+
+/**
+ * copy src to dst escaping the special bytes of the mode, runs without
+ * special bytes are copied with memcpy
+ * - mode: MS_ESC_SQL escapes apostrophes, MS_ESC_JSON makes src safe
+ *   inside a JSON string
+ * - dlen: size of dst, the result is always zero terminated
+ * - src may be NULL when slen is 0
+ * return: destination length => OK; -1 => bad params; -2 => dst too small
+ */
+int ms_escape_copy(const char *src, int slen, char *dst, int dlen, int mode)
+{
+	static const char hex[] = "0123456789abcdef";
+	const ms_byteset_t *set;
+	const char *p, *q, *end;
+	int j = 0;
+	int n;
+
+	if(!dst || dlen <= 0 || (!src && slen != 0))
+		return -1;
+
+	/* absent value, e.g. no X-MsgType, is an empty string */
+	if(!src || slen == 0)
+	{
+		dst[0] = '\0';
+		return 0;
+	}
+	if(slen == -1)
+		slen = strlen(src);
+
+	set = (mode == MS_ESC_JSON) ? &ms_set_json : &ms_set_sql;
+	p = src;
+	end = src + slen;
+	while(p < end)
+	{
+		q = ms_find_special(p, end, set);
+		n = q - p;
+		if(j + n >= dlen)
+			return -2;
+		memcpy(dst + j, p, n);
+		j += n;
+		if(q == end)
+			break;
+
+		if(mode == MS_ESC_JSON)
+		{
+			unsigned char c = (unsigned char)*q;
+			if(j + 6 >= dlen)
+				return -2;
+			dst[j++] = '\\';
+			switch(c)
+			{
+				case '"':  dst[j++] = '"'; break;
+				case '\\': dst[j++] = '\\'; break;
+				case '\n': dst[j++] = 'n'; break;
+				case '\r': dst[j++] = 'r'; break;
+				case '\t': dst[j++] = 't'; break;
+				default:
+					memcpy(dst + j, "u00", 3);
+					j += 3;
+					dst[j++] = hex[c >> 4];
+					dst[j++] = hex[c & 0x0f];
+			}
+		} else {
+			if(j + 2 >= dlen)
+				return -2;
+			memcpy(&dst[j], "\\'", 2);
+			j += 2;
+		}
+		p = q + 1;
+	}
+	dst[j] = '\0';
+
+	return j;
+}
+
+const char ms_day_names[7][3] = {
+	{'S','u','n'},{'M','o','n'},{'T','u','e'},{'W','e','d'},
+	{'T','h','u'},{'F','r','i'},{'S','a','t'}};
+const char ms_month_names[12][3] = {
+	{'J','a','n'},{'F','e','b'},{'M','a','r'},{'A','p','r'},
+	{'M','a','y'},{'J','u','n'},{'J','u','l'},{'A','u','g'},
+	{'S','e','p'},{'O','c','t'},{'N','o','v'},{'D','e','c'}};
+
+/**
+ * Break down a UTC time value without going through libc (no tz lock,
+ * no shared buffers). Only tm_year, tm_mon, tm_mday, tm_wday, tm_hour,
+ * tm_min and tm_sec are set.
+ */
+void ms_time_to_tm(time_t t, struct tm *tm)
+{
+	long long days = (long long)t / 86400;
+	long long secs = (long long)t % 86400;
+	long long era, doe, yoe, doy, mp, y;
+
+	if(secs < 0)
+	{
+		secs += 86400;
+		days -= 1;
+	}
+
+	tm->tm_hour = (int)(secs / 3600);
+	tm->tm_min = (int)(secs / 60 % 60);
+	tm->tm_sec = (int)(secs % 60);
+	/* 1970-01-01 was a Thursday */
+	tm->tm_wday = (int)((days % 7 + 11) % 7);
+
+	/* civil from days, proleptic Gregorian calendar */
+	days += 719468;
+	era = (days >= 0 ? days : days - 146096) / 146097;
+	doe = days - era * 146097;
+	yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+	y = yoe + era * 400;
+	doy = doe - (365*yoe + yoe/4 - yoe/100);
+	mp = (5*doy + 2) / 153;
+	tm->tm_mday = (int)(doy - (153*mp + 2)/5 + 1);
+	tm->tm_mon = (int)(mp < 10 ? mp + 2 : mp - 10);
+	tm->tm_year = (int)(y + (tm->tm_mon <= 1) - 1900);
+}
+
+/**
+ * Format the Date header into buf, which must hold SIP_DATE_MAX_LEN bytes
+ * return: length of the header ; -1 error
+ */
+int ms_format_sip_date(time_t date, char *buf)
+{
+	struct tm gmt;
+	int year;
+	char *p = buf;
+
+	ms_time_to_tm(date, &gmt);
+
+	year = 1900 + gmt.tm_year;
+	if(year < 1000 || year > 9999)
+		return -1;
+
+	/* In RFC 3261 the format is always GMT and in the string form like
+	 * "Wkday, Day Month Year HOUR:MIN:SEC GMT"
+	 * "Mon, 19 Feb 2007 18:42:27 GMT"
+	 */
+	memcpy(p, "Date: ", 6);
+	p += 6;
+	memcpy(p, ms_day_names[gmt.tm_wday], 3);
+	p += 3;
+	*p++ = ',';
+	*p++ = ' ';
+	p = ms_put_2digits(p, gmt.tm_mday);
+	*p++ = ' ';
+	memcpy(p, ms_month_names[gmt.tm_mon], 3);
+	p += 3;
+	*p++ = ' ';
+	p = ms_put_4digits(p, year);
+	*p++ = ' ';
+	p = ms_put_2digits(p, gmt.tm_hour);
+	*p++ = ':';
+	p = ms_put_2digits(p, gmt.tm_min);
+	*p++ = ':';
+	p = ms_put_2digits(p, gmt.tm_sec);
+	memcpy(p, " GMT\r\n", 6);
+	p += 6;
+	*p = '\0';
+
+	return p - buf;
+}
+
+/* days since 1970-01-01 of y-m-d, proleptic Gregorian, m in 1..12 */
+static inline long long ms_days_from_civil(long long y, unsigned m, unsigned d)
+{
+	long long era, yoe, doy, doe;
+
+	y -= (m <= 2);
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe/4 - yoe/100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+/**
+ * seconds since the epoch of a YYYYMMDDHHMMSS time taken as UTC; shorter
+ * values are accepted, missing digits count as zero
+ * return: 0 OK ; -1 bad params ; -2 too long ; -3 bad time
+ */
+int ms_time_from_digits(const char *s, int len, long long *time_val)
+{
+	unsigned char d[14];
+	unsigned int bad, i;
+	long long year, mon, mday, days;
+
+	if(s==NULL || len<=0 || time_val==NULL)
+		return -1;
+	if(len > 14)
+		return -2;
+
+	bad = 0;
+	memset(d, 0, sizeof(d));
+	for(i = 0; i < (unsigned int)len; i++)
+	{
+		d[i] = (unsigned char)(s[i] - '0');
+		bad |= (d[i] > 9);
+	}
+
+	/* range checks of the digits present */
+	bad |= (d[0] < 2);
+	bad |= (len > 4) & (d[4] > 1);
+	bad |= (len > 5) & (((d[4] == 0) & (d[5] == 0)) | ((d[4] == 1) & (d[5] > 2)));
+	bad |= (len > 6) & (d[6] > 3);
+	bad |= (len > 7) & (((d[6] == 0) & (d[7] == 0)) | ((d[6] == 3) & (d[7] > 1)));
+	bad |= (len > 8) & (d[8] > 2);
+	bad |= (len > 9) & ((d[8] == 2) & (d[9] > 3));
+	bad |= (len > 10) & (d[10] > 5);
+	bad |= (len > 12) & (d[12] > 5);
+	if(bad)
+		return -3;
+
+	year = 1000*d[0] + 100*d[1] + 10*d[2] + d[3];
+	/* month -1 (when present) and day 0 roll back like mktime() does */
+	mon = 10*d[4] + d[5] - (len > 4);
+	mday = 10*d[6] + d[7];
+	if(mon < 0)
+	{
+		mon += 12;
+		year -= 1;
+	}
+	days = ms_days_from_civil(year, (unsigned)mon + 1, 1) + mday - 1;
+
+	*time_val = days * 86400
+		+ (10*d[8] + d[9]) * 3600
+		+ (10*d[10] + d[11]) * 60
+		+ (10*d[12] + d[13]);
+
+	return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * MSILO module - string and time helpers, no core dependencies
+ *
+ * Copyright (C) 2001-2003 FhG Fokus
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _MS_TEXT_H_
+#define _MS_TEXT_H_
+
+#include <time.h>
+
+/*
+ * The helpers here only need libc, bench/ builds them without the core.
+ */
+
+/** set of bytes to stop at when scanning a string */
+#define MS_BYTESET_MAX	4
+
+typedef struct _ms_byteset
+{
+	int n;
+	int ctrl;
+	unsigned char bytes[MS_BYTESET_MAX];
+} ms_byteset_t;
+
+extern const ms_byteset_t ms_set_sql;
+extern const ms_byteset_t ms_set_json;
+extern const ms_byteset_t ms_set_token_end;
+
+/** find next byte from set, SIMD accelerated where available */
+const char* ms_find_special(const char *p, const char *end,
+		const ms_byteset_t *set);
+
+#define MS_ESC_SQL	0
+#define MS_ESC_JSON	1
+
+/** copy with escaping of the special bytes of the mode */
+int ms_escape_copy(const char *src, int slen, char *dst, int dlen, int mode);
+
+#define SIP_DATE_MAX_LEN	48
+
+extern const char ms_day_names[7][3];
+extern const char ms_month_names[12][3];
+
+static inline char* ms_put_2digits(char *p, int v)
+{
+	*p++ = '0' + v / 10;
+	*p++ = '0' + v % 10;
+	return p;
+}
+
+static inline char* ms_put_4digits(char *p, int v)
+{
+	p = ms_put_2digits(p, v / 100);
+	return ms_put_2digits(p, v % 100);
+}
+
+/** reentrant UTC break down of a time value */
+void ms_time_to_tm(time_t t, struct tm *tm);
+
+/** format the Date header line into buf of SIP_DATE_MAX_LEN bytes */
+int ms_format_sip_date(time_t date, char *buf);
+
+/** UTC time stamp of YYYYMMDDHHMMSS */
+int ms_time_from_digits(const char *s, int len, long long *time_val);
+
+#endif
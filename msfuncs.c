@@ -24,6 +24,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <time.h>
@@ -44,9 +45,20 @@
 #define EXTRA_OFFLINE_MSG_LEN (sizeof(EXTRA_OFFLINE_MSG)-1)
 #define EXTRA_OFFLINE_CHUNK "X-OfflineDump: "
 #define EXTRA_OFFLINE_CHUNK_LEN (sizeof(EXTRA_OFFLINE_CHUNK)-1)
-#define OFFLINE_CHUNK_ID_MAX_LEN 14
+#define CONTENT_TYPE_PREFIX "Content-Type: "
+#define CONTENT_TYPE_PREFIX_LEN (sizeof(CONTENT_TYPE_PREFIX)-1)
+#define MP_DASHES "--"
+#define MP_DASHES_LEN (sizeof(MP_DASHES)-1)
+#define BODY_DATE_PREFIX_MAX_LEN 48
+#define OFFLINE_PREFIX "[Offline message - "
+#define OFFLINE_PREFIX_LEN (sizeof(OFFLINE_PREFIX)-1)
+#define REMINDER_PREFIX "[Reminder message - "
+#define REMINDER_PREFIX_LEN (sizeof(REMINDER_PREFIX)-1)
 
 extern int ms_add_date;
+extern int ms_offline_date_fmt;
+extern int ms_reminder_date_fmt;
+extern long ms_snd_time_tz_offset;
 
 /**
  * apostrophes escaping
@@ -59,34 +71,145 @@ extern int ms_add_date;
 
 int m_apo_escape(char* src, int slen, char* dst, int dlen)
 {
-	int i, j;
+	return ms_escape_copy(src, slen, dst, dlen, MS_ESC_SQL);
+}
+
+/* last formatted Date headers of this process, indexed by the low bits
+ * of the time value - messages of one dump batch share few inc_times */
+#define SIP_DATE_CACHE_SIZE 16
+
+typedef struct _sip_date_cache
+{
+	time_t date;
+	int len;
+	char buf[SIP_DATE_MAX_LEN];
+} sip_date_cache_t;
+
+static sip_date_cache_t sip_date_cache[SIP_DATE_CACHE_SIZE];
+
+/* open addressing table of the pre-hashed header names */
+#define MS_HDR_TABLE_SIZE 8
 
-	if(!src || !dst || dlen <= 0)
+typedef struct _ms_hdr_slot
+{
+	str name;
+	unsigned int hash;
+	int id;
+} ms_hdr_slot_t;
+
+static ms_hdr_slot_t ms_hdr_table[MS_HDR_TABLE_SIZE];
+/* bit per name length, rejects most headers before hashing */
+static unsigned int ms_hdr_len_mask = 0;
+
+static inline unsigned int ms_hdr_hash(const char *s, int len)
+{
+	unsigned int h = 0;
+	int i;
+
+	for(i = 0; i < len; i++)
+		h = h * 31 + (unsigned char)(s[i] | 0x20);
+	return h;
+}
+
+/**
+ * hash the header names
+ * - names: array of MS_HDR_NAMES_NO names, indexed by MS_HDR_*
+ * return: 0 OK ; -1 error
+ */
+int ms_hdr_names_init(str *names)
+{
+	unsigned int h, i;
+	int id;
+
+	memset(ms_hdr_table, 0, sizeof(ms_hdr_table));
+	ms_hdr_len_mask = 0;
+
+	for(id = 0; id < MS_HDR_NAMES_NO; id++)
+	{
+		if(names[id].s == NULL || names[id].len <= 0)
+			return -1;
+
+		h = ms_hdr_hash(names[id].s, names[id].len);
+		for(i = h; ms_hdr_table[i & (MS_HDR_TABLE_SIZE-1)].name.s != NULL; i++);
+		i &= MS_HDR_TABLE_SIZE - 1;
+
+		ms_hdr_table[i].name = names[id];
+		ms_hdr_table[i].hash = h;
+		ms_hdr_table[i].id = id;
+		ms_hdr_len_mask |= 1u << (names[id].len & 31);
+	}
+
+	return 0;
+}
+
+static inline int ms_hdr_lookup(const str *name)
+{
+	unsigned int h, i;
+
+	if(!(ms_hdr_len_mask & (1u << (name->len & 31))))
 		return -1;
 
-	if(slen == -1)
-		slen = strlen(src);
+	h = ms_hdr_hash(name->s, name->len);
+	for(i = h; ms_hdr_table[i & (MS_HDR_TABLE_SIZE-1)].name.s != NULL; i++)
+	{
+		ms_hdr_slot_t *e = &ms_hdr_table[i & (MS_HDR_TABLE_SIZE-1)];
+		if(e->hash == h && e->name.len == name->len
+				&& strncasecmp(e->name.s, name->s, name->len) == 0)
+			return e->id;
+	}
+
+	return -1;
+}
+
+/**
+ * collect the headers msilo needs in a single walk, first instance wins
+ * - expects all headers to be parsed already (e.g. by get_body)
+ * return: 0 OK ; -1 error
+ */
+int ms_scan_headers(struct sip_msg *msg, ms_hdrs_t *hdrs)
+{
+	struct hdr_field *hf;
+	int id;
+
+	if(!msg || !hdrs)
+		return -1;
 
-	for(i=j=0; i<slen; i++)
+	memset(hdrs, 0, sizeof(ms_hdrs_t));
+	for(hf = msg->headers; hf; hf = hf->next)
 	{
-		switch(src[i])
+		switch(hf->type)
 		{
-			case '\'':
-					if(j+2>=dlen)
-						return -2;
-					memcpy(&dst[j], "\\'", 2);
-					j += 2;
+			case HDR_TO_T:
+				if(!hdrs->to)
+					hdrs->to = hf;
+				break;
+			case HDR_FROM_T:
+				if(!hdrs->from)
+					hdrs->from = hf;
+				break;
+			case HDR_CONTENTTYPE_T:
+				if(!hdrs->content_type)
+					hdrs->content_type = hf;
+				break;
+			case HDR_EXPIRES_T:
+				if(!hdrs->expires)
+					hdrs->expires = hf;
+				break;
+			case HDR_CONTACT_T:
+				if(!hdrs->contact)
+					hdrs->contact = hf;
+				break;
+			case HDR_OTHER_T:
+				id = ms_hdr_lookup(&hf->name);
+				if(id >= 0 && !hdrs->other[id])
+					hdrs->other[id] = hf;
 				break;
 			default:
-				if(j+1>=dlen)
-						return -2;
-				dst[j] = src[i];
-				j++;
+				break;
 		}
 	}
-	dst[j] = '\0';
 
-	return j;
+	return 0;
 }
 
 /**
@@ -99,29 +222,31 @@ int m_apo_escape(char* src, int slen, char* dst, int dlen)
   */
 int timetToSipDateStr(time_t date, char* buf, int bufLen)
 {
-	struct tm *gmt;
-	char* dayArray[7] = {"Sun","Mon","Tue","Wed","Thu","Fri","Sat"};
-	char* monthArray[12] = {"Jan","Feb","Mar","Apr","May","Jun","Jul","Aug","Sep","Oct","Nov","Dec"};
-	int len = 0;
-
-	gmt = gmtime(&date);
-	/* In RFC 3261 the format is always GMT and in the string form like
-	 * "Wkday, Day Month Year HOUR:MIN:SEC GMT"
-	 * "Mon, 19 Feb 2007 18:42:27 GMT"
-	 */
-	len = snprintf(buf,bufLen,"Date: %s, %02d %s %d %02d:%02d:%02d GMT\r\n",
-		dayArray[gmt->tm_wday],
-		gmt->tm_mday,
-		monthArray[gmt->tm_mon],
-		1900 + gmt->tm_year,
-		gmt->tm_hour,
-		gmt->tm_min,
-		gmt->tm_sec
-		);
-
-	/* snprintf returns number of chars it should have printed, so you
-	 * need to bounds check against input*/
-	return (len > bufLen) ? bufLen : len;
+	sip_date_cache_t *e;
+	int len;
+
+	if(buf == NULL || bufLen <= 0)
+		return -1;
+
+	e = &sip_date_cache[(unsigned long)date & (SIP_DATE_CACHE_SIZE - 1)];
+	if(e->len <= 0 || e->date != date)
+	{
+		len = ms_format_sip_date(date, e->buf);
+		if(len < 0)
+		{
+			e->len = 0;
+			return -1;
+		}
+		e->date = date;
+		e->len = len;
+	}
+
+	len = (e->len > bufLen) ? bufLen : e->len;
+	memcpy(buf, e->buf, len);
+	if(len < bufLen)
+		buf[len] = '\0';
+
+	return len;
 }
 
 /**
@@ -151,9 +276,8 @@ int m_extract_content_type(char* src, int len, content_type_t* ctype, int flag)
 		if((flag & CT_TYPE) && !(f & CT_TYPE))
 		{
 			ctype->type.s = p;
-			while(p < end && *p!=' ' && *p!='\t' && *p!='\0'
-					 && *p!=';' && *p!='\r' && *p!='\n')
-				p++;
+			/* ends at whitespace, ';', CR, LF or NUL */
+			p = (char*)ms_find_special(p, end, &ms_set_token_end);
 
 			LM_DBG("content-type found\n");
 			f |= CT_TYPE;
@@ -189,113 +313,535 @@ error:
 	return -1;
 }
 
+/** prepare the header template for one dump batch
+ *
+ * The X-Offline and X-OfflineDump lines are the same for every message
+ * of a batch, they are rendered once here and copied per message.
+ * return: 0 OK ; -1 error
+ * */
+int m_hdr_tpl_init(ms_hdr_tpl_t *tpl, long dumpId)
+{
+	char *p, *id;
+	int len;
+
+	if(!tpl)
+		return -1;
+
+	p = tpl->tail;
+	memcpy(p, EXTRA_OFFLINE_MSG EXTRA_OFFLINE_CHUNK,
+			EXTRA_OFFLINE_MSG_LEN + EXTRA_OFFLINE_CHUNK_LEN);
+	p += EXTRA_OFFLINE_MSG_LEN + EXTRA_OFFLINE_CHUNK_LEN;
+
+	if(dumpId < 0)
+		return -1;
+	id = int2str((unsigned long)dumpId, &len);
+	memcpy(p, id, len);
+	p += len;
+
+	memcpy(p, CRLF, CRLF_LEN);
+	p += CRLF_LEN;
+
+	tpl->dump_id = dumpId;
+	tpl->tail_len = p - tpl->tail;
+	return 0;
+}
+
+/** size of the buffer m_build_headers() needs for the given values */
+int m_build_headers_len(const ms_hdr_tpl_t *tpl, str ctype, str contact,
+		time_t date)
+{
+	if(!tpl || ctype.len < 0 || contact.len < 0)
+		return -1;
+
+	return ((date > 0) ? SIP_DATE_MAX_LEN : 0)
+		+ ((ctype.len > 0) ? CONTENT_TYPE_PREFIX_LEN+ctype.len+CRLF_LEN : 0)
+		+ ((contact.len > 0)
+			? CONTACT_PREFIX_LEN+contact.len+CONTACT_SUFFIX_LEN : 0)
+		+ tpl->tail_len;
+}
+
 /** build MESSAGE headers
  *
- * Add Content-Type, Contact and Date headers if they exist
+ * Add Date, Content-Type and Contact headers if they exist, followed by
+ * the batch lines of the template. Only the variable slots are written
+ * per message, the fixed parts are compile time constants.
  * expects - max buf len of the resulted body in body->len
  *         - body->s MUST be allocated
  * return: 0 OK ; -1 error
  * */
-int m_build_headers(str *buf, str ctype, str contact, time_t date, long dumpId)
+int m_build_headers(str *buf, const ms_hdr_tpl_t *tpl, str ctype, str contact,
+		time_t date)
 {
 	char *p;
-	char strDate[48];
 	int lenDate = 0;
 
-	if(!buf || !buf->s || buf->len <= 0 || ctype.len < 0 || contact.len < 0
-			|| buf->len <= ctype.len+contact.len+14 /*Content-Type: */
-				+CRLF_LEN+CONTACT_PREFIX_LEN+CONTACT_SUFFIX_LEN
-			    +CRLF_LEN+EXTRA_OFFLINE_MSG_LEN+5
-				+CRLF_LEN+EXTRA_OFFLINE_CHUNK_LEN+OFFLINE_CHUNK_ID_MAX_LEN)
+	if(!buf || !buf->s || buf->len <= 0 || !tpl || ctype.len < 0
+			|| contact.len < 0
+			|| buf->len < m_build_headers_len(tpl, ctype, contact, date))
 		goto error;
 
 	p = buf->s;
 	if(date > 0)
 	{
-		lenDate = timetToSipDateStr(date,strDate,48);
-		strncpy(p, strDate, lenDate);
-		p += lenDate;
+		lenDate = timetToSipDateStr(date, p, SIP_DATE_MAX_LEN);
+		if(lenDate > 0)
+			p += lenDate;
 	}
 	if(ctype.len > 0)
 	{
-		strncpy(p, "Content-Type: ", 14);
-		p += 14;
-		strncpy(p, ctype.s, ctype.len);
+		memcpy(p, CONTENT_TYPE_PREFIX, CONTENT_TYPE_PREFIX_LEN);
+		p += CONTENT_TYPE_PREFIX_LEN;
+		memcpy(p, ctype.s, ctype.len);
 		p += ctype.len;
-		strncpy(p, CRLF, CRLF_LEN);
+		memcpy(p, CRLF, CRLF_LEN);
 		p += CRLF_LEN;
-
 	}
 	if(contact.len > 0)
 	{
-		strncpy(p, CONTACT_PREFIX, CONTACT_PREFIX_LEN);
+		memcpy(p, CONTACT_PREFIX, CONTACT_PREFIX_LEN);
 		p += CONTACT_PREFIX_LEN;
-		strncpy(p, contact.s, contact.len);
+		memcpy(p, contact.s, contact.len);
 		p += contact.len;
-		strncpy(p, CONTACT_SUFFIX, CONTACT_SUFFIX_LEN);
+		memcpy(p, CONTACT_SUFFIX, CONTACT_SUFFIX_LEN);
 		p += CONTACT_SUFFIX_LEN;
 	}
-	{
-		int tmp=0;
-		strncpy(p, EXTRA_OFFLINE_MSG, EXTRA_OFFLINE_MSG_LEN);
-		p += EXTRA_OFFLINE_MSG_LEN;
+	memcpy(p, tpl->tail, tpl->tail_len);
+	p += tpl->tail_len;
 
-		strncpy(p, EXTRA_OFFLINE_CHUNK, EXTRA_OFFLINE_CHUNK_LEN);
-		p += EXTRA_OFFLINE_CHUNK_LEN;
-
-		tmp = snprintf(p, OFFLINE_CHUNK_ID_MAX_LEN, "%ld", dumpId);
-		if (tmp >= 0){
-			p += tmp;
-		}
-
-		strncpy(p, CRLF, CRLF_LEN);
-		p += CRLF_LEN;
-	}
 	buf->len = p - buf->s;
 	return 0;
 error:
 	return -1;
 }
 
-/** build MESSAGE body --- add incoming time and 'from'
+/** size of the buffer m_build_part() needs for the given part */
+int m_build_part_len(str boundary, str hdrs, str body, int last)
+{
+	if(boundary.len <= 0 || hdrs.len < 0 || body.len < 0)
+		return -1;
+
+	return MP_DASHES_LEN + boundary.len + CRLF_LEN + hdrs.len + CRLF_LEN
+		+ body.len + CRLF_LEN
+		+ (last ? MP_DASHES_LEN + boundary.len + MP_DASHES_LEN + CRLF_LEN : 0);
+}
+
+/** build one body part of a multipart body
  *
- * expects - max buf len of the resulted body in body->len
- *         - body->s MUST be allocated
+ * The part is the delimiter line, its headers (each ending with CRLF), an
+ * empty line and its body; last adds the close delimiter after it.
+ * expects - max buf len of the resulted part in buf->len
+ *         - buf->s MUST be allocated
  * return: 0 OK ; -1 error
  * */
-int m_build_body(str *body, time_t date, str msg, time_t sdate)
+int m_build_part(str *buf, str boundary, str hdrs, str body, int last)
 {
 	char *p;
 
-	if(!body || !(body->s) || body->len <= 0 || msg.len <= 0
-			|| date < 0 || msg.len < 0 || (46+msg.len > body->len) )
+	if(!buf || !buf->s || buf->len <= 0
+			|| buf->len < m_build_part_len(boundary, hdrs, body, last))
 		goto error;
 
-	p = body->s;
+	p = buf->s;
+	memcpy(p, MP_DASHES, MP_DASHES_LEN);
+	p += MP_DASHES_LEN;
+	memcpy(p, boundary.s, boundary.len);
+	p += boundary.len;
+	memcpy(p, CRLF, CRLF_LEN);
+	p += CRLF_LEN;
+	memcpy(p, hdrs.s, hdrs.len);
+	p += hdrs.len;
+	memcpy(p, CRLF, CRLF_LEN);
+	p += CRLF_LEN;
+	memcpy(p, body.s, body.len);
+	p += body.len;
+	memcpy(p, CRLF, CRLF_LEN);
+	p += CRLF_LEN;
+	if(last)
+	{
+		memcpy(p, MP_DASHES, MP_DASHES_LEN);
+		p += MP_DASHES_LEN;
+		memcpy(p, boundary.s, boundary.len);
+		p += boundary.len;
+		memcpy(p, MP_DASHES CRLF, MP_DASHES_LEN + CRLF_LEN);
+		p += MP_DASHES_LEN + CRLF_LEN;
+	}
 
-	if(ms_add_date!=0)
+	buf->len = p - buf->s;
+	return 0;
+error:
+	return -1;
+}
+
+/* offsets of local time to UTC per hour of the converted time, a batch
+ * spanning up to TZ_CACHE_SIZE hours does not call into the libc tz code
+ * after the first message of each hour */
+#define TZ_CACHE_SIZE 64
+
+static struct
+{
+	time_t hour;
+	long offset;
+} ms_tz_cache[TZ_CACHE_SIZE];
+
+long ms_local_utc_offset(time_t t)
+{
+	struct tm ltm;
+	time_t hour = t - (t % 3600);
+	int i = (int)((unsigned long)(hour / 3600) & (TZ_CACHE_SIZE - 1));
+
+	/* hour 0 is in the cache only when computed, 0 is its zero value */
+	if(ms_tz_cache[i].hour != hour || hour == 0)
 	{
-		if(sdate!=0)
+		if(localtime_r(&hour, &ltm) == NULL)
+			return ms_tz_cache[i].offset;
+		ms_tz_cache[i].offset = ltm.tm_gmtoff;
+		ms_tz_cache[i].hour = hour;
+	}
+
+	return ms_tz_cache[i].offset;
+}
+
+/**
+ * parse the value of a date format module parameter
+ * return: MS_DATE_FMT_* ; -1 unknown format
+ */
+int ms_parse_date_format(const char *fmt)
+{
+	str f;
+
+	if(fmt == NULL)
+		return MS_DATE_FMT_CTIME;
+	f.s = (char*)fmt;
+	f.len = strlen(fmt);
+	return ms_parse_date_format_str(&f);
+}
+
+/**
+ * same as ms_parse_date_format() for a not terminated value
+ */
+int ms_parse_date_format_str(str *fmt)
+{
+	if(fmt->len == 5 && strncasecmp(fmt->s, "ctime", 5) == 0)
+		return MS_DATE_FMT_CTIME;
+	if(fmt->len == 7 && strncasecmp(fmt->s, "iso8601", 7) == 0)
+		return MS_DATE_FMT_ISO8601;
+	if(fmt->len == 4 && strncasecmp(fmt->s, "none", 4) == 0)
+		return MS_DATE_FMT_NONE;
+	return -1;
+}
+
+/**
+ * return: MS_RCLASS_* of a final reply code
+ */
+int ms_response_class(int code)
+{
+	if(code == 408 || code == 480)
+		return MS_RCLASS_UNAVAIL;
+	if(code >= 500 && code < 600)
+		return MS_RCLASS_SERVER;
+	return MS_RCLASS_OTHER;
+}
+
+/**
+ * default actions of failed deliveries: every failure is resent up to
+ * retry_count times, as before the table existed
+ */
+void ms_resp_table_init(ms_resp_table_t *t)
+{
+	int code;
+
+	for(code = MS_RCODE_MIN; code <= MS_RCODE_MAX; code++)
+		t->act[code - MS_RCODE_MIN] = MS_RACT_RETRY;
+}
+
+/**
+ * parse the value of the response actions module parameter over the table
+ * return: 0 ok ; -1 error
+ */
+int ms_parse_resp_table(const char *spec, ms_resp_table_t *t)
+{
+	static const struct { const char *name; int act; } acts[] = {
+		{"retry", MS_RACT_RETRY}, {"giveup", MS_RACT_GIVEUP},
+		{"abort", MS_RACT_ABORT}
+	};
+	const char *p, *a;
+	int i, from, to, act, len;
+
+	if(spec == NULL)
+		return 0;
+
+	for(p = spec; *p; )
+	{
+		while(*p==' ' || *p==',' || *p==';')
+			p++;
+		if(*p == 0)
+			break;
+
+		/* NNN or Nxx */
+		if(p[0] < '3' || p[0] > '6')
+			return -1;
+		if((p[1]=='x' || p[1]=='X') && (p[2]=='x' || p[2]=='X'))
 		{
-			strncpy(p, "[Reminder message - ", 20);
-			p += 20;
+			from = (p[0] - '0') * 100;
+			to = from + 99;
+		}
+		else if(p[1] >= '0' && p[1] <= '9' && p[2] >= '0' && p[2] <= '9')
+		{
+			from = to = (p[0] - '0') * 100 + (p[1] - '0') * 10 + (p[2] - '0');
+		}
+		else
+		{
+			return -1;
+		}
+		p += 3;
+		if(*p != ':')
+			return -1;
 
-			strncpy(p, ctime(&sdate), 24);
-			p += 24;
+		a = ++p;
+		while(*p && *p!=' ' && *p!=',' && *p!=';')
+			p++;
+		len = (int)(p - a);
+		act = -1;
+		for(i = 0; i < (int)(sizeof(acts)/sizeof(acts[0])); i++)
+			if(len == (int)strlen(acts[i].name)
+					&& strncasecmp(a, acts[i].name, len) == 0)
+				act = acts[i].act;
+		if(act < 0)
+			return -1;
 
-			*p++ = ']';
-		} else {
-			strncpy(p, "[Offline message - ", 19);
-			p += 19;
+		for(i = from; i <= to; i++)
+			t->act[i - MS_RCODE_MIN] = (unsigned char)act;
+	}
+
+	return 0;
+}
+
+/**
+ * return: MS_RACT_* of the final reply code
+ */
+int ms_resp_action(const ms_resp_table_t *t, int code)
+{
+	if(code < MS_RCODE_MIN || code > MS_RCODE_MAX)
+		return MS_RACT_GIVEUP;
+	return t->act[code - MS_RCODE_MIN];
+}
+
+/**
+ * parse the value of a backoff module parameter, "base,factor,max" in
+ * seconds, factor and max may be left out
+ * return: 0 ok ; -1 error
+ */
+int ms_parse_backoff(const char *spec, ms_backoff_t *b)
+{
+	long v[3];
+	char *end;
+	int i;
+
+	if(spec == NULL)
+		return 0;
+
+	v[0] = 0;
+	v[1] = 2;
+	v[2] = 0;
+	for(i = 0; i < 3; i++)
+	{
+		while(*spec == ' ')
+			spec++;
+		v[i] = strtol(spec, &end, 10);
+		if(end == spec || v[i] < 0)
+			return -1;
+		while(*end == ' ')
+			end++;
+		if(*end == 0)
+			break;
+		if(*end != ',' || i == 2)
+			return -1;
+		spec = end + 1;
+	}
+
+	b->base = (int)v[0];
+	b->factor = v[1] > 0 ? (int)v[1] : 1;
+	b->max = v[2] > 0 ? (int)v[2] : (int)v[0];
+	return 0;
+}
+
+/**
+ * delay of the retry attempt, uniformly random up to the exponential cap
+ * so retries of many messages failing at once do not come back together
+ * return: seconds
+ */
+time_t ms_backoff_delay(const ms_backoff_t *b, int attempt)
+{
+	long cap = b->base;
+
+	while(attempt-- > 0 && cap < b->max)
+		cap *= b->factor;
+	if(cap > b->max)
+		cap = b->max;
+	if(cap <= 0)
+		return 0;
+
+	return (time_t)(rand() % (cap + 1));
+}
+
+/**
+ * Format local time t as ctime() does, without the trailing newline
+ * ("Mon Feb 19 18:42:27 2007") or as ISO 8601 with the UTC offset
+ * ("2007-02-19T18:42:27+01:00").
+ * return: length written to buf ; -1 error
+ */
+static int ms_format_local_date(time_t t, int fmt, char *buf)
+{
+	struct tm ltm;
+	long off = ms_local_utc_offset(t);
+	int year;
+	char *p = buf;
+
+	ms_time_to_tm(t + off, &ltm);
+	year = 1900 + ltm.tm_year;
+	if(year < 1000 || year > 9999)
+		return -1;
+
+	if(fmt == MS_DATE_FMT_ISO8601)
+	{
+		p = ms_put_4digits(p, year);
+		*p++ = '-';
+		p = ms_put_2digits(p, ltm.tm_mon + 1);
+		*p++ = '-';
+		p = ms_put_2digits(p, ltm.tm_mday);
+		*p++ = 'T';
+		p = ms_put_2digits(p, ltm.tm_hour);
+		*p++ = ':';
+		p = ms_put_2digits(p, ltm.tm_min);
+		*p++ = ':';
+		p = ms_put_2digits(p, ltm.tm_sec);
+		*p++ = (off < 0) ? '-' : '+';
+		if(off < 0)
+			off = -off;
+		p = ms_put_2digits(p, (int)(off / 3600 % 100));
+		*p++ = ':';
+		p = ms_put_2digits(p, (int)(off / 60 % 60));
+		return p - buf;
+	}
+
+	memcpy(p, ms_day_names[ltm.tm_wday], 3);
+	p += 3;
+	*p++ = ' ';
+	memcpy(p, ms_month_names[ltm.tm_mon], 3);
+	p += 3;
+	*p++ = ' ';
+	*p++ = (ltm.tm_mday < 10) ? ' ' : '0' + ltm.tm_mday / 10;
+	*p++ = '0' + ltm.tm_mday % 10;
+	*p++ = ' ';
+	p = ms_put_2digits(p, ltm.tm_hour);
+	*p++ = ':';
+	p = ms_put_2digits(p, ltm.tm_min);
+	*p++ = ':';
+	p = ms_put_2digits(p, ltm.tm_sec);
+	*p++ = ' ';
+	p = ms_put_4digits(p, year);
+	return p - buf;
+}
+
+/* last built body prefixes of this process, per kind (offline, reminder) */
+#define BODY_PREFIX_CACHE_SIZE 16
+
+typedef struct _body_prefix_cache
+{
+	time_t date;
+	int fmt;
+	int len;
+	char buf[BODY_DATE_PREFIX_MAX_LEN];
+} body_prefix_cache_t;
 
-			strncpy(p, ctime(&date), 24);
-			p += 24;
+static body_prefix_cache_t body_prefix_cache[2][BODY_PREFIX_CACHE_SIZE];
 
-			*p++ = ']';
+/**
+ * Get "[Offline message - <date>] " or "[Reminder message - <date>] "
+ * for the given time, formatted as fmt or, if fmt < 0, according to the
+ * date format parameter of the kind.
+ * return: prefix length, 0 when no prefix is configured ; -1 error
+ */
+static int m_body_prefix(time_t date, int reminder, int fmt, const char **prefix)
+{
+	body_prefix_cache_t *e;
+	int len;
+	char *p;
+
+	if(fmt < 0)
+		fmt = reminder ? ms_reminder_date_fmt : ms_offline_date_fmt;
+	if(ms_add_date == 0)
+		fmt = MS_DATE_FMT_NONE;
+	if(fmt == MS_DATE_FMT_NONE)
+		return 0;
+
+	e = &body_prefix_cache[reminder ? 1 : 0]
+		[(unsigned long)date & (BODY_PREFIX_CACHE_SIZE - 1)];
+	if(e->len <= 0 || e->date != date || e->fmt != fmt)
+	{
+		p = e->buf;
+		if(reminder)
+		{
+			memcpy(p, REMINDER_PREFIX, REMINDER_PREFIX_LEN);
+			p += REMINDER_PREFIX_LEN;
+		} else {
+			memcpy(p, OFFLINE_PREFIX, OFFLINE_PREFIX_LEN);
+			p += OFFLINE_PREFIX_LEN;
 		}
+
+		len = ms_format_local_date(date, fmt, p);
+		if(len < 0)
+		{
+			e->len = 0;
+			return -1;
+		}
+		p += len;
+		*p++ = ']';
 		*p++ = ' ';
+
+		e->date = date;
+		e->fmt = fmt;
+		e->len = p - e->buf;
 	}
 
+	*prefix = e->buf;
+	return e->len;
+}
+
+/** size of the buffer m_build_body() needs for the given message */
+int m_build_body_len(str msg)
+{
+	if(msg.len <= 0)
+		return -1;
+
+	return BODY_DATE_PREFIX_MAX_LEN + msg.len;
+}
+
+/** build MESSAGE body --- add incoming time and 'from'
+ *
+ * expects - max buf len of the resulted body in body->len
+ *         - body->s MUST be allocated
+ * return: 0 OK ; -1 error
+ * */
+int m_build_body(str *body, time_t date, str msg, time_t sdate, int fmt)
+{
+	char *p;
+	const char *prefix = NULL;
+	int len;
+
+	if(!body || !(body->s) || body->len <= 0 || msg.len <= 0
+			|| date < 0 || msg.len < 0
+			|| (BODY_DATE_PREFIX_MAX_LEN+msg.len > body->len) )
+		goto error;
+
+	p = body->s;
+
+	len = m_body_prefix((sdate!=0) ? sdate : date, sdate!=0, fmt, &prefix);
+	if(len < 0)
+		goto error;
+	memcpy(p, prefix, len);
+	p += len;
+
 	memcpy(p, msg.s, msg.len);
 	p += msg.len;
 
@@ -306,12 +852,79 @@ error:
 	return -1;
 }
 
-/* return time stamp of YYYYMMDDHHMMSS */
-int ms_extract_time(str *time_str, long long *time_val)
+/**
+ * parse a time zone parameter value: "local", "UTC", "Z" or a fixed
+ * offset as +HH, +HHMM or +HH:MM (or with '-')
+ * - offset: seconds east of UTC; for "local" the standard (non DST)
+ *   offset of the server zone at startup
+ * return: 0 OK ; -1 error
+ */
+int ms_parse_tz(const char *tz, long *offset)
 {
-	struct tm stm;
-	int i;
+	struct tm ltm;
+	time_t now;
+	int i, h, m = 0, sign;
+
+	if(offset == NULL)
+		return -1;
 
+	if(tz == NULL || strcasecmp(tz, "local") == 0)
+	{
+		/* mktime() with tm_isdst=0 used to interpret the value as local
+		 * standard time, find an instant without DST around now */
+		now = time(NULL);
+		for(i = 0; i < 13; i++)
+		{
+			time_t t = now + (time_t)i * 30 * 86400;
+			if(localtime_r(&t, &ltm) == NULL)
+				return -1;
+			if(ltm.tm_isdst <= 0)
+				break;
+		}
+		*offset = ltm.tm_gmtoff;
+		return 0;
+	}
+
+	if(strcasecmp(tz, "UTC") == 0 || strcasecmp(tz, "GMT") == 0
+			|| strcmp(tz, "Z") == 0)
+	{
+		*offset = 0;
+		return 0;
+	}
+
+	if(tz[0] != '+' && tz[0] != '-')
+		return -1;
+	sign = (tz[0] == '-') ? -1 : 1;
+	tz++;
+
+	if(tz[0] < '0' || tz[0] > '9' || tz[1] < '0' || tz[1] > '9')
+		return -1;
+	h = 10*(tz[0]-'0') + (tz[1]-'0');
+	tz += 2;
+	if(*tz == ':')
+		tz++;
+	if(*tz)
+	{
+		if(tz[0] < '0' || tz[0] > '5' || tz[1] < '0' || tz[1] > '9' || tz[2])
+			return -1;
+		m = 10*(tz[0]-'0') + (tz[1]-'0');
+	}
+	if(h > 14)
+		return -1;
+
+	*offset = sign * (h * 3600L + m * 60L);
+	return 0;
+}
+
+/**
+ * return time stamp of YYYYMMDDHHMMSS
+ *
+ * The value is taken as local time of the zone set with the snd_time_tz
+ * parameter (ms_snd_time_tz_offset, seconds east of UTC). Shorter values
+ * are accepted as before, missing digits count as zero.
+ */
+int ms_extract_time(str *time_str, long long *time_val)
+{
 	if(time_str==NULL || time_str->s==NULL
 			|| time_str->len<=0 || time_val==NULL)
 	{
@@ -319,121 +932,18 @@ int ms_extract_time(str *time_str, long long *time_val)
 		return -1;
 	}
 
-	memset(&stm, 0, sizeof(struct tm));
-	for(i=0; i<time_str->len; i++)
+	switch(ms_time_from_digits(time_str->s, time_str->len, time_val))
 	{
-		if(time_str->s[i]<'0' || time_str->s[i]>'9')
-		{
+		case 0:
+			break;
+		case -2:
+			LM_ERR("time spec too long [%.*s]\n", time_str->len, time_str->s);
+			return -1;
+		default:
 			LM_ERR("bad time [%.*s]\n", time_str->len, time_str->s);
 			return -1;
-		}
-		switch(i)
-		{
-			case 0:
-				if(time_str->s[i]<'2')
-				{
-					LM_ERR("bad year in time [%.*s]\n",
-							time_str->len, time_str->s);
-					return -1;
-				}
-				stm.tm_year += 1000*(time_str->s[i]-'0') - 1900;
-			break;
-			case 1:
-				stm.tm_year += 100*(time_str->s[i]-'0');
-			break;
-			case 2:
-				stm.tm_year += 10*(time_str->s[i]-'0');
-			break;
-			case 3:
-				stm.tm_year += (time_str->s[i]-'0');
-			break;
-			case 4:
-				if(time_str->s[i]>'1')
-				{
-					LM_ERR("bad month in time[%.*s]\n",
-							time_str->len, time_str->s);
-					return -1;
-				}
-				stm.tm_mon += 10*(time_str->s[i]-'0') - 1;
-			break;
-			case 5:
-				if((time_str->s[i-1]=='0' && time_str->s[i]=='0')
-						|| (time_str->s[i-1]=='1' && time_str->s[i]>'2'))
-				{
-					LM_ERR("bad month in time[%.*s]\n",
-							time_str->len, time_str->s);
-					return -1;
-				}
-				stm.tm_mon += (time_str->s[i]-'0');
-			break;
-			case 6:
-				if(time_str->s[i]>'3')
-				{
-					LM_ERR("bad day in time [%.*s]\n",
-							time_str->len, time_str->s);
-					return -1;
-				}
-				stm.tm_mday += 10*(time_str->s[i]-'0');
-			break;
-			case 7:
-				if((time_str->s[i-1]=='0' && time_str->s[i]=='0')
-						|| (time_str->s[i-1]=='3' && time_str->s[i]>'1'))
-				{
-					LM_ERR("bad day in time [%.*s]\n",
-							time_str->len, time_str->s);
-					return -1;
-				}
-				stm.tm_mday += (time_str->s[i]-'0');
-			break;
-			case 8:
-				if(time_str->s[i]>'2')
-				{
-					LM_ERR("bad hour in time [%.*s]\n",
-							time_str->len, time_str->s);
-					return -1;
-				}
-				stm.tm_hour += 10*(time_str->s[i]-'0');
-			break;
-			case 9:
-				if(time_str->s[i-1]=='2' && time_str->s[i]>'3')
-				{
-					LM_ERR("bad hour in time [%.*s]\n",
-							time_str->len, time_str->s);
-					return -1;
-				}
-				stm.tm_hour += (time_str->s[i]-'0');
-			break;
-			case 10:
-				if(time_str->s[i]>'5')
-				{
-					LM_ERR("bad min in time [%.*s]\n",
-							time_str->len, time_str->s);
-					return -1;
-				}
-				stm.tm_min += 10*(time_str->s[i]-'0');
-			break;
-			case 11:
-				stm.tm_min += (time_str->s[i]-'0');
-			break;
-			case 12:
-				if(time_str->s[i]>'5')
-				{
-					LM_ERR("bad sec in time [%.*s]\n",
-							time_str->len, time_str->s);
-					return -1;
-				}
-				stm.tm_sec += 10*(time_str->s[i]-'0');
-			break;
-			case 13:
-				stm.tm_sec += (time_str->s[i]-'0');
-			break;
-			default:
-				LM_ERR("time spec too long [%.*s]\n",
-						time_str->len, time_str->s);
-				return -1;
-		}
 	}
-	*time_val = (long)mktime(&stm);
 
+	*time_val -= ms_snd_time_tz_offset;
 	return 0;
 }
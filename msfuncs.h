@@ -25,12 +25,19 @@
 
 #include <time.h>
 #include "../../str.h"
+#include "../../parser/msg_parser.h"
 #include "msilo.h"
+#include "ms_text.h"
 
 #define CT_TYPE		1
 #define CT_CHARSET	2
 #define CT_MSGR		4
 
+/* format of the date in the body prefix of delivered messages */
+#define MS_DATE_FMT_CTIME	0
+#define MS_DATE_FMT_ISO8601	1
+#define MS_DATE_FMT_NONE	2
+
 #ifdef MSILO_TAG
 #undef MSILO_TAG
 #endif
@@ -43,19 +50,123 @@ typedef struct _content_type
 	str msgr;
 } content_type_t;
 
+/** header names looked up among the HDR_OTHER_T headers */
+#define MS_HDR_MSG_TYPE	0
+#define MS_HDR_NAMES_NO	1
+
+/** headers of a request collected in a single walk */
+typedef struct _ms_hdrs
+{
+	struct hdr_field *to;
+	struct hdr_field *from;
+	struct hdr_field *content_type;
+	struct hdr_field *expires;
+	struct hdr_field *contact;
+	struct hdr_field *other[MS_HDR_NAMES_NO];
+} ms_hdrs_t;
+
 /** apostrophes escape - useful for MySQL strings */
 int m_apo_escape(char*, int, char*, int);
 
 /** extract content-type value */
 int m_extract_content_type(char*, int, content_type_t*, int);
 
+/** per batch part of the MESSAGE headers */
+#define MS_HDR_TPL_MAX_LEN	64
+
+typedef struct _ms_hdr_tpl
+{
+	long dump_id;
+	int tail_len;
+	char tail[MS_HDR_TPL_MAX_LEN];
+} ms_hdr_tpl_t;
+
+/** render the per batch header lines */
+int m_hdr_tpl_init(ms_hdr_tpl_t *tpl, long dumpId);
+
+/** buffer size needed by m_build_headers */
+int m_build_headers_len(const ms_hdr_tpl_t *tpl, str ctype, str contact,
+		time_t date);
+
 /** build MESSAGE headers */
-int m_build_headers(str *buf, str ctype, str contact, time_t date, long dumpId);
+int m_build_headers(str *buf, const ms_hdr_tpl_t *tpl, str ctype, str contact,
+		time_t date);
+
+/** buffer size needed by m_build_part */
+int m_build_part_len(str boundary, str hdrs, str body, int last);
+
+/** build one part of a multipart body */
+int m_build_part(str *buf, str boundary, str hdrs, str body, int last);
+
+/** buffer size needed by m_build_body */
+int m_build_body_len(str msg);
 
-/** build MESSAGE body */
-int m_build_body(str *body, time_t date, str msg, time_t sdate);
+/** build MESSAGE body, fmt is MS_DATE_FMT_* or -1 for the format of the kind */
+int m_build_body(str *body, time_t date, str msg, time_t sdate, int fmt);
 
 int ms_extract_time(str *time_str, long long *time_val);
 
+/** parse time zone parameter value into seconds east of UTC */
+int ms_parse_tz(const char *tz, long *offset);
+
+/** offset of local time to UTC in seconds */
+long ms_local_utc_offset(time_t t);
+
+/** hash the header names, names is indexed by MS_HDR_* */
+int ms_hdr_names_init(str *names);
+
+/** collect the headers msilo needs in one walk over parsed headers */
+int ms_scan_headers(struct sip_msg *msg, ms_hdrs_t *hdrs);
+
+/** parse date format parameter value, see MS_DATE_FMT_* */
+int ms_parse_date_format(const char *fmt);
+int ms_parse_date_format_str(str *fmt);
+
+/** SIP response classes of failed deliveries, each with its own backoff */
+#define MS_RCLASS_UNAVAIL	0	/* 408, 480 - the device is not reachable now */
+#define MS_RCLASS_SERVER	1	/* 5xx */
+#define MS_RCLASS_OTHER		2
+#define MS_RCLASS_NO		3
+
+/** retry backoff, seconds; attempt n waits random [0, min(max, base*factor^n)] */
+typedef struct _ms_backoff
+{
+	int base;
+	int factor;
+	int max;
+} ms_backoff_t;
+
+/** response class of a final reply code, see MS_RCLASS_* */
+int ms_response_class(int code);
+
+/** what a failed delivery does next */
+#define MS_RACT_RETRY	0	/* resend after the backoff */
+#define MS_RACT_GIVEUP	1	/* leave it stored for the next dump */
+#define MS_RACT_ABORT	2	/* same, with the rest of the AoR's queued messages */
+
+#define MS_RCODE_MIN	300
+#define MS_RCODE_MAX	699
+
+/** action per final reply code */
+typedef struct _ms_resp_table
+{
+	unsigned char act[MS_RCODE_MAX - MS_RCODE_MIN + 1];
+} ms_resp_table_t;
+
+/** every code retries */
+void ms_resp_table_init(ms_resp_table_t *t);
+
+/** apply "code:action[,code:action...]", code is NNN or Nxx, later wins */
+int ms_parse_resp_table(const char *spec, ms_resp_table_t *t);
+
+/** MS_RACT_* of a final reply code */
+int ms_resp_action(const ms_resp_table_t *t, int code);
+
+/** parse "base,factor,max" backoff parameter value */
+int ms_parse_backoff(const char *spec, ms_backoff_t *b);
+
+/** delay before retry attempt (0 based), full jitter */
+time_t ms_backoff_delay(const ms_backoff_t *b, int attempt);
+
 #endif
 
@@ -6,6 +6,10 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/time.h>
 
 #include "../../mem/mem.h"
 #include "../../mem/shm_mem.h"
@@ -26,7 +30,11 @@ retry_list_el retry_list_el_new(void)
     mle->msgid = 0;
     mle->retry_ctr = 0;
     mle->not_before = 0;
+    mle->not_before_ms = 0;
     mle->flag = MS_MSG_NULL;
+    mle->aor = NULL;
+    memset(&mle->key, 0, sizeof(t_retry_key));
+    mle->queued_ms = 0;
 
     return mle;
 }
@@ -59,6 +67,14 @@ void retry_list_el_free_all(retry_list_el mle)
     }
 }
 
+long long retry_now_ms(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
 /**
  * init a list
  */
@@ -69,14 +85,15 @@ retry_list retry_list_init(void)
     ml = (retry_list)shm_malloc(sizeof(t_retry_list));
     if(ml == NULL)
         return NULL;
+    memset(ml, 0, sizeof(t_retry_list));
+
     /* init locks */
     if (lock_init(&ml->sem_retry)==0){
         LM_CRIT("could not initialize a lock\n");
         goto clean;
     };
-    ml->nrretry = 0;
-    ml->lretry_new = NULL;
-    ml->lretry_pop = NULL;
+    ml->nclasses = 1;
+    ml->classes[0].weight = 1;
 
     return ml;
 
@@ -90,33 +107,106 @@ retry_list retry_list_init(void)
  */
 void retry_list_free(retry_list ml)
 {
-    retry_list_el p0, p1;
-
     if(!ml)
         return;
 
+    retry_list_el_free_prev_all(retry_list_reset(ml));
     lock_destroy(&ml->sem_retry);
+    shm_free(ml);
+}
 
-    if(ml->nrretry>0 && ml->lretry_new)
-    { // free sent list
-        p0 = ml->lretry_new;
-        ml->lretry_new = NULL;
-        ml->nrretry = 0;
-        while(p0)
-        {
-            p1 = p0->next;
-            retry_list_el_free(p0);
-            p0 = p1;
+/**
+ * set the weight of a class, classes below cls get weight 1
+ */
+int retry_list_set_class(retry_list ml, int cls, int weight)
+{
+    if(!ml || cls < 0 || cls >= RETRY_CLASS_MAX)
+        return MSG_LIST_ERR;
+
+    lock_get(&ml->sem_retry);
+    while(ml->nclasses <= cls)
+        ml->classes[ml->nclasses++].weight = 1;
+    ml->classes[cls].weight = weight > 0 ? weight : 1;
+    lock_release(&ml->sem_retry);
+
+    return MSG_LIST_OK;
+}
+
+/**
+ * queued elements and the age of the oldest one per class, for up to n classes
+ * return: number of classes filled
+ */
+int retry_list_class_stats(retry_list ml, long * depth, long long * wait_ms, int n)
+{
+    long long now_ms = retry_now_ms();
+    retry_level lv;
+    retry_flow f;
+    long i;
+    int c;
+
+    if(!ml)
+        return 0;
+
+    lock_get(&ml->sem_retry);
+    if(n > ml->nclasses)
+        n = ml->nclasses;
+    for(c = 0; c < n; c++) {
+        depth[c] = ml->classes[c].depth;
+        wait_ms[c] = 0;
+    }
+    for(lv = ml->levels; lv < ml->levels + RETRY_PRIO_MAX; lv++) {
+        for(f = lv->active, i = 0; f && i < lv->nactive; f = f->active_next, i++) {
+            if(f->cls < n && f->lretry_pop && now_ms - f->lretry_pop->queued_ms > wait_ms[f->cls])
+                wait_ms[f->cls] = now_ms - f->lretry_pop->queued_ms;
         }
     }
+    lock_release(&ml->sem_retry);
 
-    shm_free(ml);
+    return n;
+}
+
+/**
+ * queued elements and the mean queueing time of the elements taken since
+ * the previous call per priority level, for up to n levels
+ * return: number of levels filled
+ */
+int retry_list_level_stats(retry_list ml, long * depth, long long * latency_ms, int n)
+{
+    retry_level lv;
+    int l;
+
+    if(!ml)
+        return 0;
+
+    if(n > RETRY_PRIO_MAX)
+        n = RETRY_PRIO_MAX;
+
+    lock_get(&ml->sem_retry);
+    for(l = 0; l < n; l++) {
+        lv = &ml->levels[l];
+        depth[l] = lv->n;
+        latency_ms[l] = lv->taken > 0 ? lv->wait_ms / lv->taken : 0;
+        lv->wait_ms = 0;
+        lv->taken = 0;
+    }
+    lock_release(&ml->sem_retry);
+
+    return n;
+}
+
+/**
+ * a is due before b, no deadline is the latest one
+ */
+static int retry_deadline_before(const t_retry_key * a, const t_retry_key * b)
+{
+    return a->exp_time != 0 && (b->exp_time == 0 || a->exp_time < b->exp_time);
 }
 
 /**
  * adds given entry to the retry list.
  */
-int retry_add_element(retry_list ml, t_msg_mid mid, int retry_ctr, time_t not_before)
+int retry_add_element(retry_list ml, t_msg_mid mid, int retry_ctr, time_t not_before,
+                      const t_retry_key * key)
 {
     retry_list_el p0;
 
@@ -127,110 +217,295 @@ int retry_add_element(retry_list ml, t_msg_mid mid, int retry_ctr, time_t not_be
 
     LM_DBG("adding msgid=%lld\n", (long long)mid);
 
-    lock_get(&ml->sem_retry);
-
     // When calling this we should be pretty sure record is noy already in the queue
     // thus skipping O(n) scanning.
     p0 = retry_list_el_new();
     if(!p0)
     {
         LM_ERR("failed to create new msg elem.\n");
-        goto error;
+        goto errorx;
     }
 
     p0->msgid = mid;
     p0->flag |= MS_MSG_SENT;
     p0->retry_ctr = retry_ctr;
     p0->not_before = not_before;
-    p0->next = ml->lretry_new;
-    p0->prev = NULL;
+    if(key)
+        p0->key = *key;
+
+    return retry_push_element(ml, p0);
+errorx:
+    return MSG_LIST_ERR;
+}
+
+/**
+ * links p0 into the due elements of flow f
+ */
+static void retry_flow_link(retry_flow f, retry_list_el p0)
+{
+    retry_list_el q, newer;
+
+    // Goes in front of the newer elements with a later deadline, usually
+    // there is none and it ends up on the top.
+    for(q = f->lretry_new; q && retry_deadline_before(&p0->key, &q->key); q = q->next);
+
+    newer = q ? q->prev : f->lretry_pop;
+    p0->next = q;
+    p0->prev = newer;
+    if (q) {
+        q->prev = p0;
+    } else {
+        f->lretry_pop = p0;
+    }
+    if (newer) {
+        newer->next = p0;
+    } else {
+        f->lretry_new = p0;
+    }
+}
+
+/**
+ * links p0 into the elements of flow f not due yet, next points to the
+ * later one
+ */
+static void retry_flow_defer(retry_flow f, retry_list_el p0)
+{
+    retry_list_el q;
+
+    // The deferrals of a flow are mostly in order, the walk is short.
+    for(q = f->ldefer_last; q && q->not_before_ms > p0->not_before_ms; q = q->prev);
 
-    if(ml->lretry_new)
+    p0->prev = q;
+    p0->next = q ? q->next : f->ldefer_first;
+    if (p0->next) {
+        p0->next->prev = p0;
+    } else {
+        f->ldefer_last = p0;
+    }
+    if (q) {
+        q->next = p0;
+    } else {
+        f->ldefer_first = p0;
+    }
+}
+
+/**
+ * moves the elements of flow f due at now_ms, all of them if all is set,
+ * to its due ones; stops at the first one not due
+ */
+static void retry_flow_promote(retry_flow f, int all, long long now_ms)
+{
+    retry_list_el p0;
+
+    while((p0 = f->ldefer_first) && (all || p0->not_before_ms <= now_ms)) {
+        f->ldefer_first = p0->next;
+        if (f->ldefer_first) {
+            f->ldefer_first->prev = NULL;
+        } else {
+            f->ldefer_last = NULL;
+        }
+        retry_flow_link(f, p0);
+    }
+}
+
+/**
+ * adds an existing element to the retry list, the list owns it then.
+ */
+int retry_push_element(retry_list ml, retry_list_el p0)
+{
+    retry_level lv;
+    retry_flow f;
+
+    if(!ml || !p0)
+    {
+        goto errorx;
+    }
+
+    p0->queued_ms = retry_now_ms();
+    // not_before_ms is kept only while not_before is its ceiling, a
+    // not_before set on its own counts from the start of its second
+    if((p0->not_before_ms + 999) / 1000 != (long long)p0->not_before)
+        p0->not_before_ms = (long long)p0->not_before * 1000;
+    lock_get(&ml->sem_retry);
+
+    if(p0->key.cls < 0 || p0->key.cls >= ml->nclasses)
+        p0->key.cls = 0;
+    if(p0->key.prio < 0 || p0->key.prio >= RETRY_PRIO_MAX)
+        p0->key.prio = RETRY_PRIO_MAX - 1;
+
+    lv = &ml->levels[p0->key.prio];
+    f = &lv->flows[p0->key.flow & (RETRY_FLOWS - 1)];
+
+    if (p0->not_before_ms > p0->queued_ms) {
+        retry_flow_defer(f, p0);
+    } else {
+        retry_flow_link(f, p0);
+    }
+    f->cls = p0->key.cls;
+
+    // A flow becoming non-empty joins the end of the round.
+    if(f->n++ == 0)
     {
-        ml->lretry_new->prev = p0;
+        if(lv->active)
+        {
+            f->active_next = lv->active;
+            f->active_prev = lv->active->active_prev;
+            f->active_prev->active_next = f;
+            lv->active->active_prev = f;
+        } else {
+            f->active_next = f->active_prev = f;
+            lv->active = f;
+        }
+        lv->nactive++;
     }
 
-    if (ml->lretry_pop == NULL){
-        ml->lretry_pop = p0;
+    // Aging counts from the moment the level has something to serve.
+    if(lv->n++ == 0)
+    {
+        lv->served_ms = p0->queued_ms;
     }
 
-    ml->lretry_new = p0;
+    ml->classes[p0->key.cls].depth++;
     ml->nrretry++;
 
     lock_release(&ml->sem_retry);
     LM_DBG("msg added to sent list.\n");
     return MSG_LIST_OK;
-error:
-    lock_release(&ml->sem_retry);
 errorx:
     return MSG_LIST_ERR;
 }
 
 /**
- * Removes first N elements from the queue pop end.
+ * Deficit round robin over the flows of a level, takes up to n elements due
+ * at now, all of them if all is set, appends them to the p_ret chain.
  */
-retry_list_el retry_peek_n(retry_list ml, size_t n, size_t * size){
-    retry_list_el p0 = NULL, p1 = NULL, p_ret = NULL;
-    size_t cur_ctr = 0;
-
-    if(!ml) {
-        goto errorx;
-    }
-
-    lock_get(&ml->sem_retry);
+static void retry_level_take(retry_list ml, retry_level lv, size_t n,
+                             int all, long long now_ms, retry_list_el * p_ret,
+                             retry_list_el * p_last, size_t * size){
+    retry_list_el p0 = NULL, p_prev = NULL;
+    retry_flow f, f_next;
+    long idle = 0;
+
+    // Stops when the batch is full or no flow had a due element for a whole round.
+    while(*size < n && lv->active && idle < lv->nactive) {
+        f = lv->active;
+        if (!f->turn) {
+            f->deficit += ml->classes[f->cls].weight;
+            f->turn = 1;
+        }
 
-    // Fast check for empty list.
-    if (ml->nrretry <= 0){
-        lock_release(&ml->sem_retry);
-        return p_ret;
-    }
+        retry_flow_promote(f, all, now_ms);
+
+        p0 = f->lretry_pop;
+        for(; p0 && f->deficit > 0 && *size < n; p0 = p_prev) {
+            p_prev = p0->prev;
+
+            // Unlink, next points to the older element, prev to the newer one.
+            if (p0->next) {
+                p0->next->prev = p0->prev;
+            } else {
+                f->lretry_pop = p0->prev;
+            }
+            if (p0->prev) {
+                p0->prev->next = p0->next;
+            } else {
+                f->lretry_new = p0->next;
+            }
+            f->n--;
+            f->deficit--;
+            lv->n--;
+            lv->taken++;
+            lv->wait_ms += now_ms - p0->queued_ms;
+            lv->served_ms = now_ms;
+            ml->classes[p0->key.cls].depth--;
+            ml->nrretry--;
+
+            // User iterates over prev pointers. First one is on the top.
+            p0->next = *p_last;
+            p0->prev = NULL;
+            if (*p_last) {
+                (*p_last)->prev = p0;
+            } else {
+                *p_ret = p0;
+            }
+            *p_last = p0;
+            *size += 1;
+            idle = -1;
+        }
+        idle++;
 
-    // Find where list of maximally n elements starts (cut-off place)
-    p1 = p0 = ml->lretry_pop;
-    while(p0) {
-        p1 = p0;
-        cur_ctr += 1;
-        if (cur_ctr >= n){
+        // Batch full in the middle of the turn, the flow goes on next time.
+        if (p0 && f->deficit > 0) {
             break;
         }
 
-        p0 = p0->prev;
+        // Turn over, credit is kept only by a flow that still has due elements.
+        f->turn = 0;
+        if (!p0) {
+            f->deficit = 0;
+        }
+        f_next = f->active_next;
+        if (f->n == 0) {
+            f->deficit = 0;
+            f->active_prev->active_next = f->active_next;
+            f->active_next->active_prev = f->active_prev;
+            f->active_next = f->active_prev = NULL;
+            lv->nactive--;
+            f_next = lv->nactive > 0 ? f_next : NULL;
+        }
+        lv->active = f_next;
     }
+}
+
+/**
+ * Takes up to n elements due at now, all of them if all is set; the level
+ * waiting the longest over aging_ms first, then the levels in priority order.
+ */
+static retry_list_el retry_peek(retry_list ml, size_t n, int all, size_t * size){
+    retry_list_el p_ret = NULL, p_last = NULL;
+    long long now_ms = retry_now_ms();
+    retry_level lv, starved = NULL;
 
-    // Nothing to provide
-    if (ml->lretry_pop == NULL){
-        *size = 0;
-        goto nulz;
+    *size = 0;
+    if(!ml) {
+        return NULL;
     }
 
-    // User iterates over prev pointers. First one is on the top.
-    p_ret = ml->lretry_pop;
-    p_ret->next = NULL;
-    *size = cur_ctr;
-    ml->nrretry -= cur_ctr;
+    lock_get(&ml->sem_retry);
 
-    // New queue start is p1->prev as p1 is the last element in the chain.
-    ml->lretry_pop = p1->prev;
-    p1->prev = NULL;
-    if (ml->lretry_pop){
-        ml->lretry_pop->next = NULL;
-    } else {
-        ml->lretry_new = NULL;
-        if (ml->nrretry != 0){
-            LM_CRIT("Num of nodes does not match: %ld!", ml->nrretry);
+    if (ml->aging_ms > 0) {
+        for(lv = ml->levels + 1; lv < ml->levels + RETRY_PRIO_MAX; lv++) {
+            if (lv->n > 0 && now_ms - lv->served_ms >= ml->aging_ms
+                    && (!starved || lv->served_ms < starved->served_ms)) {
+                starved = lv;
+            }
+        }
+        if (starved) {
+            retry_level_take(ml, starved, n, all, now_ms, &p_ret, &p_last, size);
         }
     }
 
-    LM_INFO("Items removed (peek): %d, remaining: %d, new: %p, pop: %p, ret: %p, p1: %p",
-            (int)cur_ctr, (int)ml->nrretry, ml->lretry_new, ml->lretry_pop, p_ret, p1);
+    for(lv = ml->levels; lv < ml->levels + RETRY_PRIO_MAX && *size < n; lv++) {
+        retry_level_take(ml, lv, n, all, now_ms, &p_ret, &p_last, size);
+    }
 
     lock_release(&ml->sem_retry);
     return p_ret;
-nulz:
-    lock_release(&ml->sem_retry);
-    return p_ret;
-errorx:
-    return p_ret;
+}
+
+/**
+ * Removes first N elements from the queue pop end.
+ */
+retry_list_el retry_peek_n(retry_list ml, size_t n, size_t * size){
+    return retry_peek(ml, n, 1, size);
+}
+
+/**
+ * Removes up to N elements due now (not_before_ms reached), elements scheduled
+ * later stay queued. Same list shape as retry_peek_n().
+ */
+retry_list_el retry_peek_due(retry_list ml, size_t n, size_t * size){
+    return retry_peek(ml, n, 0, size);
 }
 
 int retry_is_empty(retry_list ml) {
@@ -248,91 +523,343 @@ errorx:
     return ret;
 }
 
-void retry_clone_element(const retry_list_el src, retry_list_el dst){
-    if (src == NULL || dst == NULL){
-        LM_CRIT("Source or destination is NULL");
+/**
+ * free a list of elements
+ */
+void retry_list_el_free_prev_all(retry_list_el mle)
+{
+    retry_list_el p0, p1;
+
+    if(!mle)
         return;
+
+    p0 = mle;
+    while(p0)
+    {
+        p1 = p0;
+        p0 = p0->prev;
+        retry_list_el_free(p1);
+    }
+}
+
+/**
+ * reset a list
+ * return old list
+ */
+retry_list_el retry_list_reset(retry_list ml)
+{
+    size_t n;
+
+    if(!ml)
+        return NULL;
+
+    return retry_peek(ml, (size_t)-1, 1, &n);
+}
+
+// Snapshot file: a header, then count fixed size records, all little endian
+// as written by this host. Written to <path>.tmp and renamed over path.
+#define RETRY_SNAP_MAGIC    0x5152534du  // "MSRQ"
+#define RETRY_SNAP_VERSION  1
+
+typedef struct _retry_snap_hdr
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t rec_size;
+} t_retry_snap_hdr;
+
+typedef struct _retry_snap_rec
+{
+    int64_t mid;
+    int64_t not_before;
+    int64_t exp_time;
+    uint32_t flow;
+    int32_t cls;
+    int32_t prio;
+    int32_t batch;
+    int32_t retry_ctr;
+    int32_t pad;
+} t_retry_snap_rec;
+
+/**
+ * write the elements of a list (linked by prev) to a snapshot file
+ * return: number of elements written, -1 on error
+ */
+int retry_list_save(retry_list_el list, const char * path)
+{
+    t_retry_snap_hdr hdr;
+    t_retry_snap_rec rec;
+    retry_list_el p0;
+    char tmp[PATH_MAX];
+    FILE * f;
+    uint32_t n = 0;
+
+    if(!path)
+        return -1;
+
+    if(snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+    {
+        LM_ERR("snapshot path too long: %s\n", path);
+        return -1;
+    }
+
+    f = fopen(tmp, "wb");
+    if(f == NULL)
+    {
+        LM_ERR("cannot create %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+
+    // The count is known at the end, the header is written twice.
+    memset(&hdr, 0, sizeof(hdr));
+    if(fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+        goto error;
+
+    memset(&rec, 0, sizeof(rec));
+    for(p0 = list; p0; p0 = p0->prev)
+    {
+        rec.mid = p0->msgid;
+        rec.not_before = p0->not_before;
+        rec.exp_time = p0->key.exp_time;
+        rec.flow = p0->key.flow;
+        rec.cls = p0->key.cls;
+        rec.prio = p0->key.prio;
+        rec.batch = p0->key.batch;
+        rec.retry_ctr = p0->retry_ctr;
+        if(fwrite(&rec, sizeof(rec), 1, f) != 1)
+            goto error;
+        n++;
+    }
+
+    hdr.magic = RETRY_SNAP_MAGIC;
+    hdr.version = RETRY_SNAP_VERSION;
+    hdr.count = n;
+    hdr.rec_size = sizeof(rec);
+    if(fseek(f, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(hdr), 1, f) != 1
+            || fflush(f) != 0 || fsync(fileno(f)) != 0)
+        goto error;
+
+    if(fclose(f) != 0)
+    {
+        f = NULL;
+        goto error;
     }
+    f = NULL;
 
-    dst->msgid = src->msgid;
-    dst->flag = src->flag;
-    dst->not_before = src->not_before;
-    dst->retry_ctr = src->retry_ctr;
-    dst->clone = src;
-    dst->prev = NULL;
-    dst->next = NULL;
+    if(rename(tmp, path) != 0)
+        goto error;
+
+    return (int)n;
+
+error:
+    LM_ERR("cannot write snapshot %s: %s\n", tmp, strerror(errno));
+    if(f)
+        fclose(f);
+    unlink(tmp);
+    return -1;
 }
 
 /**
- * Clones list for internal usage, temporary, local.
+ * read a snapshot file written by retry_list_save()
+ * return: new elements linked by prev in the saved order, NULL if there is
+ *         no snapshot or it is not valid
  */
-retry_list_el retry_clone_elements_prev_local(retry_list_el p0) {
-    retry_list_el p0_clone = NULL, p1 = NULL, p_clone = NULL;
-    if (p0 == NULL){
+retry_list_el retry_list_load(const char * path, size_t * size)
+{
+    t_retry_snap_hdr hdr;
+    t_retry_snap_rec rec;
+    retry_list_el p_ret = NULL, p_last = NULL, p0;
+    FILE * f;
+    uint32_t i;
+
+    *size = 0;
+    if(!path)
         return NULL;
+
+    f = fopen(path, "rb");
+    if(f == NULL)
+    {
+        if(errno != ENOENT)
+            LM_ERR("cannot open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    if(fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != RETRY_SNAP_MAGIC
+            || hdr.version != RETRY_SNAP_VERSION || hdr.rec_size != sizeof(rec))
+    {
+        LM_ERR("%s is not a retry queue snapshot\n", path);
+        goto error;
+    }
+
+    for(i = 0; i < hdr.count; i++)
+    {
+        if(fread(&rec, sizeof(rec), 1, f) != 1)
+        {
+            LM_ERR("%s truncated at record %u of %u\n", path, i, hdr.count);
+            goto error;
+        }
+
+        p0 = retry_list_el_new();
+        if(p0 == NULL)
+        {
+            LM_ERR("no more shm for the snapshot of %s\n", path);
+            goto error;
+        }
+        p0->msgid = rec.mid;
+        p0->flag |= MS_MSG_SENT;
+        p0->retry_ctr = rec.retry_ctr;
+        p0->not_before = (time_t)rec.not_before;
+        p0->key.exp_time = (time_t)rec.exp_time;
+        p0->key.flow = rec.flow;
+        p0->key.cls = rec.cls;
+        p0->key.prio = rec.prio;
+        p0->key.batch = rec.batch;
+
+        p0->next = p_last;
+        if(p_last)
+            p_last->prev = p0;
+        else
+            p_ret = p0;
+        p_last = p0;
     }
 
-    p0_clone = retry_list_el_new();
-    retry_clone_element(p0, p0_clone);
+    fclose(f);
+    *size = hdr.count;
+    return p_ret;
+
+error:
+    fclose(f);
+    retry_list_el_free_prev_all(p_ret);
+    return NULL;
+}
+
+// Taken out of the index, the slot stays occupied for probing. Ids are never 0.
+static t_retry_list_el retry_index_taken;
+
+static inline size_t retry_index_slot(t_msg_mid mid)
+{
+    unsigned long long h = (unsigned long long)mid * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h >> 32) & (RETRY_INDEX_SLOTS - 1);
+}
+
+/**
+ * clear the index
+ */
+void retry_index_reset(retry_index idx)
+{
+    if(!idx)
+        return;
+
+    memset(idx->slots, 0, sizeof(idx->slots));
+    idx->used = 0;
+}
+
+/**
+ * insert element into the index, linear probing on collision.
+ * return: MSG_LIST_OK, MSG_LIST_EXIST if mid is indexed already, MSG_LIST_ERR when full
+ */
+int retry_index_put(retry_index idx, retry_list_el el)
+{
+    size_t i, n;
+
+    if(!idx || !el)
+        return MSG_LIST_ERR;
 
-    p1 = p0->prev;
-    p_clone = p0_clone;
-    while(p1){
-        // Clone p1
-        retry_list_el p1_clone = retry_list_el_new();
-        retry_clone_element(p1, p1_clone);
+    // Keep at least half of the slots free so lookups of missing mids terminate fast.
+    if(idx->used >= RETRY_INDEX_SLOTS / 2)
+        return MSG_LIST_ERR;
 
-        // Connect to the chain
-        p1_clone->next = p_clone;
-        if (p_clone) {
-            p_clone->prev = p1_clone;
+    i = retry_index_slot(el->msgid);
+    for(n = 0; n < RETRY_INDEX_SLOTS; n++)
+    {
+        if(idx->slots[i] == NULL)
+        {
+            idx->slots[i] = el;
+            idx->used++;
+            return MSG_LIST_OK;
         }
 
-        // Advance
-        p_clone = p1_clone;
-        p1 = p1->prev;
+        if(idx->slots[i]->msgid == el->msgid)
+            return MSG_LIST_EXIST;
+
+        i = (i + 1) & (RETRY_INDEX_SLOTS - 1);
     }
 
-    p_clone->prev = NULL;
-    return p0_clone;
+    return MSG_LIST_ERR;
 }
 
 /**
- * free a list of elements
+ * find element by mid, NULL if not indexed
  */
-void retry_list_el_free_prev_all(retry_list_el mle)
+retry_list_el retry_index_get(retry_index idx, t_msg_mid mid)
 {
-    retry_list_el p0, p1;
+    size_t i, n;
 
-    if(!mle)
-        return;
+    if(!idx)
+        return NULL;
 
-    p0 = mle;
-    while(p0)
+    i = retry_index_slot(mid);
+    for(n = 0; n < RETRY_INDEX_SLOTS; n++)
     {
-        p1 = p0;
-        p0 = p0->prev;
-        retry_list_el_free(p1);
+        if(idx->slots[i] == NULL)
+            return NULL;
+
+        if(idx->slots[i]->msgid == mid)
+            return idx->slots[i];
+
+        i = (i + 1) & (RETRY_INDEX_SLOTS - 1);
     }
+
+    return NULL;
 }
 
 /**
- * reset a list
- * return old list
+ * find element by mid and take it out of the index, NULL if not indexed
  */
-retry_list_el retry_list_reset(retry_list ml)
+retry_list_el retry_index_take(retry_index idx, t_msg_mid mid)
 {
-    retry_list_el p0;
+    retry_list_el el;
+    size_t i, n;
 
-    if(!ml)
+    if(!idx)
         return NULL;
 
-    lock_get(&ml->sem_retry);
-    p0 = ml->lretry_pop;
-    ml->lretry_pop = NULL;
-    ml->lretry_new = NULL;
-    ml->nrretry = 0;
-    lock_release(&ml->sem_retry);
+    i = retry_index_slot(mid);
+    for(n = 0; n < RETRY_INDEX_SLOTS; n++)
+    {
+        el = idx->slots[i];
+        if(el == NULL)
+            return NULL;
 
-    return p0;
+        if(el != &retry_index_taken && el->msgid == mid)
+        {
+            idx->slots[i] = &retry_index_taken;
+            return el;
+        }
+
+        i = (i + 1) & (RETRY_INDEX_SLOTS - 1);
+    }
+
+    return NULL;
+}
+
+/**
+ * take out the next element still indexed, pos starts at 0
+ */
+retry_list_el retry_index_next(retry_index idx, size_t * pos)
+{
+    retry_list_el el;
+
+    for(; idx && *pos < RETRY_INDEX_SLOTS; (*pos)++)
+    {
+        el = idx->slots[*pos];
+        if(el != NULL && el != &retry_index_taken)
+        {
+            idx->slots[*pos] = &retry_index_taken;
+            return el;
+        }
+    }
+
+    return NULL;
 }
@@ -31,6 +31,19 @@
 
 #define MS_MSG_RETRY_LIMIT 12
 
+struct _ms_aor;
+
+// where an element is queued, see t_retry_list, and how it is sent
+typedef struct _retry_key
+{
+    unsigned int flow;  // sub-queue hash
+    int cls;            // weight class of the sub-queue
+    int prio;           // priority level, 0 is served first
+    time_t exp_time;    // deadline of the message, 0 - none
+    int batch;          // messages per MESSAGE the AoR takes, 0/1 - one
+    struct _ms_aor * page;  // AoR whose current page counts the message
+} t_retry_key, *retry_key;
+
 typedef struct _retry_list_el
 {
     t_msg_mid msgid;
@@ -38,34 +51,109 @@ typedef struct _retry_list_el
 
     int retry_ctr;
     time_t not_before;
+    long long not_before_ms;  // not_before in ms, finer if set by the sender
+
+    // window slot of the destination AoR held by the message, ms_aor.h
+    struct _ms_aor * aor;
+
+    t_retry_key key;
+    long long queued_ms;
 
-    struct _retry_list_el * clone;
     struct _retry_list_el * prev;
     struct _retry_list_el * next;
 } t_retry_list_el, *retry_list_el;
 
-typedef struct _retry_list
+/* Open-addressing mid -> element index used by the sender for one batch.
+ * Must hold at least twice the batch size to keep probe chains short. */
+#define RETRY_INDEX_SLOTS 64
+
+typedef struct _retry_index
 {
-    long nrretry;
+    size_t used;
+    retry_list_el slots[RETRY_INDEX_SLOTS];
+} t_retry_index, *retry_index;
+
+/* The retry list has RETRY_PRIO_MAX priority levels, a lower level is served
+ * only when the higher ones have nothing due, unless it was not served for
+ * aging_ms. Each level is split into RETRY_FLOWS sub-queues, an element goes
+ * to the one its flow hashes to. A sub-queue is ordered by the deadline
+ * (exp_time), earliest first, then by arrival; elements not due yet wait
+ * aside ordered by not_before_ms and join it when due. Non-empty sub-queues
+ * are served with deficit round robin, a turn takes as many elements as the
+ * weight of the sub-queue's class. */
+#define RETRY_FLOWS 1024
+#define RETRY_CLASS_MAX 32
+#define RETRY_PRIO_MAX 4
+
+typedef struct _retry_class
+{
+    int weight;
+    long depth;
+} t_retry_class, *retry_class;
+
+typedef struct _retry_flow
+{
+    long n;
+    int cls;
+    int deficit;
+    int turn;                       // the flow is being served
     retry_list_el lretry_new;
     retry_list_el lretry_pop;
+    retry_list_el ldefer_first;     // not due yet, by not_before_ms
+    retry_list_el ldefer_last;
+    struct _retry_flow * active_next; // ring of non-empty flows
+    struct _retry_flow * active_prev;
+} t_retry_flow, *retry_flow;
+
+typedef struct _retry_level
+{
+    long n;
+    long nactive;
+    retry_flow active;              // served next
+    long long served_ms;            // last served or became non-empty
+    long long wait_ms;              // queueing time of the taken elements
+    long taken;
+    t_retry_flow flows[RETRY_FLOWS];
+} t_retry_level, *retry_level;
+
+typedef struct _retry_list
+{
+    long nrretry;
+    int nclasses;
+    t_retry_class classes[RETRY_CLASS_MAX];
+    int aging_ms;                   // 0 - strict priority
+    t_retry_level levels[RETRY_PRIO_MAX];
     gen_lock_t  sem_retry;
 } t_retry_list, *retry_list;
 
 retry_list_el retry_list_el_new();
+long long retry_now_ms(void);
 void retry_list_el_free(retry_list_el);
 void retry_list_el_free_all(retry_list_el);
 
 retry_list retry_list_init();
 void retry_list_free(retry_list);
-int retry_add_element(retry_list ml, t_msg_mid mid, int retry_ctr, time_t not_before);
+int retry_add_element(retry_list ml, t_msg_mid mid, int retry_ctr, time_t not_before,
+                      const t_retry_key * key);
+int retry_push_element(retry_list ml, retry_list_el el);
 retry_list_el retry_peek_n(retry_list ml, size_t n, size_t * size);
+retry_list_el retry_peek_due(retry_list ml, size_t n, size_t * size);
 int retry_is_empty(retry_list ml);
 retry_list_el retry_list_reset(retry_list ml);
+int retry_list_set_class(retry_list ml, int cls, int weight);
+int retry_list_class_stats(retry_list ml, long * depth, long long * wait_ms, int n);
+int retry_list_level_stats(retry_list ml, long * depth, long long * latency_ms, int n);
 
 void retry_list_el_free_prev_all(retry_list_el mle);
-void retry_clone_element(const retry_list_el src, retry_list_el dst);
-retry_list_el retry_clone_elements_prev_local(retry_list_el p0);
+
+int retry_list_save(retry_list_el list, const char * path);
+retry_list_el retry_list_load(const char * path, size_t * size);
+
+void retry_index_reset(retry_index idx);
+int retry_index_put(retry_index idx, retry_list_el el);
+retry_list_el retry_index_get(retry_index idx, t_msg_mid mid);
+retry_list_el retry_index_take(retry_index idx, t_msg_mid mid);
+retry_list_el retry_index_next(retry_index idx, size_t * pos);
 
 //int retry_list_set_flag(retry_list, int, int);
 //int retry_list_should_retry(retry_list ml, int mid, int limit, int * retryCnt, int fl);
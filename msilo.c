@@ -48,6 +48,9 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
 #include <pthread.h>
 
 #include "../../sr_module.h"
@@ -62,6 +65,7 @@
 #include "../../parser/parse_allow.h"
 #include "../../parser/parse_methods.h"
 #include "../../resolve.h"
+#include "../../ip_addr.h"
 #include "../../usr_avp.h"
 #include "../../mod_fix.h"
 
@@ -73,68 +77,72 @@
 #include "msfuncs.h"
 #include "msilo.h"
 #include "ms_amqp.h"
+#include "ms_arena.h"
+#include "ms_cache.h"
+#include "ms_aor.h"
+#include "ms_inflight.h"
+#include "ms_store.h"
 
-#define MAX_DEL_KEYS	1
 #define MAX_PEEK_NUM	10
-#define NR_KEYS			11
-#define PH_SQL_BUF_LEN 2048
-#define MSG_BODY_BUFF_LEN 2048
-#define MSG_HDR_BUFF_LEN 1024
-
-static str sc_mid      = str_init("id");        /* 0 */
-static str sc_from     = str_init("src_addr");  /* 1 */
-static str sc_to       = str_init("dst_addr");  /* 2 */
-static str sc_uri_user = str_init("username");  /* 3 */
-static str sc_uri_host = str_init("domain");    /* 4 */
-static str sc_body     = str_init("body");      /* 5 */
-static str sc_ctype    = str_init("ctype");     /* 6 */
-static str sc_exp_time = str_init("exp_time");  /* 7 */
-static str sc_inc_time = str_init("inc_time");  /* 8 */
-static str sc_snd_time = str_init("snd_time");  /* 9 */
-static str sc_msg_type = str_init("msg_type");  /* 10 */
-
-#define SET_STR_VAL(_str, _res, _r, _c)	\
-	if (RES_ROWS(_res)[_r].values[_c].nul == 0) \
-	{ \
-		switch(RES_ROWS(_res)[_r].values[_c].type) \
-		{ \
-		case DB_STRING: \
-			(_str).s=(char*)RES_ROWS(_res)[_r].values[_c].val.string_val; \
-			(_str).len=strlen((_str).s); \
-			break; \
-		case DB_STR: \
-			(_str).len=RES_ROWS(_res)[_r].values[_c].val.str_val.len; \
-			(_str).s=(char*)RES_ROWS(_res)[_r].values[_c].val.str_val.s; \
-			break; \
-		case DB_BLOB: \
-			(_str).len=RES_ROWS(_res)[_r].values[_c].val.blob_val.len; \
-			(_str).s=(char*)RES_ROWS(_res)[_r].values[_c].val.blob_val.s; \
-			break; \
-		default: \
-			(_str).len=0; \
-			(_str).s=NULL; \
-		} \
-	}
-
-
-
-#define S_TABLE_VERSION 6
-
-/** database connection */
-static db_con_t *db_con = NULL;
-static db_func_t msilo_dbf;
+#define MS_MULTIPART "multipart/mixed;boundary="
+#define MS_MULTIPART_LEN (sizeof(MS_MULTIPART)-1)
+#define MS_BOUNDARY_MAX_LEN 64
+#define MS_ROUTE_PREFIX "Route: "
+#define MS_ROUTE_PREFIX_LEN (sizeof(MS_ROUTE_PREFIX)-1)
+/* registration lifetime when the REGISTER does not tell */
+#define MS_CONTACT_EXPIRES 3600
+/* "sip:[ipv6]:port;transport=sctp" */
+#define MS_SOURCE_URI_MAX 80
+#define MSG_ARENA_CHUNK 16384
+#define MSG_ARENA_KEEP (16*MSG_ARENA_CHUNK)
+#define MS_CACHE_DUMP_MAX 64
+/* AoRs given a next page per sender loop */
+#define MS_PAGE_DUE_MAX 32
+
+/** state of one dump (or page) of an AoR */
+typedef struct _ms_dump_ctx
+{
+	time_t not_before;
+	int limit;      // page size, 0 - whole backlog
+	int n;
+	int capped;     // dump_limit reached, more messages may be stored
+	t_msg_mid last; // highest id seen
+	t_msg_mid mids[MS_CACHE_DUMP_MAX];
+	int page_n;     // messages queued by this run
+	t_retry_key key;   // sender sub-queue of the AoR
+} t_ms_dump_ctx;
+
+/* sender sub-queues, fair_queue param */
+#define MS_FAIR_OFF    0
+#define MS_FAIR_AOR    1
+#define MS_FAIR_DOMAIN 2
+
+#if MAX_PEEK_NUM*2 > RETRY_INDEX_SLOTS
+#error "RETRY_INDEX_SLOTS too small for MAX_PEEK_NUM"
+#endif
 
 /** precessed msg list - used for dumping the messages */
 msg_list ml = NULL;
 retry_list rl = NULL;
 
+/** cache of stored messages, NULL if disabled */
+ms_cache mc = NULL;
+
+/** per AoR dump and window state, NULL if neither is used */
+ms_aor_table ma = NULL;
+
+/** MESSAGE transactions in flight, the TM callback param is a handle */
+ms_inflight mi = NULL;
+
 /** TM bind */
 struct tm_binds tmb;
 
+/** message storage */
+ms_store mss = NULL;
+
 /** parameters */
 
-static str ms_db_url = {NULL, 0};
-static str ms_db_table = str_init("silo");
+static char* ms_storage = "db";
 str  ms_reminder = {NULL, 0};
 str  ms_outbound_proxy = {NULL, 0};
 
@@ -155,7 +163,58 @@ long  ms_send_time = 0;
 int  ms_clean_period = 10;
 int  ms_use_contact = 1;
 int  ms_add_date = 1;
+int  ms_offline_date_fmt = MS_DATE_FMT_CTIME;
+int  ms_reminder_date_fmt = MS_DATE_FMT_CTIME;
+static char* ms_offline_date_fmt_s = NULL;
+static char* ms_reminder_date_fmt_s = NULL;
+static char* ms_type_date_fmts = NULL;
+#define MS_DATE_TYPES_MAX 16
+static str ms_date_type[MS_DATE_TYPES_MAX];
+static int ms_date_type_fmt[MS_DATE_TYPES_MAX];
+static int ms_date_types = 0;
 int  ms_max_messages = 0;
+int  ms_cache_size = 0;
+int  ms_dump_limit = 0;
+int  ms_page_size = 0;
+int  ms_page_timeout = 120;
+int  ms_window = 0;
+int  ms_rate_aor = 0;
+int  ms_burst_aor = 0;
+int  ms_rate_domain = 0;
+int  ms_burst_domain = 0;
+static t_ms_rate ms_aor_rate, ms_domain_rate;
+int  ms_fair_queue = MS_FAIR_AOR;
+static char* ms_domain_weights = NULL;
+static char* ms_type_priorities = NULL;
+int  ms_priority_aging = 5000;
+/* msg_type -> priority level, "*" is the default */
+#define MS_PRIO_TYPES_MAX 32
+static str ms_prio_type[MS_PRIO_TYPES_MAX];
+static int ms_prio_level[MS_PRIO_TYPES_MAX];
+static int ms_prio_types = 0;
+static int ms_prio_default = 0;
+static int ms_prio_levels = 1;
+static char* ms_backoff_s[MS_RCLASS_NO] = {NULL, NULL, NULL};
+static char* ms_response_actions = NULL;
+static ms_resp_table_t ms_resp_table;
+int  ms_unreachable_time = 300;
+int  ms_breaker_failures = 3;
+int  ms_breaker_cooldown = 600;
+int  ms_expiry_margin = 2;
+static str ms_batch_accept = {NULL, 0};
+int  ms_direct_delivery = 0;
+int  ms_batch_max = MAX_PEEK_NUM;
+int  ms_inflight_max = 8192;
+static char* ms_queue_snapshot = NULL;
+int  ms_shutdown_timeout = 2000;
+static ms_backoff_t ms_backoff[MS_RCLASS_NO] = {
+	{5, 2, 300},    /* MS_RCLASS_UNAVAIL */
+	{2, 2, 60},     /* MS_RCLASS_SERVER */
+	{1, 2, 30}      /* MS_RCLASS_OTHER */
+};
+/* weighted domains, class 0 is every other domain */
+static str ms_class_domain[RETRY_CLASS_MAX];
+static int ms_classes = 1;
 
 // AMQP related
 char*  ms_amqp_host = "localhost";
@@ -167,6 +226,8 @@ int  ms_amqp_port = 5672;
 int  ms_amqp_enabled = 0;
 
 static str ms_snd_time_avp_param = {NULL, 0};
+static char* ms_snd_time_tz = NULL;
+long ms_snd_time_tz_offset = 0;
 int ms_snd_time_avp_name = -1;
 unsigned short ms_snd_time_avp_type;
 
@@ -180,13 +241,15 @@ static int m_store(struct sip_msg*, char*, char*);
 static int m_dump(struct sip_msg*, char*, char*);
 
 void destroy(void);
+static void m_queue_restore(void);
+static void m_queue_save(void);
 
 void m_clean_silo(unsigned int ticks, void *);
 void m_send_ontimer(unsigned int ticks, void *);
 
 int ms_reset_stime(t_msg_mid mid);
 
-int check_message_support(struct sip_msg* msg);
+int check_message_support(struct sip_msg* msg, contact_t** mc);
 
 /** TM callback function */
 static void m_tm_callback( struct cell *t, int type, struct tmcb_params *ps);
@@ -196,10 +259,21 @@ static void m_tm_callback( struct cell *t, int type, struct tmcb_params *ps);
 #define SENDER_THREAD_NUM 1
 #define SENDER_THREAD_WAIT_MS 100
 str msg_hdr_type = str_init("X-MsgType");
+static str msg_hdr_names[MS_HDR_NAMES_NO];
 
 static volatile int sender_threads_running;
+static volatile sig_atomic_t sender_sigterm_got = 0;
 static int sender_thread_waiters;
 
+/** sender process state, shared with the process running destroy() */
+typedef struct _ms_sender_ctl
+{
+	int pid;
+	volatile int stop;     // asked to quit
+	volatile int stopped;  // quit, its batch is back in the queue
+} t_ms_sender_ctl;
+static t_ms_sender_ctl *sender_ctl = NULL;
+
 pthread_mutex_t * p_sender_thread_queue_cond_mutex = NULL;
 pthread_mutexattr_t * p_sender_thread_queue_cond_mutex_attr = NULL;
 
@@ -221,20 +295,24 @@ static int spawn_sender_threads(void);
 static int terminate_sender_threads(void);
 static void *sender_thread_main(void *varg);
 static void signal_new_task(void);
+static int sender_running(void);
+static int wait_sender_stopped(void);
+static void requeue_list_prev(retry_list_el list);
 
 // https://voipmagazine.wordpress.com/tag/extra-process/
-int* sender_pid;
 int pid = 0;
 static int msg_process_prefork(void);
 static int msg_process_postfork(void);
 static void msg_process(int rank);
-static int build_sql_query(char *sql_query, str *sql_str, t_msg_mid *mids_to_load, size_t mids_to_load_size);
-static unsigned long wait_not_before(time_t not_before);
+static unsigned long wait_not_before(long long not_before_ms);
 static int send_messages(retry_list_el list);
 static int msg_set_flags_all_list_prev(retry_list_el list, int flag);
 static int msg_set_flags_all(t_msg_mid *mids, size_t mids_size, int flag);
 static void timespec_add_milli(struct timespec * time_to_change, struct timeval * now, long long milli_seconds);
 
+/** per process buffers for building outgoing messages */
+static t_ms_arena msg_arena;
+
 #ifdef MS_AMQP
 #define AMQP_BUFF 2048
 /** RabbitMQ */
@@ -291,8 +369,40 @@ static param_export_t params[]={
 	{ "sc_snd_time",      STR_PARAM, &sc_snd_time.s           },
 	{ "sc_msg_type",      STR_PARAM, &sc_msg_type.s           },
 	{ "snd_time_avp",     STR_PARAM, &ms_snd_time_avp_param.s },
+	{ "snd_time_tz",      STR_PARAM, &ms_snd_time_tz          },
 	{ "add_date",         INT_PARAM, &ms_add_date             },
+	{ "offline_date_format",  STR_PARAM, &ms_offline_date_fmt_s  },
+	{ "reminder_date_format", STR_PARAM, &ms_reminder_date_fmt_s },
+	{ "type_date_formats",    STR_PARAM, &ms_type_date_fmts      },
 	{ "max_messages",     INT_PARAM, &ms_max_messages         },
+	{ "cache_size",       INT_PARAM, &ms_cache_size           },
+	{ "dump_limit",       INT_PARAM, &ms_dump_limit           },
+	{ "page_size",        INT_PARAM, &ms_page_size            },
+	{ "page_timeout",     INT_PARAM, &ms_page_timeout         },
+	{ "window",           INT_PARAM, &ms_window               },
+	{ "rate_aor",         INT_PARAM, &ms_rate_aor             },
+	{ "burst_aor",        INT_PARAM, &ms_burst_aor            },
+	{ "rate_domain",      INT_PARAM, &ms_rate_domain          },
+	{ "burst_domain",     INT_PARAM, &ms_burst_domain         },
+	{ "fair_queue",       INT_PARAM, &ms_fair_queue           },
+	{ "domain_weights",   STR_PARAM, &ms_domain_weights       },
+	{ "type_priorities",  STR_PARAM, &ms_type_priorities      },
+	{ "priority_aging",   INT_PARAM, &ms_priority_aging       },
+	{ "backoff_unavailable", STR_PARAM, &ms_backoff_s[MS_RCLASS_UNAVAIL] },
+	{ "backoff_server",   STR_PARAM, &ms_backoff_s[MS_RCLASS_SERVER] },
+	{ "backoff_other",    STR_PARAM, &ms_backoff_s[MS_RCLASS_OTHER]  },
+	{ "response_actions", STR_PARAM, &ms_response_actions     },
+	{ "unreachable_time", INT_PARAM, &ms_unreachable_time     },
+	{ "breaker_failures", INT_PARAM, &ms_breaker_failures     },
+	{ "breaker_cooldown", INT_PARAM, &ms_breaker_cooldown     },
+	{ "expiry_margin",    INT_PARAM, &ms_expiry_margin        },
+	{ "batch_accept",     STR_PARAM, &ms_batch_accept.s       },
+	{ "batch_max",        INT_PARAM, &ms_batch_max            },
+	{ "inflight_max",     INT_PARAM, &ms_inflight_max         },
+	{ "direct_delivery",  INT_PARAM, &ms_direct_delivery      },
+	{ "queue_snapshot",   STR_PARAM, &ms_queue_snapshot       },
+	{ "shutdown_timeout", INT_PARAM, &ms_shutdown_timeout     },
+	{ "fetch_rows",       INT_PARAM, &ms_db_fetch_rows        },
 	{ "amqp_host",        STR_PARAM, &ms_amqp_host            },
 	{ "amqp_vhost",       STR_PARAM, &ms_amqp_vhost           },
 	{ "amqp_user",        STR_PARAM, &ms_amqp_user            },
@@ -300,6 +410,11 @@ static param_export_t params[]={
 	{ "amqp_queue",       STR_PARAM, &ms_amqp_queue           },
 	{ "amqp_port",        INT_PARAM, &ms_amqp_port            },
 	{ "amqp_enabled",     INT_PARAM, &ms_amqp_enabled         },
+	{ "storage",          STR_PARAM, &ms_storage              },
+	{ "log_dir",          STR_PARAM, &ms_log_dir              },
+	{ "log_segment_size", INT_PARAM, &ms_log_segment_size     },
+	{ "log_segments",     INT_PARAM, &ms_log_segments         },
+	{ "log_sync",         INT_PARAM, &ms_log_sync             },
 	{ 0,0,0 }
 };
 
@@ -312,6 +427,22 @@ stat_var* ms_dumped_msgs;
 stat_var* ms_failed_msgs;
 stat_var* ms_dumped_rmds;
 stat_var* ms_failed_rmds;
+stat_var* ms_unmatched_rows;
+stat_var* ms_cache_dump_hits;
+stat_var* ms_cache_dump_misses;
+stat_var* ms_cache_row_hits;
+stat_var* ms_cache_row_misses;
+stat_var* ms_rate_deferred;
+stat_var* ms_aborted_msgs;
+stat_var* ms_expired_msgs;
+stat_var* ms_batched_msgs;
+stat_var* ms_direct_msgs;
+stat_var* ms_aor_pauses;
+stat_var* ms_aor_paused_time;
+static stat_var* ms_queue_depth[RETRY_CLASS_MAX];
+static stat_var* ms_queue_wait[RETRY_CLASS_MAX];
+static stat_var* ms_prio_depth[RETRY_PRIO_MAX];
+static stat_var* ms_prio_latency[RETRY_PRIO_MAX];
 
 static stat_export_t msilo_stats[] = {
 	{"stored_messages" ,  0,  &ms_stored_msgs  },
@@ -319,6 +450,18 @@ static stat_export_t msilo_stats[] = {
 	{"failed_messages" ,  0,  &ms_failed_msgs  },
 	{"dumped_reminders" , 0,  &ms_dumped_rmds  },
 	{"failed_reminders" , 0,  &ms_failed_rmds  },
+	{"unmatched_rows" ,   0,  &ms_unmatched_rows },
+	{"cache_dump_hits" ,  0,  &ms_cache_dump_hits },
+	{"cache_dump_misses", 0,  &ms_cache_dump_misses },
+	{"cache_row_hits" ,   0,  &ms_cache_row_hits },
+	{"cache_row_misses" , 0,  &ms_cache_row_misses },
+	{"rate_deferred" ,    0,  &ms_rate_deferred },
+	{"aborted_messages" , 0,  &ms_aborted_msgs  },
+	{"expired_messages" , 0,  &ms_expired_msgs  },
+	{"batched_messages" , 0,  &ms_batched_msgs  },
+	{"direct_messages" ,  0,  &ms_direct_msgs   },
+	{"aor_pauses" ,       STAT_NO_RESET,  &ms_aor_pauses },
+	{"aor_paused_time" ,  STAT_NO_RESET,  &ms_aor_paused_time },
 	{0,0,0}
 };
 
@@ -344,41 +487,335 @@ struct module_exports exports= {
 	child_init  /* per-child init function */
 };
 
+/**
+ * walk "key=value[,key=value...]", set is called for every pair
+ * return: 0 ok ; -1 bad syntax or set failed
+ */
+static int m_parse_key_values(char *spec, int (*set)(str *key, str *val))
+{
+	char *p;
+	str key, val;
+
+	if(spec == NULL)
+		return 0;
+
+	for(p = spec; *p; )
+	{
+		while(*p==' ' || *p==',' || *p==';')
+			p++;
+		if(*p == 0)
+			break;
+
+		key.s = p;
+		while(*p && *p!='=' && *p!=' ' && *p!=',' && *p!=';')
+			p++;
+		key.len = (int)(p - key.s);
+		while(*p == ' ')
+			p++;
+		if(*p != '=' || key.len == 0)
+			return -1;
+		p++;
+		while(*p == ' ')
+			p++;
+		val.s = p;
+		while(*p && *p!=' ' && *p!=',' && *p!=';')
+			p++;
+		val.len = (int)(p - val.s);
+
+		if(set(&key, &val) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int m_set_domain_weight(str *domain, str *val)
+{
+	int w;
+
+	if(str2sint(val, &w) != 0 || w <= 0)
+		return -1;
+	if(ms_classes >= RETRY_CLASS_MAX)
+	{
+		LM_ERR("more than %d weighted domains\n", RETRY_CLASS_MAX - 1);
+		return -1;
+	}
+
+	ms_class_domain[ms_classes] = *domain;
+	if(retry_list_set_class(rl, ms_classes, w) != MSG_LIST_OK)
+		return -1;
+	LM_DBG("domain <%.*s> weight %d\n", domain->len, domain->s, w);
+	ms_classes++;
+	return 0;
+}
+
+/**
+ * parse "domain=weight[,domain=weight...]" into the weighted classes
+ */
+static int m_parse_domain_weights(char *spec)
+{
+	ms_classes = 1;
+	ms_class_domain[0].s = "other";
+	ms_class_domain[0].len = 5;
+
+	return m_parse_key_values(spec, m_set_domain_weight);
+}
+
+/**
+ * sub-queue and weight class of the AoR in the retry list
+ */
+static void m_flow(str *user, str *host, unsigned int *flow, int *cls)
+{
+	unsigned int h = 2166136261u;
+	int i;
+
+	*cls = 0;
+	for(i = 1; i < ms_classes; i++)
+	{
+		if(ms_class_domain[i].len == host->len
+				&& strncasecmp(ms_class_domain[i].s, host->s, host->len) == 0)
+		{
+			*cls = i;
+			break;
+		}
+	}
+
+	if(ms_fair_queue == MS_FAIR_AOR)
+	{
+		for(i = 0; i < user->len; i++)
+			h = (h ^ (unsigned char)user->s[i]) * 16777619u;
+		h = (h ^ '@') * 16777619u;
+	}
+	for(i = 0; i < host->len; i++)
+		h = (h ^ (unsigned char)tolower((unsigned char)host->s[i])) * 16777619u;
+
+	*flow = ms_fair_queue == MS_FAIR_OFF ? 0 : h;
+}
+
+static int m_set_type_priority(str *type, str *val)
+{
+	int l;
+
+	if(str2sint(val, &l) != 0)
+		return -1;
+	if(l < 0 || l >= RETRY_PRIO_MAX)
+	{
+		LM_ERR("priority level of <%.*s> out of 0..%d\n", type->len, type->s,
+				RETRY_PRIO_MAX - 1);
+		return -1;
+	}
+	if(l + 1 > ms_prio_levels)
+		ms_prio_levels = l + 1;
+
+	if(type->len == 1 && *type->s == '*')
+	{
+		ms_prio_default = l;
+		return 0;
+	}
+	if(ms_prio_types >= MS_PRIO_TYPES_MAX)
+	{
+		LM_ERR("more than %d prioritized message types\n", MS_PRIO_TYPES_MAX);
+		return -1;
+	}
+	ms_prio_type[ms_prio_types] = *type;
+	ms_prio_level[ms_prio_types++] = l;
+	return 0;
+}
+
+/**
+ * parse "msg_type=level[,msg_type=level...]", level 0 is served first,
+ * msg_type "*" sets the level of the other types
+ */
+static int m_parse_type_priorities(char *spec)
+{
+	ms_prio_types = 0;
+	ms_prio_default = 0;
+	ms_prio_levels = 1;
+
+	return m_parse_key_values(spec, m_set_type_priority);
+}
+
+static int m_set_type_date_fmt(str *type, str *val)
+{
+	int fmt;
+
+	if((fmt = ms_parse_date_format_str(val)) < 0)
+		return -1;
+	if(ms_date_types >= MS_DATE_TYPES_MAX)
+	{
+		LM_ERR("more than %d message types with a date format\n", MS_DATE_TYPES_MAX);
+		return -1;
+	}
+	ms_date_type[ms_date_types] = *type;
+	ms_date_type_fmt[ms_date_types++] = fmt;
+	return 0;
+}
+
+/**
+ * date format of the body prefix for a stored msg_type, -1 - that of the kind
+ */
+static int m_date_fmt(str *msg_type)
+{
+	int i;
+
+	for(i = 0; i < ms_date_types; i++)
+		if(ms_date_type[i].len == msg_type->len
+				&& strncasecmp(ms_date_type[i].s, msg_type->s, msg_type->len) == 0)
+			return ms_date_type_fmt[i];
+
+	return -1;
+}
+
+/**
+ * priority level of a stored msg_type
+ */
+static int m_prio(str *msg_type)
+{
+	int i;
+
+	for(i = 0; i < ms_prio_types; i++)
+		if(ms_prio_type[i].len == msg_type->len
+				&& strncasecmp(ms_prio_type[i].s, msg_type->s, msg_type->len) == 0)
+			return ms_prio_level[i];
+
+	return ms_prio_default;
+}
+
+#ifdef STATISTICS
+/**
+ * queue_depth_<domain> and queue_wait_<domain> for every class
+ */
+static int m_register_queue_stats(void)
+{
+	static const char *names[2] = {"queue_depth_", "queue_wait_"};
+	stat_var **vars[2] = {ms_queue_depth, ms_queue_wait};
+	char *name;
+	int i, k, len;
+
+	for(i = 0; i < ms_classes; i++)
+	{
+		for(k = 0; k < 2; k++)
+		{
+			len = strlen(names[k]);
+			name = (char*)pkg_malloc(len + ms_class_domain[i].len + 1);
+			if(name == NULL)
+			{
+				LM_ERR("no more pkg memory\n");
+				return -1;
+			}
+			memcpy(name, names[k], len);
+			memcpy(name + len, ms_class_domain[i].s, ms_class_domain[i].len);
+			name[len + ms_class_domain[i].len] = 0;
+
+			if(register_stat("msilo", name, &vars[k][i], STAT_NO_RESET) != 0)
+			{
+				LM_ERR("failed to register stat %s\n", name);
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * queue_depth_prio<n> and latency_prio<n> for every priority level in use
+ */
+static int m_register_prio_stats(void)
+{
+	char *name;
+	int l;
+
+	for(l = 0; l < ms_prio_levels; l++)
+	{
+		name = (char*)pkg_malloc(2 * 24);
+		if(name == NULL)
+		{
+			LM_ERR("no more pkg memory\n");
+			return -1;
+		}
+		snprintf(name, 24, "queue_depth_prio%d", l);
+		snprintf(name + 24, 24, "latency_prio%d", l);
+		if(register_stat("msilo", name, &ms_prio_depth[l], STAT_NO_RESET) != 0
+				|| register_stat("msilo", name + 24, &ms_prio_latency[l], STAT_NO_RESET) != 0)
+		{
+			LM_ERR("failed to register priority stats\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * publish the depth and the mean queueing time (ms) since the last call per
+ * priority level
+ */
+static void m_update_prio_stats(void)
+{
+	long depth[RETRY_PRIO_MAX];
+	long long latency_ms[RETRY_PRIO_MAX];
+	int l, n;
+
+	n = retry_list_level_stats(rl, depth, latency_ms, ms_prio_levels);
+	for(l = 0; l < n; l++)
+	{
+		update_stat(ms_prio_depth[l], depth[l] - (long)get_stat_val(ms_prio_depth[l]));
+		update_stat(ms_prio_latency[l], (long)latency_ms[l] - (long)get_stat_val(ms_prio_latency[l]));
+	}
+}
+
+/**
+ * publish the depth and the oldest wait (ms) of the queued messages per class
+ */
+static void m_update_queue_stats(void)
+{
+	long depth[RETRY_CLASS_MAX];
+	long long wait_ms[RETRY_CLASS_MAX];
+	int i, n;
+
+	n = retry_list_class_stats(rl, depth, wait_ms, ms_classes);
+	for(i = 0; i < n; i++)
+	{
+		update_stat(ms_queue_depth[i], depth[i] - (long)get_stat_val(ms_queue_depth[i]));
+		update_stat(ms_queue_wait[i], (long)wait_ms[i] - (long)get_stat_val(ms_queue_wait[i]));
+	}
+}
+
+/**
+ * publish the AoR pauses and the time the finished ones took (s)
+ */
+static void m_update_pause_stats(void)
+{
+	long pauses;
+	long long paused_s;
+
+	ms_aor_pause_stats(ma, &pauses, &paused_s);
+	update_stat(ms_aor_pauses, pauses - (long)get_stat_val(ms_aor_pauses));
+	update_stat(ms_aor_paused_time, (long)paused_s - (long)get_stat_val(ms_aor_paused_time));
+}
+#endif
+
 /**
  * init module function
  */
 static int mod_init(void)
 {
 	pv_spec_t avp_spec;
+	int i;
 
-	init_db_url( ms_db_url , 0 /*cannot be null*/);
-	ms_db_table.len = strlen (ms_db_table.s);
-	sc_mid.len = strlen(sc_mid.s);
-	sc_from.len = strlen(sc_from.s);
-	sc_to.len = strlen(sc_to.s);
-	sc_uri_user.len = strlen(sc_uri_user.s);
-	sc_uri_host.len = strlen(sc_uri_host.s);
-	sc_body.len = strlen(sc_body.s);
-	sc_ctype.len = strlen(sc_ctype.s);
-	sc_exp_time.len = strlen(sc_exp_time.s);
-	sc_inc_time.len = strlen(sc_inc_time.s);
-	sc_snd_time.len = strlen(sc_snd_time.s);
-	sc_msg_type.len = strlen(sc_msg_type.s);
 	if (ms_snd_time_avp_param.s)
 		ms_snd_time_avp_param.len = strlen(ms_snd_time_avp_param.s);
 
 	LM_DBG("initializing ...\n");
 
-	/* binding to mysql module  */
-	if (db_bind_mod(&ms_db_url, &msilo_dbf))
+	if (ms_storage==NULL || strcasecmp(ms_storage, ms_db_store.name)==0)
+		mss = &ms_db_store;
+	else if (strcasecmp(ms_storage, ms_log_store.name)==0)
+		mss = &ms_log_store;
+	else
 	{
-		LM_INFO("database module not found\n");
-		return -1;
-	}
-
-	if (!DB_CAPABILITY(msilo_dbf, DB_CAP_ALL)) {
-		LM_ERR("database module does not implement "
-		    "all functions needed by the module\n");
+		LM_ERR("unknown storage [%s], use db or log\n", ms_storage);
 		return -1;
 	}
 
@@ -397,22 +834,20 @@ static int mod_init(void)
 					ms_snd_time_avp_param.len, ms_snd_time_avp_param.s);
 			return -1;
 		}
-	}
 
-	db_con = msilo_dbf.init(&ms_db_url);
-	if (!db_con)
-	{
-		LM_ERR("failed to connect to the database\n");
-		return -1;
+		if(ms_parse_tz(ms_snd_time_tz, &ms_snd_time_tz_offset)!=0)
+		{
+			LM_ERR("bad snd_time_tz value [%s]\n", ms_snd_time_tz);
+			return -1;
+		}
+		LM_DBG("snd_time offset to UTC: %ld\n", ms_snd_time_tz_offset);
 	}
 
-	if(db_check_table_version(&msilo_dbf, db_con, &ms_db_table, S_TABLE_VERSION) < 0) {
-		LM_ERR("error during table version check.\n");
+	if (mss->init() != 0)
+	{
+		LM_ERR("failed to initialize %s storage\n", mss->name);
 		return -1;
 	}
-	if(db_con)
-		msilo_dbf.close(db_con);
-	db_con = NULL;
 
 	/* load the TM API */
 	if (load_tm_api(&tmb)!=0) {
@@ -500,6 +935,128 @@ static int mod_init(void)
 		return -1;
 	}
 
+	if(m_parse_domain_weights(ms_domain_weights) != 0)
+	{
+		LM_ERR("bad domain_weights, use domain=weight[,domain=weight...]\n");
+		return -1;
+	}
+	for(i = 0; i < MS_RCLASS_NO; i++)
+	{
+		if(ms_parse_backoff(ms_backoff_s[i], &ms_backoff[i]) != 0)
+		{
+			LM_ERR("bad backoff [%s], use base[,factor[,max]] in seconds\n",
+					ms_backoff_s[i]);
+			return -1;
+		}
+	}
+	ms_resp_table_init(&ms_resp_table);
+	if(ms_parse_resp_table(ms_response_actions, &ms_resp_table) != 0)
+	{
+		LM_ERR("bad response_actions, use code:retry|giveup|abort[,...] with"
+				" code as NNN or Nxx\n");
+		return -1;
+	}
+	if(ms_fair_queue < MS_FAIR_OFF || ms_fair_queue > MS_FAIR_DOMAIN)
+	{
+		LM_ERR("bad fair_queue, use 0 (off), 1 (per AoR) or 2 (per domain)\n");
+		return -1;
+	}
+	if(m_parse_type_priorities(ms_type_priorities) != 0)
+	{
+		LM_ERR("bad type_priorities, use msg_type=level[,msg_type=level...]\n");
+		return -1;
+	}
+	rl->aging_ms = ms_priority_aging > 0 ? ms_priority_aging : 0;
+#ifdef STATISTICS
+	if(m_register_queue_stats() != 0 || m_register_prio_stats() != 0)
+		return -1;
+#endif
+
+	ms_offline_date_fmt = ms_parse_date_format(ms_offline_date_fmt_s);
+	ms_reminder_date_fmt = ms_parse_date_format(ms_reminder_date_fmt_s);
+	if(ms_offline_date_fmt < 0 || ms_reminder_date_fmt < 0)
+	{
+		LM_ERR("bad date format, use ctime, iso8601 or none\n");
+		return -1;
+	}
+	if(m_parse_key_values(ms_type_date_fmts, m_set_type_date_fmt) != 0)
+	{
+		LM_ERR("bad type_date_formats, use msg_type=ctime|iso8601|none[,...]\n");
+		return -1;
+	}
+
+	msg_hdr_names[MS_HDR_MSG_TYPE] = msg_hdr_type;
+	if(ms_hdr_names_init(msg_hdr_names) != 0)
+	{
+		LM_ERR("can't initialize header lookup table\n");
+		return -1;
+	}
+
+	if(ms_arena_init(&msg_arena, MSG_ARENA_CHUNK, MSG_ARENA_KEEP) != 0)
+	{
+		LM_ERR("can't initialize message buffers\n");
+		return -1;
+	}
+
+	if(ms_cache_size > 0)
+	{
+		if(mss->caps & MS_STORE_CAP_INDEXED)
+		{
+			LM_INFO("%s storage is indexed in memory, "
+				"message cache not used\n", mss->name);
+		} else if(!(mss->caps & MS_STORE_CAP_IDS))
+		{
+			/* cached rows are keyed by the id the storage gave them */
+			LM_WARN("%s storage cannot report inserted ids, "
+				"message cache disabled\n", mss->name);
+		} else {
+			mc = ms_cache_init((size_t)ms_cache_size);
+			if(mc==NULL)
+			{
+				LM_ERR("can't initialize message cache\n");
+				return -1;
+			}
+		}
+	}
+
+	/* every page would load the whole rest of the backlog */
+	if(ms_page_size > 0 && !(mss->caps & MS_STORE_CAP_PAGED))
+	{
+		LM_WARN("storage cannot read a page alone, page_size ignored\n");
+		ms_page_size = 0;
+	}
+	if(ms_page_size > 0)
+	{
+		if(ms_page_size > MS_AOR_PAGE_MAX)
+		{
+			LM_WARN("page_size limited to %d\n", MS_AOR_PAGE_MAX);
+			ms_page_size = MS_AOR_PAGE_MAX;
+		}
+		if(ms_page_timeout <= 0)
+			ms_page_timeout = 120;
+	}
+	ms_aor_rate.rate = ms_rate_aor > 0 ? ms_rate_aor : 0;
+	ms_aor_rate.burst = ms_burst_aor > 0 ? ms_burst_aor : ms_aor_rate.rate;
+	ms_domain_rate.rate = ms_rate_domain > 0 ? ms_rate_domain : 0;
+	ms_domain_rate.burst = ms_burst_domain > 0 ? ms_burst_domain : ms_domain_rate.rate;
+
+	ma = ms_aor_init(1024);
+	if(ma==NULL)
+	{
+		LM_ERR("can't initialize AoR table\n");
+		return -1;
+	}
+	if(ms_breaker_cooldown <= 0)
+		ms_breaker_cooldown = 600;
+	ma->fail_ttl = ms_breaker_cooldown;
+
+	mi = ms_inflight_init(ms_inflight_max > 0 ? ms_inflight_max : 8192);
+	if(mi==NULL)
+	{
+		LM_ERR("can't initialize in-flight table\n");
+		return -1;
+	}
+
 	if(ms_check_time<0)
 	{
 		LM_ERR("bad check time value\n");
@@ -511,6 +1068,13 @@ static int mod_init(void)
 
 	if(ms_reminder.s!=NULL)
 		ms_reminder.len = strlen(ms_reminder.s);
+	if(ms_batch_accept.s!=NULL)
+		ms_batch_accept.len = strlen(ms_batch_accept.s);
+	if(ms_batch_max > MAX_PEEK_NUM)
+	{
+		LM_WARN("batch_max limited to %d\n", MAX_PEEK_NUM);
+		ms_batch_max = MAX_PEEK_NUM;
+	}
 	if(ms_outbound_proxy.s!=NULL)
 		ms_outbound_proxy.len = strlen(ms_outbound_proxy.s);
 
@@ -534,6 +1098,9 @@ static int mod_init(void)
 #endif
 	}
 
+	// What the last shutdown left queued.
+	m_queue_restore();
+
 	// Sender thread startup.
 	return init_sender_worker_env() == 0 ? 0 : -1;
 }
@@ -544,26 +1111,11 @@ static int mod_init(void)
 static int child_init(int rank)
 {
 	LM_DBG("rank #%d / pid <%d>\n", rank, getpid());
-	if (msilo_dbf.init==0)
+	if (mss->child_init(rank) != 0)
 	{
-		LM_CRIT("database not bound\n");
+		LM_ERR("child %d: failed to initialize %s storage\n", rank, mss->name);
 		return -1;
 	}
-	db_con = msilo_dbf.init(&ms_db_url);
-	if (!db_con)
-	{
-		LM_ERR("child %d: failed to connect database\n", rank);
-		return -1;
-	}
-	else
-	{
-		if (msilo_dbf.use_table(db_con, &ms_db_table) < 0) {
-			LM_ERR("child %d: failed in use_table\n", rank);
-			return -1;
-		}
-
-		LM_DBG("#%d database connection opened successfully\n", rank);
-	}
 
 #ifdef MS_AMQP
 	if (amqp_cfg_ok && ms_amqp_enabled)
@@ -593,31 +1145,43 @@ static int child_init(int rank)
 	//return init_child_sender_threads() == 0 ? 0 : -1;
 }
 
+#ifdef MS_AMQP
 /**
- * store message
- * mode = "0" -- look for outgoing URI starting with new_uri
- * 		= "1" -- look for outgoing URI starting with r-uri
- * 		= "2" -- look for outgoing URI only at to header
+ * JSON-escape src into a buffer of the message arena
  */
-
-static int m_store(struct sip_msg* msg, char* owner, char* s2)
+static int m_json_escape_arena(str *src, str *dst)
+{
+	/* worst case is \u00XX for every byte */
+	int size = 6*src->len + 1;
+
+	dst->s = ms_arena_alloc(&msg_arena, size);
+	if(dst->s == NULL)
+		return -1;
+	dst->len = ms_escape_copy(src->s, src->len, dst->s, size, MS_ESC_JSON);
+	return dst->len;
+}
+#endif
+
+/**
+ * store message
+ * mode = "0" -- look for outgoing URI starting with new_uri
+ * 		= "1" -- look for outgoing URI starting with r-uri
+ * 		= "2" -- look for outgoing URI only at to header
+ */
+
+static int m_store(struct sip_msg* msg, char* owner, char* s2)
 {
 	str body, str_hdr, ctaddr;
 	struct to_body *pto, *pfrom;
 	struct sip_uri puri;
 	str duri, owner_s;
-	db_key_t db_keys[NR_KEYS-1];
-	db_val_t db_vals[NR_KEYS-1];
-	db_key_t db_cols[1];
-	db_res_t* res = NULL;
-
-	int nr_keys = 0;
+	t_ms_row row;
+	t_msg_mid mid;
+	int n;
 	long val;
 	long lexpire=0;
 	content_type_t ctype;
-#define MS_BUF1_SIZE	MSG_BODY_BUFF_LEN
 #define MS_MSG_TYPE_SIZE	64
-	static char ms_buf1[MS_BUF1_SIZE];
 	static char ms_msg_type[MS_MSG_TYPE_SIZE];
 	int mime;
 	str notify_from;
@@ -626,9 +1190,13 @@ static int m_store(struct sip_msg* msg, char* owner, char* s2)
 	str notify_contact;
 	str msg_type_value = {NULL, 0};
 	long msg_time = 0;
+	long long snd_time;
 
 	int_str        avp_value;
 	struct usr_avp *avp;
+	ms_hdrs_t hdrs;
+	str expires_s;
+	unsigned int expires_val;
 
 	LM_DBG("------------ start ------------\n");
 
@@ -639,14 +1207,21 @@ static int m_store(struct sip_msg* msg, char* owner, char* s2)
 		goto error;
 	}
 
+	/* pick all headers used below in one walk */
+	if (ms_scan_headers(msg, &hdrs) != 0)
+	{
+		LM_ERR("cannot scan headers\n");
+		goto error;
+	}
+
 	/* get TO URI */
-	if(!msg->to || !msg->to->body.s)
+	if(!hdrs.to || !hdrs.to->body.s)
 	{
 	    LM_ERR("cannot find 'to' header!\n");
 	    goto error;
 	}
 
-	pto = get_to(msg);
+	pto = (struct to_body*)hdrs.to->parsed;
 	if (pto == NULL || pto->error != PARSE_OK) {
 		LM_ERR("failed to parse TO header\n");
 		goto error;
@@ -693,64 +1268,34 @@ static int m_store(struct sip_msg* msg, char* owner, char* s2)
 		goto error;
 	}
 
-	db_keys[nr_keys] = &sc_uri_user;
-
-	db_vals[nr_keys].type = DB_STR;
-	db_vals[nr_keys].nul = 0;
-	db_vals[nr_keys].val.str_val.s = puri.user.s;
-	db_vals[nr_keys].val.str_val.len = puri.user.len;
-
-	nr_keys++;
-
-	db_keys[nr_keys] = &sc_uri_host;
-
-	db_vals[nr_keys].type = DB_STR;
-	db_vals[nr_keys].nul = 0;
-	db_vals[nr_keys].val.str_val.s = puri.host.s;
-	db_vals[nr_keys].val.str_val.len = puri.host.len;
-
-	nr_keys++;
-
-	if (msilo_dbf.use_table(db_con, &ms_db_table) < 0)
-	{
-		LM_ERR("failed to use_table\n");
-		goto error;
-	}
+	memset(&row, 0, sizeof(t_ms_row));
+	row.user = puri.user;
+	row.host = puri.host;
 
 	if (ms_max_messages > 0) {
-	    db_cols[0] = &sc_inc_time;
-	    if (msilo_dbf.query(db_con, db_keys, 0, db_vals, db_cols,
-				2, 1, 0, &res) < 0 ) {
-			LM_ERR("failed to query the database\n");
+		n = mss->count(&row.user, &row.host);
+		if (n < 0) {
+			LM_ERR("failed to count stored messages\n");
 			return -1;
-	    }
-	    if (RES_ROW_N(res) >= ms_max_messages) {
+		}
+		if (n >= ms_max_messages) {
 			LM_ERR("too many messages for AoR '%.*s@%.*s'\n",
 			    puri.user.len, puri.user.s, puri.host.len, puri.host.s);
- 	        msilo_dbf.free_result(db_con, res);
-		return -1;
-	    }
-	    msilo_dbf.free_result(db_con, res);
+			return -1;
+		}
 	}
 
 	/* Set To key */
-	db_keys[nr_keys] = &sc_to;
-
-	db_vals[nr_keys].type = DB_STR;
-	db_vals[nr_keys].nul = 0;
-	db_vals[nr_keys].val.str_val.s = pto->uri.s;
-	db_vals[nr_keys].val.str_val.len = pto->uri.len;
-
-	nr_keys++;
+	row.to = pto->uri;
 
 	/* check FROM URI */
-	if(!msg->from || !msg->from->body.s)
+	if(!hdrs.from || !hdrs.from->body.s)
 	{
 		LM_ERR("cannot find 'from' header!\n");
 		goto error;
 	}
 
-	if(msg->from->parsed == NULL)
+	if(hdrs.from->parsed == NULL)
 	{
 		LM_DBG("'From' header not parsed\n");
 		/* parsing from header */
@@ -760,28 +1305,13 @@ static int m_store(struct sip_msg* msg, char* owner, char* s2)
 			goto error;
 		}
 	}
-	pfrom = (struct to_body*)msg->from->parsed;
+	pfrom = (struct to_body*)hdrs.from->parsed;
 	LM_DBG("'From' header: <%.*s>\n", pfrom->uri.len, pfrom->uri.s);
 
-	db_keys[nr_keys] = &sc_from;
-
-	db_vals[nr_keys].type = DB_STR;
-	db_vals[nr_keys].nul = 0;
-	db_vals[nr_keys].val.str_val.s = pfrom->uri.s;
-	db_vals[nr_keys].val.str_val.len = pfrom->uri.len;
-
-	nr_keys++;
-
-	/* add the message's body in SQL query */
-
-	db_keys[nr_keys] = &sc_body;
+	row.from = pfrom->uri;
 
-	db_vals[nr_keys].type = DB_BLOB;
-	db_vals[nr_keys].nul = 0;
-	db_vals[nr_keys].val.blob_val.s = body.s;
-	db_vals[nr_keys].val.blob_val.len = body.len;
-
-	nr_keys++;
+	/* add the message's body */
+	row.body = body;
 
 	lexpire = ms_expire_time;
 	/* add 'content-type' -- parse the content-type header */
@@ -791,58 +1321,43 @@ static int m_store(struct sip_msg* msg, char* owner, char* s2)
 		goto error;
 	}
 
-	db_keys[nr_keys]      = &sc_ctype;
-	db_vals[nr_keys].type = DB_STR;
-	db_vals[nr_keys].nul  = 0;
-	db_vals[nr_keys].val.str_val.s   = "text/plain";
-	db_vals[nr_keys].val.str_val.len = 10;
+	row.ctype.s = "text/plain";
+	row.ctype.len = 10;
 
 	/** check the content-type value */
 	if( mime!=(TYPE_TEXT<<16)+SUBTYPE_PLAIN
 		&& mime!=(TYPE_MESSAGE<<16)+SUBTYPE_CPIM )
 	{
-		if(m_extract_content_type(msg->content_type->body.s,
-				msg->content_type->body.len, &ctype, CT_TYPE) != -1)
+		if(m_extract_content_type(hdrs.content_type->body.s,
+				hdrs.content_type->body.len, &ctype, CT_TYPE) != -1)
 		{
 			LM_DBG("'content-type' found\n");
-			db_vals[nr_keys].val.str_val.s   = ctype.type.s;
-			db_vals[nr_keys].val.str_val.len = ctype.type.len;
+			row.ctype = ctype.type;
 		}
 	}
-	nr_keys++;
 
 	/* check 'expires' -- no more parsing - already done by get_body() */
-	if(msg->expires && msg->expires->body.len > 0)
+	if(hdrs.expires && hdrs.expires->body.len > 0)
 	{
 		LM_DBG("'expires' found\n");
-		val = atoi(msg->expires->body.s);
-		if(val > 0)
-			lexpire = (ms_expire_time<=val)?ms_expire_time:val;
+		expires_s = hdrs.expires->body;
+		if(str2int(&expires_s, &expires_val) == 0 && expires_val > 0)
+			lexpire = (ms_expire_time<=(long)expires_val)
+				? ms_expire_time : (long)expires_val;
 	}
 
 	/* current time */
 	val = (long)time(NULL);
 
 	/* add expiration time */
-	db_keys[nr_keys] = &sc_exp_time;
-	db_vals[nr_keys].type = DB_BIGINT;
-	db_vals[nr_keys].nul = 0;
-	db_vals[nr_keys].val.bigint_val = (long long)val+lexpire;
-	nr_keys++;
+	row.exp_time = (time_t)(val+lexpire);
 
 	/* add incoming time */
-	db_keys[nr_keys] = &sc_inc_time;
-	db_vals[nr_keys].type = DB_BIGINT;
-	db_vals[nr_keys].nul = 0;
-	db_vals[nr_keys].val.bigint_val = (long long)val;
+	row.inc_time = (time_t)val;
 	msg_time = val;
-	nr_keys++;
 
 	/* add sending time */
-	db_keys[nr_keys] = &sc_snd_time;
-	db_vals[nr_keys].type = DB_BIGINT;
-	db_vals[nr_keys].nul = 0;
-	db_vals[nr_keys].val.bigint_val = 0ll;
+	row.snd_time = 0;
 	if(ms_snd_time_avp_name >= 0)
 	{
 		avp = NULL;
@@ -850,48 +1365,24 @@ static int m_store(struct sip_msg* msg, char* owner, char* s2)
 				&avp_value, 0);
 		if(avp!=NULL && is_avp_str_val(avp))
 		{
-			if(ms_extract_time(&avp_value.s, &db_vals[nr_keys].val.bigint_val)!=0)
-				db_vals[nr_keys].val.bigint_val = 0;
+			if(ms_extract_time(&avp_value.s, &snd_time)!=0)
+				snd_time = 0;
+			row.snd_time = (time_t)snd_time;
 		}
 	}
-	nr_keys++;
-
-	// MSG-type parsing.
-	if (msg->headers != NULL)
-	{
-		struct hdr_field * p0 = msg->headers;
-		for(; p0 != NULL; p0 = p0->next)
-		{
-			if (p0->type != HDR_OTHER_T && p0->type != HDR_EOH_T)
-			{
-				continue;
-			}
 
-			if (p0->name.len < msg_hdr_type.len && strncmp(p0->name.s, msg_hdr_type.s, (size_t)msg_hdr_type.len) != 0)
-			{
-				continue;
-			}
-			
-			int len_to_copy = MS_MSG_TYPE_SIZE <= p0->body.len ? MS_MSG_TYPE_SIZE-1 : p0->body.len;
-			strncpy(ms_msg_type, p0->body.s, len_to_copy);
-			msg_type_value.s = ms_msg_type;
-			msg_type_value.len = len_to_copy;
-			break;
-		}
-	}
-	else
+	// MSG-type, found by the header scan.
+	if (hdrs.other[MS_HDR_MSG_TYPE] != NULL)
 	{
-		LM_INFO("Headers not parser for message\n");
+		struct hdr_field * p0 = hdrs.other[MS_HDR_MSG_TYPE];
+		int len_to_copy = MS_MSG_TYPE_SIZE <= p0->body.len ? MS_MSG_TYPE_SIZE-1 : p0->body.len;
+		memcpy(ms_msg_type, p0->body.s, len_to_copy);
+		msg_type_value.s = ms_msg_type;
+		msg_type_value.len = len_to_copy;
 	}
+	row.msg_type = msg_type_value;
 
-	db_keys[nr_keys] = &sc_msg_type;
-	db_vals[nr_keys].type = DB_STR;
-	db_vals[nr_keys].nul = msg_type_value.len <= 0;
-	db_vals[nr_keys].val.str_val.s   = msg_type_value.s;
-	db_vals[nr_keys].val.str_val.len = msg_type_value.len;
-	nr_keys++;
-
-	if(msilo_dbf.insert(db_con, db_keys, db_vals, nr_keys) < 0)
+	if(mss->insert(&row, &mid) < 0)
 	{
 		LM_ERR("failed to store message\n");
 		goto error;
@@ -899,6 +1390,11 @@ static int m_store(struct sip_msg* msg, char* owner, char* s2)
 	LM_INFO("message stored. T:<%.*s> F:<%.*s>\n",
 		pto->uri.len, pto->uri.s, pfrom->uri.len, pfrom->uri.s);
 
+	/* reminders are not dumped on REGISTER, keep them out of the cache */
+	if(mc!=NULL && row.snd_time==0)
+		ms_cache_add(mc, &row.user, &row.host, mid, &row.from, &row.to,
+			&row.body, &row.ctype, &row.msg_type, row.inc_time, row.exp_time);
+
 #ifdef MS_AMQP
     // Send AMQP event
 	if (ms_amqp_enabled && msilo_amqp_started(&ms_amqp))
@@ -906,19 +1402,31 @@ static int m_store(struct sip_msg* msg, char* owner, char* s2)
 		char amqp_buff[AMQP_BUFF];
 		amqp_buff[AMQP_BUFF-1] = 0;
 		size_t amqp_size = 0;
+		str amqp_from, amqp_to, amqp_type;
+
+		// URIs and the message type may carry quotes or control bytes,
+		// escape them so the event stays valid JSON
+		if (m_json_escape_arena(&pfrom->uri, &amqp_from) < 0
+				|| m_json_escape_arena(&pto->uri, &amqp_to) < 0
+				|| m_json_escape_arena(&msg_type_value, &amqp_type) < 0)
+		{
+			LM_ERR("cannot escape AMQP event fields\n");
+			goto amqp_done;
+		}
 		snprintf(amqp_buff, AMQP_BUFF,
 				 "{\"job\":\"offlineMessage\", \"data\":{\"from\":\"%.*s\",\"to\":\"%.*s\","
 						 "\"timestampSeconds\":%ld,\"msgType\":\"%.*s\"}}",
-				 pfrom->uri.len, pfrom->uri.s,
-				 pto->uri.len, pto->uri.s,
+				 amqp_from.len, amqp_from.s,
+				 amqp_to.len, amqp_to.s,
 				 msg_time,
-				 msg_type_value.len, msg_type_value.s
+				 amqp_type.len, amqp_type.s
 		);
 		amqp_size = strlen(amqp_buff);
 
 		LM_INFO("Sending AMQP message: %s to queue %s\n", amqp_buff, ms_amqp_queue);
 		msilo_amqp_send(&ms_amqp, ms_amqp_queue, amqp_buff, amqp_size);
 	}
+amqp_done:
 
 #endif
 
@@ -952,14 +1460,14 @@ static int m_store(struct sip_msg* msg, char* owner, char* s2)
 	if(ms_contact!=NULL && fixup_get_svalue(msg, (gparam_p)*ms_contact_sp,
 				&notify_contact)==0 && notify_contact.len>0)
 	{
-		if(notify_contact.len+notify_ctype.len>=MS_BUF1_SIZE)
+		str_hdr.s = ms_arena_alloc(&msg_arena, notify_contact.len+notify_ctype.len);
+		if(str_hdr.s==NULL)
 		{
 			LM_WARN("insufficient buffer to build notification headers\n");
 			goto done;
 		}
-		memcpy(ms_buf1, notify_contact.s, notify_contact.len);
-		memcpy(ms_buf1+notify_contact.len, notify_ctype.s, notify_ctype.len);
-		str_hdr.s = ms_buf1;
+		memcpy(str_hdr.s, notify_contact.s, notify_contact.len);
+		memcpy(str_hdr.s+notify_contact.len, notify_ctype.s, notify_ctype.len);
 		str_hdr.len = notify_contact.len + notify_ctype.len;
 	} else {
 		str_hdr = notify_ctype;
@@ -967,21 +1475,21 @@ static int m_store(struct sip_msg* msg, char* owner, char* s2)
 
 	/* look for Contact header -- must be parsed by now*/
 	ctaddr.s = NULL;
-	if(ms_use_contact && msg->contact!=NULL && msg->contact->body.s!=NULL
-			&& msg->contact->body.len > 0)
+	if(ms_use_contact && hdrs.contact!=NULL && hdrs.contact->body.s!=NULL
+			&& hdrs.contact->body.len > 0)
 	{
 		LM_DBG("contact header found\n");
-		if((msg->contact->parsed!=NULL
-			&& ((contact_body_t*)(msg->contact->parsed))->contacts!=NULL)
-			|| (parse_contact(msg->contact)==0
-			&& msg->contact->parsed!=NULL
-			&& ((contact_body_t*)(msg->contact->parsed))->contacts!=NULL))
+		if((hdrs.contact->parsed!=NULL
+			&& ((contact_body_t*)(hdrs.contact->parsed))->contacts!=NULL)
+			|| (parse_contact(hdrs.contact)==0
+			&& hdrs.contact->parsed!=NULL
+			&& ((contact_body_t*)(hdrs.contact->parsed))->contacts!=NULL))
 		{
 			LM_DBG("using contact header for info msg\n");
 			ctaddr.s =
-			((contact_body_t*)(msg->contact->parsed))->contacts->uri.s;
+			((contact_body_t*)(hdrs.contact->parsed))->contacts->uri.s;
 			ctaddr.len =
-			((contact_body_t*)(msg->contact->parsed))->contacts->uri.len;
+			((contact_body_t*)(hdrs.contact->parsed))->contacts->uri.len;
 
 			if(!ctaddr.s || ctaddr.len < 6 || strncasecmp(ctaddr.s, "sip:", 4)
 				|| ctaddr.s[4]==' ')
@@ -1004,43 +1512,339 @@ static int m_store(struct sip_msg* msg, char* owner, char* s2)
 		);
 
 done:
+	ms_arena_reset(&msg_arena);
 	return 1;
 error:
 	return -1;
 }
 
+/**
+ * the message expires before it could be sent at not_before, 0 - now
+ */
+static int m_expiring(time_t exp_time, time_t not_before)
+{
+	time_t now = time(NULL);
+
+	if(exp_time == 0)
+		return 0;
+	if(not_before > now)
+		now = not_before;
+	return exp_time <= now + ms_expiry_margin;
+}
+
+/**
+ * queue one stored message of the AoR being dumped
+ */
+static int m_dump_mid(ms_row row, void *param)
+{
+	t_ms_dump_ctx *ctx = (t_ms_dump_ctx*)param;
+	t_msg_mid mid = row->mid;
+	int cur_flags = 0;
+	int cur_retry = 0;
+
+	/* the rest waits for the next dump */
+	if(ms_dump_limit > 0 && ctx->n >= ms_dump_limit)
+	{
+		ctx->capped = 1;
+		return -1;
+	}
+	/* the rest waits for the next page */
+	if(ctx->limit > 0 && ctx->n >= ctx->limit)
+		return -1;
+
+	/* the first ids are kept to tell the cache what the storage holds */
+	if(ctx->n < MS_CACHE_DUMP_MAX)
+		ctx->mids[ctx->n] = mid;
+	ctx->n++;
+	if(mid > ctx->last)
+		ctx->last = mid;
+
+	/* expires before it could be sent, the cleaner takes it */
+	if(m_expiring(row->exp_time, ctx->not_before))
+	{
+		LM_DBG("message[%d] mid=%lld expires at %ld, not queued\n",
+				ctx->n-1, (long long)mid, (long)row->exp_time);
+#ifdef STATISTICS
+		update_stat(ms_expired_msgs, 1);
+#endif
+		return 0;
+	}
+
+	if(msg_list_check_msg(ml, mid, &cur_retry, &cur_flags))
+	{
+		LM_INFO("message[%d] mid=%lld already sent. Flags: %d, retry: %d\n",
+				ctx->n-1, (long long)mid, cur_flags, cur_retry);
+		return 0;
+	}
+
+	// Add to the retry queue, signal to the executor.
+	ctx->key.prio = m_prio(&row->msg_type);
+	ctx->key.exp_time = row->exp_time;
+	if(retry_add_element(rl, mid, 0, ctx->not_before, &ctx->key) == 0)
+		ctx->page_n++;
+	return 0;
+}
+
+/**
+ * queue the messages of the AoR with id above after, at most ctx->limit
+ */
+static int m_dump_page(str *user, str *host, t_msg_mid after, t_ms_dump_ctx *ctx)
+{
+	t_ms_row cached[MS_CACHE_DUMP_MAX];
+	unsigned int gen;
+	int i, n;
+
+	m_flow(user, host, &ctx->key.flow, &ctx->key.cls);
+
+	/* the cache knows all pending messages of recently seen AoRs */
+	if(mc!=NULL && ms_cache_dump(mc, user, host, cached,
+				MS_CACHE_DUMP_MAX, &n, &msg_arena)==MS_CACHE_OK)
+	{
+#ifdef STATISTICS
+		update_stat(ms_cache_dump_hits, 1);
+#endif
+		for(i = 0; i < n; i++)
+			if(cached[i].mid > after && m_dump_mid(&cached[i], ctx) < 0)
+				break;
+		return 0;
+	}
+
+#ifdef STATISTICS
+	if(mc!=NULL)
+		update_stat(ms_cache_dump_misses, 1);
+#endif
+	/* a message stored meanwhile may miss both the dump and the cache */
+	gen = ms_cache_gen(mc, user, host);
+	if(mss->dump(user, host, after, ctx->limit, m_dump_mid, ctx) < 0)
+		return -1;
+
+	/* a partial listing says nothing about the rest of the AoR */
+	if(mc!=NULL && after==0 && !ctx->capped
+			&& (ctx->limit<=0 || ctx->n<ctx->limit) && ctx->n<=MS_CACHE_DUMP_MAX)
+		ms_cache_set_complete(mc, user, host, ctx->mids, ctx->n, gen);
+
+	return 0;
+}
+
+/**
+ * queue the next page of every AoR whose previous page was delivered
+ * - run by the sender
+ */
+static void m_page_refill(void)
+{
+	t_ms_aor_due due[MS_PAGE_DUE_MAX];
+	t_ms_dump_ctx ctx;
+	time_t now;
+	int i, n, last;
+
+	if(ma==NULL || ms_page_size <= 0)
+		return;
+
+	now = time(NULL);
+	n = ms_aor_page_due(ma, now, ms_page_timeout, due, MS_PAGE_DUE_MAX,
+			&msg_arena);
+	for(i = 0; i < n; i++)
+	{
+		memset(&ctx, 0, sizeof(ctx));
+		ctx.limit = ms_page_size;
+		ctx.key.batch = due[i].batch;
+		ctx.key.page = due[i].aor;
+		last = m_dump_page(&due[i].user, &due[i].host, due[i].watermark, &ctx) < 0
+			|| ctx.capped || ctx.n < ms_page_size;
+		ms_aor_page_set(ma, due[i].aor, ctx.last, ctx.page_n, last, now);
+		LM_DBG("page of [%d] messages for <%.*s@%.*s> after %lld%s\n",
+				ctx.n, due[i].user.len, due[i].user.s, due[i].host.len,
+				due[i].host.s, (long long)due[i].watermark, last?", last":"");
+	}
+
+	ms_arena_reset(&msg_arena);
+}
+
+#define m_is_lws(_c) ((_c)==' ' || (_c)=='\t' || (_c)=='\r' || (_c)=='\n')
+
+/**
+ * 1 if an entry of the ',' separated list in body has a ';' separated
+ * token named mark (the part before '='), ignoring case, and no q=0
+ */
+static int m_list_has(str *body, str *mark)
+{
+	char *p = body->s, *end = body->s + body->len;
+	char *t, *te, *v;
+	int found = 0, refused = 0;
+
+	for(; p <= end; p++)
+	{
+		for(t = p; p < end && *p!=';' && *p!=','; p++);
+		for(te = p; t < te && m_is_lws(*t); t++);
+		for(v = t; v < te && *v!='='; v++);
+		while(v > t && m_is_lws(v[-1]))
+			v--;
+
+		if(v - t==mark->len && strncasecmp(t, mark->s, mark->len)==0)
+			found = 1;
+		else if(v - t==1 && (*t=='q' || *t=='Q'))
+		{
+			/* q=0, q=0.0 ... refuses the entry */
+			for(v++; v < te && (*v=='=' || *v=='0' || *v=='.'
+						|| m_is_lws(*v)); v++);
+			if(v==te)
+				refused = 1;
+		}
+
+		if(p==end || *p==',')
+		{
+			if(found && !refused)
+				return 1;
+			found = refused = 0;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * messages per MESSAGE the registering UA takes, batch_max if an entry of
+ * an Accept header is batch_accept or a Contact carries it as feature tag
+ */
+static int m_batch_size(struct sip_msg* msg)
+{
+	struct hdr_field *hf;
+
+	if(ms_batch_accept.s==NULL || ms_batch_max <= 1)
+		return 1;
+
+	/* all headers are parsed by check_message_support() */
+	for(hf = msg->headers; hf; hf = hf->next)
+	{
+		if(hf->type!=HDR_ACCEPT_T && hf->type!=HDR_CONTACT_T)
+			continue;
+		if(m_list_has(&hf->body, &ms_batch_accept))
+			return ms_batch_max;
+	}
+
+	return 1;
+}
+
+/**
+ * uri of the address the request came from, as nathelper builds received
+ */
+static int m_source_uri(struct sip_msg* msg, str* uri)
+{
+	char *ip, *t;
+
+	switch(msg->rcv.proto)
+	{
+		case PROTO_TCP:
+			t = ";transport=tcp";
+			break;
+		case PROTO_TLS:
+			t = ";transport=tls";
+			break;
+		case PROTO_SCTP:
+			t = ";transport=sctp";
+			break;
+		default:
+			t = "";
+	}
+
+	uri->s = ms_arena_alloc(&msg_arena, MS_SOURCE_URI_MAX);
+	if(uri->s==NULL)
+		return -1;
+	ip = ip_addr2a(&msg->rcv.src_ip);
+	uri->len = snprintf(uri->s, MS_SOURCE_URI_MAX,
+			msg->rcv.src_ip.af==AF_INET6 ? "sip:[%s]:%u%s" : "sip:%s:%u%s",
+			ip, (unsigned int)msg->rcv.src_port, t);
+	if(uri->len < 0 || uri->len >= MS_SOURCE_URI_MAX)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * keep the contact the REGISTER came from with its received and Path,
+ * the sender delivers the dumped messages straight to it
+ */
+static void m_keep_contact(struct sip_msg* msg, contact_t* c, str* user,
+		str* host, time_t now)
+{
+	struct hdr_field *hf;
+	str received = {NULL, 0};
+	str path = {NULL, 0};
+	str expires = {NULL, 0};
+	unsigned int exp = MS_CONTACT_EXPIRES;
+	char *p;
+
+	if(c->expires!=NULL && c->expires->body.len > 0)
+		expires = c->expires->body;
+	else if(msg->expires!=NULL && msg->expires->body.len > 0)
+		expires = msg->expires->body;
+	if(expires.len > 0 && str2int(&expires, &exp) < 0)
+		exp = MS_CONTACT_EXPIRES;
+
+	if(c->received!=NULL && c->received->body.len > 0)
+	{
+		received = c->received->body;
+		if(received.len >= 2 && received.s[0]=='"'
+				&& received.s[received.len-1]=='"')
+		{
+			received.s++;
+			received.len -= 2;
+		}
+	}
+	/* few UAs send received, a NATed contact is reached where the
+	 * REGISTER came from */
+	else if(m_source_uri(msg, &received) < 0)
+	{
+		LM_ERR("no memory for the source of <%.*s@%.*s>\n", user->len, user->s,
+				host->len, host->s);
+		return;
+	}
+
+	/* all Path headers as one list, headers are parsed by now */
+	for(hf = msg->headers; hf; hf = hf->next)
+		if(hf->type==HDR_PATH_T)
+			path.len += hf->body.len + 1;
+	if(path.len > 0)
+	{
+		path.s = ms_arena_alloc(&msg_arena, path.len);
+		if(path.s==NULL)
+		{
+			LM_ERR("no memory for the Path of <%.*s@%.*s>\n", user->len, user->s,
+					host->len, host->s);
+			return;
+		}
+		for(p = path.s, hf = msg->headers; hf; hf = hf->next)
+		{
+			if(hf->type!=HDR_PATH_T)
+				continue;
+			if(p > path.s)
+				*p++ = ',';
+			memcpy(p, hf->body.s, hf->body.len);
+			p += hf->body.len;
+		}
+		path.len = p - path.s;
+	}
+
+	if(exp > 0)
+		ms_aor_set_contact(ma, user, host, &c->uri, &received, &path,
+				now + exp);
+}
+
 /**
  * dump message
  */
 static int m_dump(struct sip_msg* msg, char* owner, char* str2)
 {
 	struct to_body *pto = NULL;
-	db_key_t db_keys[3];
-	db_key_t ob_key;
-	db_op_t  db_ops[3];
-	db_val_t db_vals[3];
-	db_key_t db_cols[1];
-	db_res_t* db_res = NULL;
-	int i, db_no_cols = 1, db_no_keys = 3;
-	t_msg_mid mid = 0;
+	contact_t *ct;
+	int i;
 	struct sip_uri puri;
 	str owner_s;
+	t_ms_dump_ctx ctx;
+	int rc;
 
 	time_t dumpId;
 
-	/* init */
-	ob_key = &sc_mid;
-
-	db_keys[0]=&sc_uri_user;
-	db_keys[1]=&sc_uri_host;
-	db_keys[2]=&sc_snd_time;
-	db_ops[0]=OP_EQ;
-	db_ops[1]=OP_EQ;
-	db_ops[2]=OP_EQ;
-
-	// Select only message identifiers.
-	db_cols[0]=&sc_mid;
-
 	/* check for TO header */
 	if(msg->to==NULL && (parse_headers(msg, HDR_TO_F, 0)==-1
 				|| msg->to==NULL || msg->to->body.s==NULL))
@@ -1081,7 +1885,7 @@ static int m_dump(struct sip_msg* msg, char* owner, char* str2)
 		goto error;
 	}
 
-	if (check_message_support(msg)!=0) {
+	if (check_message_support(msg, &ct)!=0) {
 	    LM_DBG("MESSAGE method not supported\n");
 	    return -1;
 	}
@@ -1117,62 +1921,57 @@ static int m_dump(struct sip_msg* msg, char* owner, char* str2)
 	}
 
 	time(&dumpId);
-
-	db_vals[0].type = DB_STR;
-	db_vals[0].nul = 0;
-	db_vals[0].val.str_val.s = puri.user.s;
-	db_vals[0].val.str_val.len = puri.user.len;
-
-	db_vals[1].type = DB_STR;
-	db_vals[1].nul = 0;
-	db_vals[1].val.str_val.s = puri.host.s;
-	db_vals[1].val.str_val.len = puri.host.len;
-
-	db_vals[2].type = DB_INT;
-	db_vals[2].nul = 0;
-	db_vals[2].val.int_val = 0;
-
-	if (msilo_dbf.use_table(db_con, &ms_db_table) < 0)
-	{
-		LM_ERR("failed to use_table\n");
-		goto error;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.not_before = dumpId + ms_delay_sec;
+	ctx.key.batch = m_batch_size(msg);
+
+	/* registered again, deliveries resume */
+	if(ma!=NULL)
+		ms_aor_reachable(ma, &puri.user, &puri.host);
+	if(ma!=NULL && ms_direct_delivery && ct!=NULL)
+		m_keep_contact(msg, ct, &puri.user, &puri.host, dumpId);
+
+	/* paginated: the first page now, the sender queues the rest */
+	if(ma!=NULL && ms_page_size > 0)
+	{
+		rc = ms_aor_page_begin(ma, &puri.user, &puri.host, ctx.key.batch,
+				dumpId, &ctx.key.page);
+		if(rc == MS_AOR_EXIST)
+		{
+			LM_DBG("dump of <%.*s> already running\n", pto->uri.len, pto->uri.s);
+			goto done;
+		}
+		if(rc == MS_AOR_OK)
+			ctx.limit = ms_page_size;
 	}
 
-	if((msilo_dbf.query(db_con,db_keys,db_ops,db_vals,db_cols,db_no_keys,
-				db_no_cols, ob_key, &db_res)!=0) || (RES_ROW_N(db_res) <= 0))
+	rc = m_dump_page(&puri.user, &puri.host, 0, &ctx);
+	if(ctx.limit > 0)
+		ms_aor_page_set(ma, ctx.key.page, ctx.last, ctx.page_n,
+				rc < 0 || ctx.capped || ctx.n < ctx.limit, dumpId);
+	if(rc < 0)
+		goto done;
+
+	if(ctx.n <= 0)
 	{
 		LM_DBG("no stored message for <%.*s>!\n", pto->uri.len,	pto->uri.s);
+		/* nothing to deliver to the contact */
+		if(ma!=NULL && ms_direct_delivery)
+			ms_aor_set_contact(ma, &puri.user, &puri.host, NULL, NULL, NULL, 0);
 		goto done;
 	}
 
-	LM_INFO("dumping [%d] messages for <%.*s>, dumpId: %ld, delay: %d!!!\n",
-			RES_ROW_N(db_res), pto->uri.len, pto->uri.s, (long) dumpId, ms_delay_sec);
-
-	for(i = 0; i < RES_ROW_N(db_res); i++)
-	{
-		int cur_flags = 0;
-		int cur_retry = 0;
-		mid =  RES_ROWS(db_res)[i].values[0].val.bigint_val;
-		if(msg_list_check_msg(ml, mid, &cur_retry, &cur_flags))
-		{
-			LM_INFO("message[%d] mid=%lld already sent. Flags: %d, retry: %d\n", i, (long long)mid, cur_flags, cur_retry);
-			continue;
-		}
-
-		// Add to the retry queue, signal to the executor.
-		retry_add_element(rl, mid, 0, dumpId + ms_delay_sec);
-	}
+	LM_INFO("dumping [%d] messages for <%.*s>, dumpId: %ld, delay: %d%s!!!\n",
+			ctx.n, pto->uri.len, pto->uri.s, (long) dumpId, ms_delay_sec,
+			(ctx.limit > 0 && ctx.n >= ctx.limit) ? ", first page" : "");
+	if(ctx.capped)
+		LM_INFO("dump_limit reached for <%.*s>, the rest waits for the next dump\n",
+				pto->uri.len, pto->uri.s);
 
 	signal_new_task();
 
 done:
-	/**
-	 * Free the result because we don't need it
-	 * anymore
-	 */
-	if (db_res!=NULL && msilo_dbf.free_result(db_con, db_res) < 0)
-		LM_ERR("failed to free result of query\n");
-
+	ms_arena_reset(&msg_arena);
 	return 1;
 error:
 	return -1;
@@ -1185,18 +1984,14 @@ error:
 void m_clean_silo(unsigned int ticks, void *param)
 {
 	msg_list_el mle = NULL, p;
-	db_key_t db_keys[MAX_DEL_KEYS];
-	db_val_t db_vals[MAX_DEL_KEYS];
-	db_op_t  db_ops[1] = { OP_LEQ };
-	int n;
 	long deletedTotal = 0;
+	time_t now;
 	long iters = 0;
 
 	LM_DBG("cleaning stored messages - %d\n", ticks);
 
 	msg_list_check(ml); // Separates message with flag (DONE | ERROR) in sent_list to the done_list.
 	mle = p = msg_list_reset(ml); // Extracts done_list and returns it here.
-	n = 0;
 	while(p)
 	{
 		if(p->flag & MS_MSG_DONE)
@@ -1209,19 +2004,12 @@ void m_clean_silo(unsigned int ticks, void *param)
 				update_stat(ms_dumped_rmds, 1);
 #endif
 
-			db_keys[n] = &sc_mid;
-			db_vals[n].type = DB_BIGINT;
-			db_vals[n].nul = 0;
-			db_vals[n].val.bigint_val = p->msgid;
 			LM_DBG("cleaning sent message [%lld]\n", (long long)p->msgid);
-			n++;
-			if(n==MAX_DEL_KEYS)
-			{
-				if (msilo_dbf.delete(db_con, db_keys, NULL, db_vals, n) < 0)
-					LM_ERR("failed to clean %d messages.\n",n);
-				else
-					deletedTotal += n;
-				n = 0;
+			if (mss->remove(p->msgid) < 0)
+				LM_ERR("failed to clean message [%lld]\n", (long long)p->msgid);
+			else {
+				deletedTotal += 1;
+				ms_cache_del(mc, p->msgid);
 			}
 		}
 		if((p->flag & MS_MSG_ERRO) && (p->flag & MS_MSG_TSND))
@@ -1238,14 +2026,6 @@ void m_clean_silo(unsigned int ticks, void *param)
 #endif
 		p = p->next;
 	}
-	if(n>0)
-	{
-		if (msilo_dbf.delete(db_con, db_keys, NULL, db_vals, n) < 0)
-			LM_ERR("failed to clean %d messages\n", n);
-		else
-			deletedTotal += n;
-		n = 0;
-	}
 
 	msg_list_el_free_all(mle);
 	if (deletedTotal > 0 || iters > 0){
@@ -1256,229 +2036,267 @@ void m_clean_silo(unsigned int ticks, void *param)
 	if(ticks%(ms_check_time*ms_clean_period)<ms_check_time)
 	{
 		LM_DBG("cleaning expired messages\n");
-		db_keys[0] = &sc_exp_time;
-		db_vals[0].type = DB_BIGINT;
-		db_vals[0].nul = 0;
-		db_vals[0].val.bigint_val = (long long)time(NULL);
-		if (msilo_dbf.delete(db_con, db_keys, db_ops, db_vals, 1) < 0)
+		now = time(NULL);
+		if (mss->expire(now) < 0)
 			LM_DBG("ERROR cleaning expired messages\n");
+		else
+			ms_cache_expire(mc, now);
 	}
+
+	/* AoR entries kept only by a refilling rate bucket */
+	ms_aor_sweep(ma);
+
+#ifdef STATISTICS
+	m_update_queue_stats();
+	m_update_prio_stats();
+	m_update_pause_stats();
+#endif
+
+	if (mss->maintain)
+		mss->maintain();
 }
 
 /**
- * destroy function
+ * queue the messages saved by m_queue_save() at the last shutdown
  */
-void destroy(void)
+static void m_queue_restore(void)
 {
-	LM_DBG("msilo destroy module ...\n");
-	destroy_sender_worker_env();
+	retry_list_el list, p0, next;
+	size_t n;
+	int queued = 0;
 
-#ifdef MS_AMQP
-	if (ms_amqp_enabled)
+	if(ms_queue_snapshot == NULL)
+		return;
+
+	list = retry_list_load(ms_queue_snapshot, &n);
+	for(p0 = list; p0; p0 = next)
 	{
-		msilo_amqp_deinit(&ms_amqp);
+		next = p0->prev;
+		p0->prev = NULL;
+		p0->next = NULL;
+
+		// Expired meanwhile or queued already, the storage keeps it anyway.
+		if(m_expiring(p0->key.exp_time, p0->not_before)
+				|| msg_list_check_msg(ml, p0->msgid, NULL, NULL)
+				|| retry_push_element(rl, p0) != MSG_LIST_OK)
+		{
+			retry_list_el_free(p0);
+			continue;
+		}
+		queued++;
 	}
-#endif
 
-	msg_list_free(ml);
-	retry_list_free(rl);
+	// Loaded once, a later crash must not bring back what was delivered since.
+	if(unlink(ms_queue_snapshot) != 0 && errno != ENOENT)
+		LM_WARN("cannot remove %s: %s\n", ms_queue_snapshot, strerror(errno));
 
-	if(db_con && msilo_dbf.close)
-		msilo_dbf.close(db_con);
+	if(n > 0)
+		LM_INFO("%d of %lu queued messages restored from %s\n", queued,
+				(unsigned long)n, ms_queue_snapshot);
 }
 
-void m_send_ontimer(unsigned int ticks, void *param)
+/**
+ * save what is still queued, the messages held by the windows included,
+ * for the next start
+ */
+static void m_queue_save(void)
 {
-	db_key_t db_keys[2];
-	db_op_t  db_ops[2];
-	db_val_t db_vals[2];
-	db_key_t db_cols[6];
-	db_res_t* db_res = NULL;
-	int i, db_no_cols = 6, db_no_keys = 2;
-	t_msg_mid mid, n;
-	static char hdr_buf[MSG_HDR_BUFF_LEN];
-	static char uri_buf[1024];
-	static char body_buf[MSG_BODY_BUFF_LEN];
-	str puri;
-	time_t ttime;
-
-	str str_vals[4], hdr_str , body_str;
-	time_t stime;
-	time_t dumpId;
+	retry_list_el list;
+	int n;
 
-	if(ms_reminder.s==NULL)
-	{
-		LM_WARN("reminder address null\n");
+	if(ms_queue_snapshot == NULL || rl == NULL)
 		return;
-	}
 
-	/* init */
-	db_keys[0]=&sc_snd_time;
-	db_keys[1]=&sc_snd_time;
-	db_ops[0]=OP_NEQ;
-	db_ops[1]=OP_LEQ;
-
-	db_cols[0]=&sc_mid;
-	db_cols[1]=&sc_uri_user;
-	db_cols[2]=&sc_uri_host;
-	db_cols[3]=&sc_body;
-	db_cols[4]=&sc_ctype;
-	db_cols[5]=&sc_snd_time;
+	if(ma != NULL)
+		requeue_list_prev(ms_aor_held_reset(ma));
 
+	list = retry_list_reset(rl);
+	n = retry_list_save(list, ms_queue_snapshot);
+	if(n >= 0)
+		LM_INFO("%d queued messages saved to %s\n", n, ms_queue_snapshot);
+	retry_list_el_free_prev_all(list);
+}
 
-	LM_DBG("------------ start ------------\n");
-	hdr_str.s=hdr_buf;
-	hdr_str.len=MSG_HDR_BUFF_LEN;
-	body_str.s=body_buf;
-	body_str.len=MSG_BODY_BUFF_LEN;
+/**
+ * destroy function
+ */
+void destroy(void)
+{
+	int alive;
 
-	db_vals[0].type = DB_INT;
-	db_vals[0].nul = 0;
-	db_vals[0].val.int_val = 0;
+	LM_DBG("msilo destroy module ...\n");
+	alive = destroy_sender_worker_env();
 
-	db_vals[1].type = DB_BIGINT;
-	db_vals[1].nul = 0;
-	ttime = time(NULL);
-	db_vals[1].val.bigint_val = (long long)ttime;
-
-	if (msilo_dbf.use_table(db_con, &ms_db_table) < 0)
+#ifdef MS_AMQP
+	if (ms_amqp_enabled)
 	{
-		LM_ERR("failed to use_table\n");
-		return;
+		msilo_amqp_deinit(&ms_amqp);
 	}
+#endif
 
-	if((msilo_dbf.query(db_con,db_keys,db_ops,db_vals,db_cols,db_no_keys,
-				db_no_cols, NULL,&db_res)!=0) || (RES_ROW_N(db_res) <= 0))
+	// The sender may still be walking the queues, they are left alone.
+	if (alive > 0)
 	{
-		LM_DBG("no message for <%.*s>!\n", 24, ctime((const time_t*)&ttime));
-		goto done;
+		LM_WARN("sender still running, queue snapshot skipped\n");
 	}
+	else
+	{
+		m_queue_save();
 
-	time(&dumpId);
-	LM_DBG("dumping [%d] messages for <%.*s>!!!\n", RES_ROW_N(db_res), 24,
-			ctime((const time_t*)&ttime));
+		msg_list_free(ml);
+		retry_list_free(rl);
+		ms_cache_free(mc);
+		ms_aor_free(ma);
+		ms_inflight_free(mi);
+	}
 
-	for(i = 0; i < RES_ROW_N(db_res); i++)
+	if(mss)
+		mss->destroy();
+}
+
+/**
+ * send one due reminder
+ */
+static int m_send_reminder(ms_row row, void *param)
+{
+	ms_hdr_tpl_t *hdr_tpl = (ms_hdr_tpl_t*)param;
+	t_msg_mid mid = row->mid;
+	str puri, hdr_str, body_str;
+	t_retry_list_el el;
+	t_ms_inflight_slot slot;
+	ms_inflight_h h;
+	int n;
+
+	if(msg_list_check_msg(ml, mid, NULL, NULL))
 	{
-		mid = RES_ROWS(db_res)[i].values[0].val.bigint_val;
-		if(msg_list_check_msg(ml, mid, NULL, NULL))
-		{
-			LM_DBG("message[%d] mid=%lld already sent.\n", i, (long long) mid);
-			continue;
-		}
+		LM_DBG("message mid=%lld already sent.\n", (long long) mid);
+		return 0;
+	}
 
-		memset(str_vals, 0, 4*sizeof(str));
-		SET_STR_VAL(str_vals[0], db_res, i, 1); /* user */
-		SET_STR_VAL(str_vals[1], db_res, i, 2); /* host */
-		SET_STR_VAL(str_vals[2], db_res, i, 3); /* body */
-		SET_STR_VAL(str_vals[3], db_res, i, 4); /* ctype */
+	// One buffer per message: headers, body, then the R-URI.
+	hdr_str.len = m_build_headers_len(hdr_tpl, row->ctype, ms_reminder, 0);
+	body_str.len = m_build_body_len(row->body);
+	puri.len = 4 + row->user.len + 1 + row->host.len;
+	hdr_str.s = ms_arena_alloc(&msg_arena,
+			hdr_str.len + (body_str.len > 0 ? body_str.len : 0) + puri.len);
+	if(hdr_str.s == NULL)
+	{
+		LM_ERR("no memory to build message [%lld]\n", (long long)mid);
+		msg_list_set_flag(ml, mid, MS_MSG_ERRO);
+		return 0;
+	}
+	body_str.s = hdr_str.s + hdr_str.len;
+	puri.s = body_str.s + (body_str.len > 0 ? body_str.len : 0);
 
-		hdr_str.len = MSG_HDR_BUFF_LEN;
-		if(m_build_headers(&hdr_str, str_vals[3] /*ctype*/,
-				ms_reminder/*from*/,0/*Date*/, (long) (dumpId * 1000l)) < 0)
-		{
-			LM_ERR("headers building failed [%lld]\n", (long long)mid);
-			if (msilo_dbf.free_result(db_con, db_res) < 0)
-				LM_DBG("failed to free result of query\n");
-			msg_list_set_flag(ml, mid, MS_MSG_ERRO);
-			return;
-		}
+	if(m_build_headers(&hdr_str, hdr_tpl, row->ctype /*ctype*/,
+			ms_reminder/*from*/,0/*Date*/) < 0)
+	{
+		LM_ERR("headers building failed [%lld]\n", (long long)mid);
+		msg_list_set_flag(ml, mid, MS_MSG_ERRO);
+		return 0;
+	}
 
-		puri.s = uri_buf;
-		puri.len = 4 + str_vals[0].len + 1 + str_vals[1].len;
-		memcpy(puri.s, "sip:", 4);
-		memcpy(puri.s+4, str_vals[0].s, str_vals[0].len);
-		puri.s[4+str_vals[0].len] = '@';
-		memcpy(puri.s+4+str_vals[0].len+1, str_vals[1].s, str_vals[1].len);
+	memcpy(puri.s, "sip:", 4);
+	memcpy(puri.s+4, row->user.s, row->user.len);
+	puri.s[4+row->user.len] = '@';
+	memcpy(puri.s+4+row->user.len+1, row->host.s, row->host.len);
 
-		LM_DBG("msg [%d-%lld] for: %.*s\n", i+1, (long long)mid, puri.len, puri.s);
+	LM_DBG("msg [%lld] for: %.*s\n", (long long)mid, puri.len, puri.s);
 
-		/** sending using TM function: t_uac */
-		body_str.len = MSG_BODY_BUFF_LEN;
-		stime =
-			(time_t)RES_ROWS(db_res)[i].values[5/*snd time*/].val.bigint_val;
-		n = m_build_body(&body_str, 0, str_vals[2/*body*/], stime);
-		if(n<0)
-			LM_DBG("sending simple body\n");
-		else
-			LM_DBG("sending composed body\n");
+	/** sending using TM function: t_uac */
+	n = (body_str.len > 0) ? m_build_body(&body_str, 0, row->body, row->snd_time,
+			m_date_fmt(&row->msg_type)) : -1;
+	if(n<0)
+		LM_DBG("sending simple body\n");
+	else
+		LM_DBG("sending composed body\n");
 
-		msg_list_set_flag(ml, mid, MS_MSG_TSND);
+	msg_list_set_flag(ml, mid, MS_MSG_TSND);
 
-		tmb.t_request(&msg_type,  /* Type of the message */
-					&puri,            /* Request-URI */
-					&puri,            /* To */
-					&ms_reminder,     /* From */
-					&hdr_str,         /* Optional headers including CRLF */
-					(n<0)?&str_vals[2]:&body_str, /* Message body */
-					(ms_outbound_proxy.s)?&ms_outbound_proxy:0,
-							/* outbound uri */
-					m_tm_callback,    /* Callback function */
-					(void*)(t_msg_mid)mid,  /* Callback parameter */
-					NULL
-				);
+	// The reply only settles the flag of the message, no retry state.
+	memset(&el, 0, sizeof(el));
+	el.msgid = mid;
+	if ((h = ms_inflight_put(mi, &el, MS_INFLIGHT_REMINDER, 0)) == 0)
+	{
+		LM_ERR("more than [%d] messages in flight\n", mi->size);
+		msg_list_set_flag(ml, mid, MS_MSG_ERRO);
+		return 0;
 	}
 
-done:
-	/**
-	 * Free the result because we don't need it anymore
-	 */
-	if (db_res!=NULL && msilo_dbf.free_result(db_con, db_res) < 0)
-		LM_DBG("failed to free result of query\n");
-
-	return;
+	if(tmb.t_request(&msg_type,  /* Type of the message */
+				&puri,            /* Request-URI */
+				&puri,            /* To */
+				&ms_reminder,     /* From */
+				&hdr_str,         /* Optional headers including CRLF */
+				(n<0)?&row->body:&body_str, /* Message body */
+				(ms_outbound_proxy.s)?&ms_outbound_proxy:0,
+						/* outbound uri */
+				m_tm_callback,    /* Callback function */
+				(void*)h,         /* Callback parameter */
+				NULL
+			) < 0)
+	{
+		LM_ERR("sending reminder [%lld] failed\n", (long long)mid);
+		if (ms_inflight_take(mi, h, &slot) == MS_INFLIGHT_OK)
+			msg_list_set_flag(ml, mid, MS_MSG_ERRO);
+	}
+	return 0;
 }
 
-int ms_reset_stime(t_msg_mid mid)
+void m_send_ontimer(unsigned int ticks, void *param)
 {
-	db_key_t db_keys[1];
-	db_op_t  db_ops[1];
-	db_val_t db_vals[1];
-	db_key_t db_cols[1];
-	db_val_t db_cvals[1];
+	time_t ttime;
+	time_t dumpId;
+	ms_hdr_tpl_t hdr_tpl;
+	int n;
 
-	db_keys[0]=&sc_mid;
-	db_ops[0]=OP_EQ;
+	if(ms_reminder.s==NULL)
+	{
+		LM_WARN("reminder address null\n");
+		return;
+	}
 
-	db_vals[0].type = DB_BIGINT;
-	db_vals[0].nul = 0;
-	db_vals[0].val.bigint_val = mid;
+	LM_DBG("------------ start ------------\n");
 
+	ttime = time(NULL);
+	time(&dumpId);
+	m_hdr_tpl_init(&hdr_tpl, (long) (dumpId * 1000l));
 
-	db_cols[0]=&sc_snd_time;
-	db_cvals[0].type = DB_INT;
-	db_cvals[0].nul = 0;
-	db_cvals[0].val.int_val = 0;
+	n = mss->reminders(ttime, m_send_reminder, &hdr_tpl);
+	if(n <= 0)
+		LM_DBG("no message for <%ld>!\n", (long)ttime);
+	else
+		LM_DBG("dumped [%d] messages for <%ld>!!!\n", n, (long)ttime);
 
-	LM_DBG("updating send time for [%lld]!\n", (long long) mid);
+	ms_arena_reset(&msg_arena);
+}
 
-	if (msilo_dbf.use_table(db_con, &ms_db_table) < 0)
-	{
-		LM_ERR("failed to use_table\n");
+int ms_reset_stime(t_msg_mid mid)
+{
+	if(mss->reset_stime(mid) != 0)
 		return -1;
-	}
 
-	if(msilo_dbf.update(db_con,db_keys,db_ops,db_vals,db_cols,db_cvals,1,1)!=0)
-	{
-		LM_ERR("failed to make update for [%lld]!\n", (long long)mid);
-		return -1;
-	}
+	/* the row is pending again but its AoR is unknown here */
+	ms_cache_set_incomplete_all(mc);
 	return 0;
 }
 
 /*
  * Check if REGISTER request has contacts that support MESSAGE method or
  * if MESSAGE method is listed in Allow header and contact does not have
- * methods parameter.
+ * methods parameter. The first such contact is returned in mc.
  */
-int check_message_support(struct sip_msg* msg)
+int check_message_support(struct sip_msg* msg, contact_t** mc)
 {
 	contact_t* c;
+	contact_t* plain = NULL;
 	unsigned int allow_message = 0;
 	unsigned int allow_hdr = 0;
 	str *methods_body;
 	unsigned int methods;
 
+	*mc = NULL;
+
 	/* Parse all headers in order to see all Allow headers */
 	if (parse_headers(msg, HDR_EOH_F, 0) == -1)
 	{
@@ -1530,14 +2348,18 @@ int check_message_support(struct sip_msg* msg)
 			if (methods & METHOD_MESSAGE)
 			{
 				LM_DBG("MESSAGE contact found\n");
+				*mc = c;
 				return 0;
 			}
 		} else {
 			if (allow_message)
 			{
 				LM_DBG("MESSAGE found in Allow Header\n");
+				*mc = c;
 				return 0;
 			}
+			if (plain == NULL)
+				plain = c;
 		}
 		if (contact_iterator(&c, msg, c) < 0)
 		{
@@ -1547,7 +2369,10 @@ int check_message_support(struct sip_msg* msg)
 	}
 	/* no Allow header and no methods in Contact => dump MESSAGEs */
 	if(allow_hdr==0)
+	{
+		*mc = plain;
 		return 0;
+	}
 	return -1;
 }
 
@@ -1561,21 +2386,45 @@ static int msg_process_postfork(void){
 	return 0;
 }
 
+static void sender_sigterm(int signo)
+{
+	sender_sigterm_got = 1;
+}
+
 static void msg_process(int rank)
 {
+	struct sigaction sa;
+
 	/* if this blasted server had a decent I/O loop, we'd
 	 * just add our socket to it and connect().
 	 */
 	pid = my_pid();
-	*sender_pid = pid;
+	sender_ctl->pid = pid;
 
 	LM_INFO("started child message sender process, rank: %d\n", rank);
 	sender_threads_running = 1;
 
+	// Shutdown lets the current batch finish and puts the rest back. The
+	// core handler would exit on the spot, in this process only it is
+	// replaced by one that just raises the flag sender_running() checks.
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sender_sigterm;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGTERM, &sa, NULL) < 0)
+		LM_ERR("cannot catch SIGTERM: %s\n", strerror(errno));
+
 	t_senderThreadArg arg;
 	arg.rank = rank;
 	arg.thread_id = 0;
 	sender_thread_main(&arg);
+
+	ms_arena_destroy(&msg_arena);
+
+	// Acknowledge, destroy() may be waiting.
+	pthread_mutex_lock(p_sender_thread_queue_cond_mutex);
+	sender_ctl->stopped = 1;
+	pthread_cond_broadcast(p_sender_thread_queue_cond);
+	pthread_mutex_unlock(p_sender_thread_queue_cond_mutex);
 }
 
 /**
@@ -1586,11 +2435,12 @@ static int init_sender_worker_env(void){
 	sender_threads_running = 1;
 	sender_thread_waiters = 0;
 
-	sender_pid = (int*)shm_malloc(sizeof(int));
-	if(sender_pid == NULL) {
+	sender_ctl = (t_ms_sender_ctl*)shm_malloc(sizeof(t_ms_sender_ctl));
+	if(sender_ctl == NULL) {
 		LM_ERR("No more shared memory\n");
 		return -1;
 	}
+	memset(sender_ctl, 0, sizeof(t_ms_sender_ctl));
 
 	/* Allocate memory for cond mutex attribute */
 	p_sender_thread_queue_cond_mutex_attr = (pthread_mutexattr_t *)shm_malloc(sizeof(pthread_mutexattr_t));
@@ -1665,11 +2515,13 @@ static int init_sender_worker_env(void){
 
 /**
  * Terminates running sender threads.
+ * returns 1 if the sender is still running, its shared state is kept then
  */
 static int destroy_sender_worker_env(void){
 	terminate_sender_threads();
-	// TODO: wait for termination so mutex & conditions are not destroyed before memory release.
-	sleep(1);
+	// Mutex & conditions are not destroyed under the sender.
+	if (wait_sender_stopped() > 0)
+		return 1;
 
 	// Clean up.
 	if (p_sender_thread_queue_cond_mutex != NULL) {
@@ -1696,9 +2548,9 @@ static int destroy_sender_worker_env(void){
 		p_sender_thread_queue_cond_attr = NULL;
 	}
 
-	if (sender_pid != NULL){
-		shm_free(sender_pid);
-		sender_pid = NULL;
+	if (sender_ctl != NULL){
+		shm_free(sender_ctl);
+		sender_ctl = NULL;
 	}
 
 	return 0;
@@ -1741,8 +2593,11 @@ static int spawn_sender_threads(void){
  * Sets all sender threads to terminate.
  */
 static int terminate_sender_threads(void){
-	// Running flag set to false.
+	// Running flag set to false, in this process and in the sender one.
 	sender_threads_running = 0;
+	if (sender_ctl != NULL){
+		sender_ctl->stop = 1;
+	}
 	if (p_sender_thread_queue_cond_mutex == NULL || p_sender_thread_queue_cond == NULL){
 		return -1;
 	}
@@ -1758,6 +2613,83 @@ static int terminate_sender_threads(void){
 	return 0;
 }
 
+/**
+ * Waits until the sender process acknowledges the stop, is gone or
+ * shutdown_timeout passes.
+ * returns 0 if it stopped or is gone, 1 if it is still running
+ */
+static int wait_sender_stopped(void){
+	struct timespec time_to_wait;
+	struct timeval now;
+	long waited = 0;
+	int stopped;
+
+	if (sender_ctl == NULL || p_sender_thread_queue_cond_mutex == NULL
+			|| p_sender_thread_queue_cond == NULL){
+		return -1;
+	}
+
+	pthread_mutex_lock(p_sender_thread_queue_cond_mutex);
+	while (!sender_ctl->stopped && waited < ms_shutdown_timeout)
+	{
+		// Never started or killed before it could answer.
+		if (sender_ctl->pid <= 0 || (kill(sender_ctl->pid, 0) != 0 && errno == ESRCH))
+			break;
+
+		gettimeofday(&now, NULL);
+		timespec_add_milli(&time_to_wait, &now, SENDER_THREAD_WAIT_MS);
+		pthread_cond_timedwait(p_sender_thread_queue_cond, p_sender_thread_queue_cond_mutex, &time_to_wait);
+		waited += SENDER_THREAD_WAIT_MS;
+	}
+	stopped = sender_ctl->stopped;
+	pthread_mutex_unlock(p_sender_thread_queue_cond_mutex);
+
+	if (stopped || sender_ctl->pid <= 0
+			|| (kill(sender_ctl->pid, 0) != 0 && errno == ESRCH)){
+		return 0;
+	}
+
+	LM_WARN("Sender %d did not stop in %d ms\n", sender_ctl->pid, ms_shutdown_timeout);
+	return 1;
+}
+
+/**
+ * Sender keeps going until asked to quit, by destroy() or by a signal.
+ */
+static int sender_running(void){
+	return sender_threads_running && !sender_sigterm_got
+		&& !(sender_ctl && sender_ctl->stop);
+}
+
+/**
+ * the message left the queue for good, flag is MS_MSG_DONE or MS_MSG_ERRO;
+ * its page no longer keeps the next one back
+ */
+static void m_settle(t_msg_mid mid, const t_retry_key *key, int flag){
+	msg_list_set_flag(ml, mid, flag);
+	if (key->page != NULL && ma != NULL)
+		ms_aor_page_settled(ma, key->page);
+}
+
+/**
+ * Puts elements linked by prev back to the retry queue.
+ */
+static void requeue_list_prev(retry_list_el list){
+	retry_list_el p0, next;
+
+	for(p0 = list; p0; p0 = next)
+	{
+		next = p0->prev;
+		p0->prev = NULL;
+		p0->next = NULL;
+		if (retry_push_element(rl, p0) != MSG_LIST_OK)
+		{
+			m_settle(p0->msgid, &p0->key, MS_MSG_ERRO);
+			retry_list_el_free(p0);
+		}
+	}
+}
+
 static void signal_new_task(void){
 	if (p_sender_thread_queue_cond_mutex == NULL){
 		LM_CRIT("Mutex is null");
@@ -1787,9 +2719,10 @@ static void *sender_thread_main(void *varg)
 	size_t to_peek = MAX_PEEK_NUM;
 	size_t peek_num = 0;
 	unsigned long long wait_ctr = 0;
+	int idle = 0;
 
 	// Work loop.
-	while(sender_threads_running)
+	while(sender_running())
 	{
 		retry_list_el elems = NULL;
 		int signaled = 0;
@@ -1816,16 +2749,18 @@ static void *sender_thread_main(void *varg)
 
 		sender_thread_waiters += 1;
 
-		// If queue is empty, wait for insertion signal.
-		if (retry_is_empty(rl))
+		// If nothing is due, wait for insertion signal.
+		if (idle || retry_is_empty(rl))
 		{
 			// Wait signaling, note mutex is atomically unlocked while waiting.
 			// CPU cycles are saved here since thread blocks while waiting for new jobs.
 			signaled = pthread_cond_timedwait(p_sender_thread_queue_cond, p_sender_thread_queue_cond_mutex, &time_to_wait);
 		}
 
-		// Remove given amount of elements from the retry queue atomically.
-		elems = retry_peek_n(rl, to_peek, &peek_num);
+		// Remove given amount of due elements from the retry queue atomically,
+		// deferred ones stay queued until their not_before.
+		elems = retry_peek_due(rl, to_peek, &peek_num);
+		idle = elems == NULL;
 		sender_thread_waiters -= 1;
 		wait_ctr += 1;
 
@@ -1845,17 +2780,19 @@ static void *sender_thread_main(void *varg)
 			LM_ERR("cond_timedwait returned error code: %d\n", signaled);
 		}
 
-		// If signaling ended with command to quit.
-		if (!sender_threads_running)
+		// If signaling ended with command to quit, the batch stays queued.
+		if (!sender_running())
 		{
-			msg_set_flags_all_list_prev(elems, MS_MSG_ERRO);
-			retry_list_el_free_prev_all(elems);
+			requeue_list_prev(elems);
 			elems = NULL;
 
 			LM_INFO("Sender loop break\n");
 			break;
 		}
 
+		// Next pages of paginated dumps join the queue.
+		m_page_refill();
+
 		// List to process may be empty. If is, continue with waiting.
 		if (elems == NULL)
 		{
@@ -1871,22 +2808,375 @@ static void *sender_thread_main(void *varg)
 	return NULL;
 }
 
+/** rows collected for one sender batch */
+typedef struct _ms_batch
+{
+	t_ms_row rows[MAX_PEEK_NUM];
+	int size;
+} t_ms_batch;
+
+/**
+ * copy a row loaded from the storage into the batch
+ */
+static int m_batch_add_row(ms_row row, void *param)
+{
+	t_ms_batch *batch = (t_ms_batch*)param;
+	ms_row dst;
+	char *s;
+
+	if (batch->size >= MAX_PEEK_NUM)
+		return -1;
+
+	s = ms_arena_alloc(&msg_arena, row->from.len + row->to.len
+			+ row->body.len + row->ctype.len + row->user.len + row->host.len
+			+ row->msg_type.len);
+	if (s == NULL)
+	{
+		LM_ERR("no memory to load message [%lld]\n", (long long) row->mid);
+		return 0;
+	}
+
+	dst = &batch->rows[batch->size++];
+	memset(dst, 0, sizeof(t_ms_row));
+	dst->mid = row->mid;
+	dst->inc_time = row->inc_time;
+	dst->from.s = s;
+	memcpy(s, row->from.s, row->from.len);
+	dst->from.len = row->from.len;
+	s += row->from.len;
+	dst->to.s = s;
+	memcpy(s, row->to.s, row->to.len);
+	dst->to.len = row->to.len;
+	s += row->to.len;
+	dst->body.s = s;
+	memcpy(s, row->body.s, row->body.len);
+	dst->body.len = row->body.len;
+	s += row->body.len;
+	dst->ctype.s = s;
+	memcpy(s, row->ctype.s, row->ctype.len);
+	dst->ctype.len = row->ctype.len;
+	s += row->ctype.len;
+	dst->user.s = s;
+	memcpy(s, row->user.s, row->user.len);
+	dst->user.len = row->user.len;
+	s += row->user.len;
+	dst->host.s = s;
+	memcpy(s, row->host.s, row->host.len);
+	dst->host.len = row->host.len;
+	s += row->host.len;
+	/* absent unless the message had an X-MsgType */
+	if (row->msg_type.len > 0)
+	{
+		dst->msg_type.s = s;
+		memcpy(s, row->msg_type.s, row->msg_type.len);
+		dst->msg_type.len = row->msg_type.len;
+	}
+
+	return 0;
+}
+
+/**
+ * a message left the window of its AoR, queue the held one taking over
+ */
+static void m_window_next(ms_aor a, retry_list_el resend)
+{
+	retry_list_el next = ms_aor_win_release(ma, a, resend);
+
+	if (next != NULL)
+	{
+		retry_push_element(rl, next);
+		signal_new_task();
+	}
+}
+
+/** messages of one AoR and sender sent together, see m_send_group() */
+typedef struct _ms_group
+{
+	int n;
+	int max;
+	ms_row rows[MAX_PEEK_NUM];
+	retry_list_el els[MAX_PEEK_NUM];
+} t_ms_group;
+
+/**
+ * group still taking messages for the AoR of row from the same sender,
+ * NULL if none is; the MESSAGE carries one From for all of them
+ */
+static t_ms_group *m_group_find(t_ms_group *groups, int ngroups, ms_row row)
+{
+	ms_row first;
+	int i;
+
+	for(i = 0; i < ngroups; i++)
+	{
+		if (groups[i].n <= 0)
+			continue;
+		first = groups[i].rows[0];
+		if (first->user.len == row->user.len && first->host.len == row->host.len
+				&& first->from.len == row->from.len
+				&& strncmp(first->user.s, row->user.s, row->user.len) == 0
+				&& strncasecmp(first->host.s, row->host.s, row->host.len) == 0
+				&& strncmp(first->from.s, row->from.s, row->from.len) == 0)
+			return &groups[i];
+	}
+
+	return NULL;
+}
+
+static t_ms_group *m_group_new(t_ms_group *groups, int *ngroups, int max)
+{
+	groups[*ngroups].n = 0;
+	groups[*ngroups].max = max < MAX_PEEK_NUM ? max : MAX_PEEK_NUM;
+	return &groups[(*ngroups)++];
+}
+
+/**
+ * build headers and body of one stored message into the arena, the body
+ * is the stored one when it cannot be composed
+ */
+static int m_build_msg(ms_row row, const ms_hdr_tpl_t *hdr_tpl, str *hdr_str,
+		str *body_str)
+{
+	// One buffer per message sized from the row, headers first, body right after.
+	hdr_str->len = m_build_headers_len(hdr_tpl, row->ctype, row->from, row->inc_time);
+	body_str->len = m_build_body_len(row->body);
+	hdr_str->s = ms_arena_alloc(&msg_arena, hdr_str->len + (body_str->len > 0 ? body_str->len : 0));
+	if (hdr_str->s == NULL)
+	{
+		LM_ERR("resend: no memory to build message [%lld]\n", (long long) row->mid);
+		return -1;
+	}
+	body_str->s = hdr_str->s + hdr_str->len;
+
+	if(m_build_headers(hdr_str, hdr_tpl, row->ctype, row->from,
+					   row->inc_time /*Date*/) < 0)
+	{
+		LM_ERR("resend: headers building failed [%lld]\n", (long long) row->mid);
+		return -1;
+	}
+
+	if (body_str->len <= 0
+			|| m_build_body(body_str, row->inc_time, row->body, 0,
+				m_date_fmt(&row->msg_type)) < 0)
+	{
+		LM_DBG("resend: sending simple body\n");
+		*body_str = row->body;
+	}
+	else
+	{
+		LM_DBG("resend: sending composed body\n");
+	}
+
+	return 0;
+}
+
+/**
+ * route to the registered contact: through its Path, the first hop as the
+ * outbound uri and the whole Path as Route, or to its received address
+ */
+static int m_direct_route(str *hdr_str, str *contact, str *received,
+		str *path, str *hop, str **obu)
+{
+	char *p, *b, *e;
+
+	if (path->len <= 0)
+	{
+		if (received->len > 0)
+			*obu = received;
+		return 0;
+	}
+
+	b = memchr(path->s, '<', path->len);
+	e = b ? memchr(b, '>', path->len - (b - path->s)) : NULL;
+	if (e == NULL)
+	{
+		LM_DBG("bad Path <%.*s> of <%.*s>\n", path->len, path->s,
+				contact->len, contact->s);
+		return -1;
+	}
+
+	p = ms_arena_alloc(&msg_arena, MS_ROUTE_PREFIX_LEN + path->len + CRLF_LEN
+			+ hdr_str->len);
+	if (p == NULL)
+		return -1;
+	memcpy(p, MS_ROUTE_PREFIX, MS_ROUTE_PREFIX_LEN);
+	memcpy(p + MS_ROUTE_PREFIX_LEN, path->s, path->len);
+	memcpy(p + MS_ROUTE_PREFIX_LEN + path->len, CRLF, CRLF_LEN);
+	memcpy(p + MS_ROUTE_PREFIX_LEN + path->len + CRLF_LEN, hdr_str->s, hdr_str->len);
+	hdr_str->s = p;
+	hdr_str->len += MS_ROUTE_PREFIX_LEN + path->len + CRLF_LEN;
+
+	hop->s = b + 1;
+	hop->len = e - b - 1;
+	*obu = hop;
+	return 0;
+}
+
+/**
+ * send messages of one AoR; more than one go as the parts of a single
+ * multipart/mixed MESSAGE, each part with the headers it would have been
+ * sent with, and the reply settles all of them
+ * - the elements are freed, their state goes to the in-flight table
+ */
+static int m_send_group(ms_row *rows, retry_list_el *els, int n,
+		const ms_hdr_tpl_t *hdr_tpl)
+{
+	str hdr_str, body_str, part;
+	str part_hdr[MAX_PEEK_NUM], part_body[MAX_PEEK_NUM];
+	str boundary, ctype, no_contact = {NULL, 0};
+	str contact, received, path, hop, *ruri, *obu;
+	t_ms_inflight_slot slot;
+	ms_inflight_h h, head = 0;
+	char *p;
+	int i, len, res;
+
+	if (n == 1)
+	{
+		if (m_build_msg(rows[0], hdr_tpl, &hdr_str, &body_str) < 0)
+			goto error;
+	}
+	else
+	{
+		boundary.s = ms_arena_alloc(&msg_arena, MS_BOUNDARY_MAX_LEN);
+		if (boundary.s == NULL)
+			goto error;
+		boundary.len = snprintf(boundary.s, MS_BOUNDARY_MAX_LEN, "msilo-%ld-%lld",
+				hdr_tpl->dump_id, (long long) rows[0]->mid);
+
+		len = 0;
+		for(i = 0; i < n; i++)
+		{
+			if (m_build_msg(rows[i], hdr_tpl, &part_hdr[i], &part_body[i]) < 0)
+				goto error;
+			len += m_build_part_len(boundary, part_hdr[i], part_body[i], i == n-1);
+		}
+
+		ctype.len = MS_MULTIPART_LEN + boundary.len;
+		hdr_str.len = m_build_headers_len(hdr_tpl, ctype, no_contact, 0);
+		p = ms_arena_alloc(&msg_arena, ctype.len + hdr_str.len + len);
+		if (p == NULL)
+		{
+			LM_ERR("resend: no memory to batch [%d] messages\n", n);
+			goto error;
+		}
+		ctype.s = p;
+		memcpy(p, MS_MULTIPART, MS_MULTIPART_LEN);
+		memcpy(p + MS_MULTIPART_LEN, boundary.s, boundary.len);
+		hdr_str.s = p + ctype.len;
+		if (m_build_headers(&hdr_str, hdr_tpl, ctype, no_contact, 0) < 0)
+			goto error;
+
+		body_str.s = hdr_str.s + hdr_str.len;
+		p = body_str.s;
+		for(i = 0; i < n; i++)
+		{
+			part.s = p;
+			part.len = len - (int)(p - body_str.s);
+			if (m_build_part(&part, boundary, part_hdr[i], part_body[i], i == n-1) < 0)
+				goto error;
+			p += part.len;
+		}
+		body_str.len = (int)(p - body_str.s);
+	}
+
+	// The first message carries the others, its reply settles them all.
+	h = 0;
+	for(i = n - 1; i >= 0; i--)
+	{
+		if ((h = ms_inflight_put(mi, els[i], 0, h)) == 0)
+		{
+			LM_ERR("resend: more than [%d] messages in flight\n", mi->size);
+			for(i++; i < n; i++)
+			{
+				ms_inflight_take(mi, head, &slot);
+				head = slot.next;
+			}
+			goto error;
+		}
+		head = h;
+	}
+	for(i = 0; i < n; i++)
+		retry_list_el_free(els[i]);
+
+	// Straight to the device that registered, routing by To otherwise.
+	ruri = &rows[0]->to;
+	obu = (ms_outbound_proxy.s) ? &ms_outbound_proxy : 0;
+	if (ms_direct_delivery && ma != NULL
+			&& ms_aor_get_contact(ma, &rows[0]->user, &rows[0]->host, time(NULL),
+				&contact, &received, &path, &msg_arena) == MS_AOR_OK
+			&& m_direct_route(&hdr_str, &contact, &received, &path, &hop, &obu) == 0)
+	{
+		ruri = &contact;
+#ifdef STATISTICS
+		update_stat(ms_direct_msgs, 1);
+#endif
+	}
+
+	LM_DBG("resend: [%d] msg from [%lld] for: %.*s\n", n, (long long) rows[0]->mid,
+			ruri->len, ruri->s);
+
+	/** sending using TM function: t_uac */
+	res = tmb.t_request(&msg_type,  /* Type of the message */
+						ruri,             /* Request-URI */
+						&rows[0]->to,     /* To */
+						&rows[0]->from,   /* From */
+						&hdr_str,         /* Optional headers including CRLF */
+						&body_str,        /* Message body */
+						obu,              /* outbound uri */
+						m_tm_callback,    /* Callback function */
+						(void*)h,         /* Callback parameter */
+						NULL
+	);
+
+	if (res < 0){
+		LM_WARN("resend: message sending failed [%lld], res=%d messages for <%.*s>!\n",
+				(long long) rows[0]->mid, res, rows[0]->to.len, rows[0]->to.s);
+
+		// No reply will come to free the slots.
+		while(h && ms_inflight_take(mi, h, &slot) == MS_INFLIGHT_OK)
+		{
+			m_settle(slot.mid, &slot.key, MS_MSG_ERRO);
+			if (slot.aor)
+				m_window_next(slot.aor, NULL);
+			h = slot.next;
+		}
+		return -1;
+	}
+
+#ifdef STATISTICS
+	if (n > 1)
+		update_stat(ms_batched_msgs, n);
+#endif
+	return 0;
+
+error:
+	for(i = 0; i < n; i++)
+	{
+		m_settle(rows[i]->mid, &els[i]->key, MS_MSG_ERRO);
+		if (els[i]->aor)
+			m_window_next(els[i]->aor, NULL);
+		retry_list_el_free(els[i]);
+	}
+	return -1;
+}
+
 static int send_messages(retry_list_el list)
 {
-	db_res_t* db_res = NULL;
 	int i, n;
-	char hdr_buf[MSG_HDR_BUFF_LEN];
-	char body_buf[MSG_BODY_BUFF_LEN];
-
-	char sql_query[PH_SQL_BUF_LEN];
-	str sql_str;
 
-	str str_vals[4], hdr_str , body_str;
-	time_t rtime;
 	time_t dump_id;
+	ms_hdr_tpl_t hdr_tpl;
 
 	t_msg_mid mids_to_load[MAX_PEEK_NUM];
 	size_t mids_to_load_size = 0;
+	size_t batch_size = 0;
+	long long wait_ms = 0;
+	t_ms_batch batch;
+	t_ms_row *rows = batch.rows;
+	static t_retry_index list_index;
+	t_ms_group groups[MAX_PEEK_NUM];
+	int ngroups = 0;
+	t_ms_group *g;
 
 	// Logic.
 	if (list == NULL){
@@ -1898,7 +3188,7 @@ static int send_messages(retry_list_el list)
 	// Usually the first message determines the waiting time for the whole bunch.
 	// It is better to wait here than during SQL result set processing for each message
 	// since no SQL-related resources are blocked.
-	unsigned long time_slept = wait_not_before(list->not_before);
+	unsigned long time_slept = wait_not_before(list->not_before_ms);
 	time(&dump_id);
 
 	if (time_slept > 0)
@@ -1907,181 +3197,255 @@ static int send_messages(retry_list_el list)
 				time_slept, (long)list->not_before, (long)dump_id, (long)(dump_id - list->not_before), (long long) list->msgid);
 	}
 
-	// Load message with given MID from database.
-	// Need to clone the list as the original list may got deallocated by tx_callbacks
-	// When message transaction finishes.
-	retry_list_el list_cloned = retry_clone_elements_prev_local(list);
-	retry_list_el p0 = list_cloned;
-	while(p0 && mids_to_load_size < MAX_PEEK_NUM)
+	// Load message with given MID from the cache or the database.
+	// The elements are ours, each one is indexed until it is sent, queued
+	// again, held or dropped.
+	retry_list_el p0 = list, p_next;
+	size_t pos = 0;
+	retry_index_reset(&list_index);
+	while(p0 && batch_size < MAX_PEEK_NUM)
 	{
-		mids_to_load[mids_to_load_size++] = p0->msgid;
-		p0 = p0->prev;
+		batch_size++;
+		p_next = p0->prev;
+		p0->next = NULL;
+		p0->prev = NULL;
+
+		// Expired while queued, or will before it gets out, not worth a fetch.
+		if (m_expiring(p0->key.exp_time, p0->not_before))
+		{
+			LM_DBG("message <%lld> expires at %ld, dropping\n",
+					(long long) p0->msgid, (long) p0->key.exp_time);
+			m_settle(p0->msgid, &p0->key, MS_MSG_ERRO);
+			if (p0->aor)
+				m_window_next(p0->aor, NULL);
+			retry_list_el_free(p0);
+#ifdef STATISTICS
+			update_stat(ms_expired_msgs, 1);
+#endif
+		}
+		else if (retry_index_put(&list_index, p0) != MSG_LIST_OK)
+		{
+			LM_CRIT("Could not index message <%lld>\n", (long long) p0->msgid);
+			m_settle(p0->msgid, &p0->key, MS_MSG_ERRO);
+			if (p0->aor)
+				m_window_next(p0->aor, NULL);
+			retry_list_el_free(p0);
+		}
+		else if (mc != NULL && ms_cache_get(mc, p0->msgid, &rows[batch.size], &msg_arena) == MS_CACHE_OK)
+		{
+			batch.size++;
+#ifdef STATISTICS
+			update_stat(ms_cache_row_hits, 1);
+#endif
+		}
+		else
+		{
+			mids_to_load[mids_to_load_size++] = p0->msgid;
+#ifdef STATISTICS
+			if (mc != NULL)
+				update_stat(ms_cache_row_misses, 1);
+#endif
+		}
+		p0 = p_next;
 
 		// Invariant faikure detection. peek() on retry list should be always terminated on both ends by NULLs.
-		if (mids_to_load_size >= MAX_PEEK_NUM && p0 != NULL)
+		if (batch_size >= MAX_PEEK_NUM && p0 != NULL)
 		{
-			LM_CRIT("List is not ended with prev=NULL, toLoad: %d, p: %p\n", (int) mids_to_load_size, p0);
+			LM_CRIT("List is not ended with prev=NULL, toLoad: %d, p: %p\n", (int) batch_size, p0);
 			break;
 		}
 	}
 
-	hdr_str.s=hdr_buf;
-	hdr_str.len=MSG_HDR_BUFF_LEN;
-	body_str.s=body_buf;
-	body_str.len=MSG_BODY_BUFF_LEN;
-
-	if (build_sql_query(sql_query, &sql_str, mids_to_load, mids_to_load_size) < 0)
-	{
-		LM_CRIT("Could not build sql string\n");
-		goto error;
-	}
+	m_hdr_tpl_init(&hdr_tpl, (long) (dump_id * 1000l));
 
-	if (msilo_dbf.use_table(db_con, &ms_db_table) < 0)
+	// Rows missing in the cache come from the storage.
+	if (mids_to_load_size > 0
+			&& mss->load(mids_to_load, mids_to_load_size, m_batch_add_row, &batch) <= 0)
 	{
-		LM_ERR("failed to use_table\n");
-		goto error;
+		LM_DBG("no stored messages for size=%d!\n", (int) mids_to_load_size);
 	}
 
-	if((msilo_dbf.raw_query(db_con, &sql_str, &db_res)!=0) || (RES_ROW_N(db_res) <= 0))
+	// Keep the id order of the stored messages across cache and storage rows.
+	for(i = 1; i < batch.size; i++)
 	{
-		LM_DBG("no stored messages for size=%d!\n", (int) mids_to_load_size);
-		msg_set_flags_all_list_prev(list, MS_MSG_ERRO);
-		retry_list_el_free_prev_all(list);
-		list = NULL;
-		goto done;
+		t_ms_row tmp = rows[i];
+		for(n = i; n > 0 && rows[n-1].mid > tmp.mid; n--)
+			rows[n] = rows[n-1];
+		rows[n] = tmp;
 	}
 
-	LM_INFO("resend: dumping [%d] messages for size: %d\n",  RES_ROW_N(db_res), (int) mids_to_load_size);
-	for(i = 0; i < RES_ROW_N(db_res); i++)
+	LM_INFO("resend: dumping [%d] messages for size: %d\n", batch.size, (int) batch_size);
+	for(i = 0; i < batch.size; i++)
 	{
-		retry_list_el p1 = list_cloned;
-
-		int find_iter = 0;
-		const t_msg_mid mid = RES_ROWS(db_res)[i].values[0].val.bigint_val;
+		ms_row row = &rows[i];
+		const t_msg_mid mid = row->mid;
 
 		// Find this mid in the list.
-		while(p1)
-		{
-			if (p1->msgid == mid)
-			{
-				break;
-			}
-			find_iter += 1;
-			p1 = p1->prev;
-		}
+		retry_list_el p1 = retry_index_take(&list_index, mid);
 
-		// This happened prior list cloning approach as tx_callback released list nodes while
-		// this loop was processing data. Cloning is neccessary though.
 		if (p1 == NULL)
 		{
-			LM_CRIT("Message loaded from DB not found in list: <%lld>, find_iter: [%d]\n", (long long) mid, find_iter);
-			msg_list_set_flag(ml, mid, MS_MSG_ERRO);
-			continue;
-		}
-
-		if (p1->clone == NULL)
-		{
-			LM_CRIT("Message loaded from DB has no cloned record <%lld>, %p, find_iter: [%d]\n", (long long) mid, p1, find_iter);
+			LM_CRIT("Message loaded from DB not found in list: <%lld>\n", (long long) mid);
 			msg_list_set_flag(ml, mid, MS_MSG_ERRO);
+#ifdef STATISTICS
+			update_stat(ms_unmatched_rows, 1);
+#endif
 			continue;
 		}
 
 		// Waiting for not-before so message is sent no earlier than necessary / required.
-		time_slept = wait_not_before(p1->not_before);
+		time_slept = wait_not_before(p1->not_before_ms);
 		if (time_slept > 0)
 		{
 			LM_INFO("Slept during sending: %lu iterations, not_before: %ld, mid: %lld\n", time_slept, (long)p1->not_before, (long long)mid);
 		}
 
-		// Remove bounds for original
-		p1->clone->next = NULL;
-		p1->clone->prev = NULL;
-		p1->clone->clone = NULL;
-
-		memset(str_vals, 0, 4*sizeof(str));
-		SET_STR_VAL(str_vals[0], db_res, i, 1); /* from */
-		SET_STR_VAL(str_vals[1], db_res, i, 2); /* to */
-		SET_STR_VAL(str_vals[2], db_res, i, 3); /* body */
-		SET_STR_VAL(str_vals[3], db_res, i, 4); /* ctype */
-		rtime = (time_t)RES_ROWS(db_res)[i].values[5/*inc time*/].val.bigint_val;
-
-		hdr_str.len = MSG_HDR_BUFF_LEN;
-		if(m_build_headers(&hdr_str, str_vals[3] /*ctype*/,
-						   str_vals[0]/*from*/, rtime /*Date*/, (long) (dump_id * 1000l)) < 0)
+		// The AoR failed as unreachable, the message waits for its next dump.
+		if (ma != NULL && row->user.len > 0
+				&& ms_aor_unreachable(ma, &row->user, &row->host, time(NULL)))
 		{
-			LM_ERR("resend: headers building failed [%lld]\n", (long long) mid);
-			if (msilo_dbf.free_result(db_con, db_res) < 0)
-			{
-				LM_ERR("resend: failed to free the query result\n");
-			}
+			LM_DBG("resend: message [%lld] aborted, AoR unreachable\n", (long long) mid);
+			m_settle(mid, &p1->key, MS_MSG_ERRO);
+			if (p1->aor)
+				m_window_next(p1->aor, NULL);
+			retry_list_el_free(p1);
+#ifdef STATISTICS
+			update_stat(ms_aborted_msgs, 1);
+#endif
+			continue;
+		}
 
-			msg_list_set_flag(ml, mid, MS_MSG_ERRO);
+		// Over the rate of the AoR or its domain the message goes back to the
+		// queue, due when the bucket has a token again.
+		if (ma != NULL && p1->aor == NULL && row->user.len > 0
+				&& (ms_aor_rate.rate > 0 || ms_domain_rate.rate > 0)
+				&& ms_aor_rate_take(ma, &row->user, &row->host, &ms_aor_rate,
+						&ms_domain_rate, &wait_ms) == MS_AOR_DEFER)
+		{
+			LM_DBG("resend: message [%lld] deferred by %lld ms\n", (long long) mid, wait_ms);
+			p1->not_before_ms = retry_now_ms() + wait_ms;
+			p1->not_before = (time_t)((p1->not_before_ms + 999) / 1000);
+			retry_push_element(rl, p1);
+#ifdef STATISTICS
+			update_stat(ms_rate_deferred, 1);
+#endif
 			continue;
 		}
 
-		LM_DBG("resend: msg [%d-%lld] for: %.*s\n", i+1, (long long) mid, str_vals[1].len, str_vals[1].s);
+		// A MESSAGE takes one window slot, however many messages it carries.
+		g = NULL;
+		if (p1->key.batch > 1)
+			g = m_group_find(groups, ngroups, row);
 
-		/** sending using TM function: t_uac */
-		body_str.len = MSG_BODY_BUFF_LEN;
-		n = m_build_body(&body_str, rtime, str_vals[2/*body*/], 0);
-		if(n<0)
+		// Over the window of the AoR the message waits for an earlier reply.
+		if (g == NULL && ma != NULL && p1->aor == NULL && row->user.len > 0
+				&& ms_aor_win_acquire(ma, &row->user, &row->host, p1,
+						ms_window) == MS_AOR_HELD)
 		{
-			LM_DBG("resend: sending simple body\n");
+			LM_DBG("resend: message [%lld] held by the window\n", (long long) mid);
+			continue;
 		}
-		else
+
+		// An AoR taking batches gets its messages of this batch in one MESSAGE.
+		if (p1->key.batch > 1)
 		{
-			LM_DBG("resend: sending composed body\n");
+			if (g == NULL)
+				g = m_group_new(groups, &ngroups, p1->key.batch);
+			g->rows[g->n] = row;
+			g->els[g->n++] = p1;
+			if (g->n >= g->max)
+			{
+				m_send_group(g->rows, g->els, g->n, &hdr_tpl);
+				g->n = 0;
+			}
+			continue;
 		}
 
-		int res = tmb.t_request(&msg_type,  /* Type of the message */
-								&str_vals[1],     /* Request-URI (To) */
-								&str_vals[1],     /* To */
-								&str_vals[0],     /* From */
-								&hdr_str,         /* Optional headers including CRLF */
-								(n<0)?&str_vals[2]:&body_str, /* Message body */
-								(ms_outbound_proxy.s)?&ms_outbound_proxy:0, /* outbound uri */
-								m_tm_callback,    /* Callback function */
-								(void*)p1->clone, /* Callback parameter */
-								NULL
-		);
-
-		if (res < 0){
-			LM_WARN("resend: message sending failed [%lld], res=%d messages for <%.*s>!\n",
-					(long long) mid, res, str_vals[1].len, str_vals[1].s);
+		m_send_group(&row, &p1, 1, &hdr_tpl);
+	}
 
-			msg_list_set_flag(ml, mid, MS_MSG_ERRO);
-		}
+	// Groups not filled up by this batch.
+	for(i = 0; i < ngroups; i++)
+	{
+		if (groups[i].n > 0)
+			m_send_group(groups[i].rows, groups[i].els, groups[i].n, &hdr_tpl);
 	}
 
-	// Messages not found in the database are removed from retry queue
+	// Messages not found in the cache nor the database are removed from retry queue
 	// since its record gets lost.
-
-done:
-	// Remove cloned list.
-	retry_list_el_free_prev_all(list_cloned);
-	list_cloned = NULL;
-
-	/**
-	 * Free the result because we don't need it
-	 * anymore
-	 */
-	if (db_res!=NULL && msilo_dbf.free_result(db_con, db_res) < 0)
+	while((p0 = retry_index_next(&list_index, &pos)) != NULL)
 	{
-		LM_ERR("resend: failed to free result of query\n");
+		LM_DBG("message <%lld> not loaded, dropping\n", (long long) p0->msgid);
+		m_settle(p0->msgid, &p0->key, MS_MSG_ERRO);
+		if (p0->aor)
+			m_window_next(p0->aor, NULL);
+		retry_list_el_free(p0);
 	}
 
+	// TM has its own copy of everything built for this batch.
+	ms_arena_reset(&msg_arena);
+
 	return 1;
-error:
-	// Set all messages in the list to error so they are re-sent in the next registration.
-	msg_set_flags_all_list_prev(list, MS_MSG_ERRO);
+}
 
-	// On error cleanup memoy for all lists.
-	retry_list_el_free_prev_all(list);
-	retry_list_el_free_prev_all(list_cloned);
-	list = NULL;
-	list_cloned = NULL;
-	return -1;
+/**
+ * settle one message by the final reply of the MESSAGE that carried it,
+ * paused - the failure paused the AoR
+ */
+static void m_tm_reply(ms_inflight_slot cur, int code, int action, int paused)
+{
+	retry_list_el resend = NULL;
+	time_t not_before;
+
+	if(code >= 300)
+	{
+		int should_resend = !paused && action == MS_RACT_RETRY
+			&& cur->retry_ctr < ms_retry_count;
+		LM_INFO("message <%lld> was not sent successfully, resendCtr: %d, should_resend: %d\n",
+				(long long)cur->mid, cur->retry_ctr, should_resend);
+
+		// Spread the attempts out, a device that just went away is not back yet.
+		not_before = time(NULL) + ms_backoff_delay(
+				&ms_backoff[ms_response_class(code)], cur->retry_ctr);
+
+		if (should_resend && cur->aor)
+		{
+			// Resent ahead of the later messages held by the window.
+			resend = retry_list_el_new();
+			if (resend)
+			{
+				resend->msgid = cur->mid;
+				resend->flag |= MS_MSG_SENT;
+				resend->retry_ctr = cur->retry_ctr + 1;
+				resend->not_before = not_before;
+				resend->key = cur->key;
+			}
+			else
+			{
+				m_settle(cur->mid, &cur->key, MS_MSG_ERRO);
+			}
+		}
+		else if (should_resend)
+		{
+			retry_add_element(rl, cur->mid, cur->retry_ctr + 1, not_before,
+					&cur->key);
+			signal_new_task();
+		}
+		else
+		{
+			m_settle(cur->mid, &cur->key, MS_MSG_ERRO);
+		}
+	}
+	else
+	{
+		// By seting DONE cleaning thread will remove it from the list and from the database.
+		LM_INFO("message <%lld> was sent successfully\n", (long long)cur->mid);
+		m_settle(cur->mid, &cur->key, MS_MSG_DONE);
+	}
 
+	// The reply frees the window slot for the next message of the AoR.
+	if (cur->aor)
+		m_window_next(cur->aor, resend);
 }
 
 /**
@@ -2089,113 +3453,80 @@ error:
  */
 void m_tm_callback( struct cell *t, int type, struct tmcb_params *ps)
 {
-	retry_list_el cur_elem = NULL;
-	if(ps->param==NULL)
+	t_ms_inflight_slot cur;
+	ms_inflight_h h;
+	retry_list_el held, p0;
+	int action = MS_RACT_GIVEUP;
+	int paused = 0;
+	if(ps->param==NULL || *ps->param==NULL)
 	{
 		LM_INFO("message id not received\n");
 		goto done;
 	}
 
-	cur_elem = *((retry_list_el*)ps->param);
+	h = (ms_inflight_h)*ps->param;
+	if (ms_inflight_take(mi, h, &cur) != MS_INFLIGHT_OK)
+	{
+		LM_ERR("stale in-flight handle %lu, reply %d ignored\n", h, ps->code);
+		goto done;
+	}
 
-	LM_INFO("completed with status %d [mid: %lld]\n", ps->code, (long long) cur_elem->msgid);
-	if(!db_con)
+	LM_INFO("completed with status %d [mid: %lld]\n", ps->code, (long long) cur.mid);
+	if (cur.flags & MS_INFLIGHT_REMINDER)
 	{
-		LM_ERR("db_con is NULL\n");
+		msg_list_set_flag(ml, cur.mid, ps->code < 300 ? MS_MSG_DONE : MS_MSG_ERRO);
 		goto done;
 	}
+
 	if(ps->code >= 300)
 	{
-		int should_resend = cur_elem->retry_ctr < ms_retry_count;
-		LM_INFO("message <%lld> was not sent successfully, resendCtr: %d, should_resend: %d\n",
-				(long long)cur_elem->msgid, cur_elem->retry_ctr, should_resend);
+		action = ms_resp_action(&ms_resp_table, ps->code);
 
-		if (should_resend)
-		{
-			retry_add_element(rl, cur_elem->msgid, cur_elem->retry_ctr + 1, 0);
-			signal_new_task();
-		}
-		else
+		// The rest of the AoR would fail the same way, it waits for the next
+		// REGISTER. Messages already in flight finish on their own.
+		if (action != MS_RACT_GIVEUP && cur.aor
+				&& ms_aor_failed(ma, cur.aor, action == MS_RACT_ABORT,
+					ms_breaker_failures, time(NULL) + (action == MS_RACT_ABORT
+						? ms_unreachable_time : ms_breaker_cooldown),
+					&held) == MS_AOR_PAUSED)
 		{
-			msg_list_set_flag(ml, cur_elem->msgid, MS_MSG_ERRO);
+			paused = 1;
+			while (held)
+			{
+				p0 = held;
+				held = held->next;
+				m_settle(p0->msgid, &p0->key, MS_MSG_ERRO);
+				retry_list_el_free(p0);
+#ifdef STATISTICS
+				update_stat(ms_aborted_msgs, 1);
+#endif
+			}
 		}
-
-		// Free SHM memory.
-		retry_list_el_free(cur_elem);
-		cur_elem = NULL;
-
-		goto done;
+	}
+	else if (cur.aor)
+	{
+		ms_aor_succeeded(ma, cur.aor);
 	}
 
-	// By seting DONE cleaning thread will remove it from the list and from the database.
-	LM_INFO("message <%lld> was sent successfully\n", (long long)cur_elem->msgid);
-	msg_list_set_flag(ml, cur_elem->msgid, MS_MSG_DONE);
-
-	// Free SHM memory.
-	retry_list_el_free(cur_elem);
-	cur_elem = NULL;
+	// A batched MESSAGE settles every message it carried.
+	while (1)
+	{
+		h = cur.next;
+		m_tm_reply(&cur, ps->code, action, paused);
+		if (h == 0 || ms_inflight_take(mi, h, &cur) != MS_INFLIGHT_OK)
+			break;
+	}
 
 	done:
 	return;
 }
 
-/**
- * Builds SQL Query string sql_str, using sql_query buffer. Constructs SELECT query to load all
- * messages for sending with specified message ids.
- */
-static int build_sql_query(char *sql_query, str *sql_str, t_msg_mid *mids_to_load, size_t mids_to_load_size)
-{
-	int off = 0, ret = 0, i = 0;
-	ret = snprintf(sql_query, PH_SQL_BUF_LEN, "SELECT `%.*s`, `%.*s`, `%.*s`, `%.*s`, `%.*s`, `%.*s` FROM `%.*s` WHERE ",
-				   sc_mid.len, sc_mid.s,
-				   sc_from.len, sc_from.s,
-				   sc_to.len, sc_to.s,
-				   sc_body.len, sc_body.s,
-				   sc_ctype.len, sc_ctype.s,
-				   sc_inc_time.len, sc_inc_time.s,
-				   ms_db_table.len, ms_db_table.s);
-	if (ret < 0 || ret >= PH_SQL_BUF_LEN) goto error;
-	off = ret;
-
-	// WHERE conditions.
-	for(i = 0; i < mids_to_load_size; i++){
-		ret = snprintf(sql_query + off, PH_SQL_BUF_LEN - off, " `%.*s`=%lld ", sc_mid.len, sc_mid.s, (long long) mids_to_load[i]);
-		if (ret < 0 || ret >= (PH_SQL_BUF_LEN - off)) goto error;
-		off += ret;
-
-		if (i+1 < mids_to_load_size){
-			ret = snprintf(sql_query + off, PH_SQL_BUF_LEN - off, " OR ");
-			if (ret < 0 || ret >= (PH_SQL_BUF_LEN - off)) goto error;
-			off += ret;
-		}
-	}
-
-	ret = snprintf(sql_query + off, PH_SQL_BUF_LEN - off, " ORDER BY `%.*s`", sc_mid.len, sc_mid.s);
-	if (ret < 0 || ret >= (PH_SQL_BUF_LEN - off)) goto error;
-	off += ret;
-
-	// Null terminate.
-	if (off + 1 >= PH_SQL_BUF_LEN) goto error;
-	sql_query[off + 1] = '\0';
-	sql_str->s = sql_query;
-	sql_str->len = off;
-
-	return 0;
-error:
-	return -1;
-}
-
-/**
- * Waits until time is reached, checking sender cancellation.
- */
-static unsigned long wait_not_before(time_t not_before)
+static unsigned long wait_not_before(long long not_before_ms)
 {
 	unsigned long wait_iter = 0;
-	while(sender_threads_running)
+	while(sender_running())
 	{
-		time_t send_time;
-		time(&send_time);
-		if (not_before > send_time)
+		if (not_before_ms > retry_now_ms())
 		{
 			wait_iter += 1;
 			usleep(50l*1000l);